@@ -1,7 +1,7 @@
 {
   "targets": [{
     "target_name": "picam360", 
-    "sources": ["omxcv_jpeg.cpp", "omxcv.cpp", "gl_transform.cc", "capture.c", "picam360_tools.cc", "picam360.cc"],
+    "sources": ["omxcv_jpeg.cpp", "omxcv.cpp", "gl_transform.cc", "capture.c", "mjpeg.c", "group.c", "fanout.c", "picam360_tools.cc", "picam360.cc"],
     "cflags": ["-Wall", "-Wextra", "-pedantic"],
     "cflags_c": ["-std=c11", "-Wno-unused-parameter"], 
     "cflags_cc": ["-std=c++11", "-fexceptions"],
@@ -40,6 +40,7 @@
 					"-lGLESv2",
 					"-lavformat",
 					"-lavcodec",
-					"-lavutil"]
+					"-lavutil",
+					"-ljpeg"]
   }]
 }
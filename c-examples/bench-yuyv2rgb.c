@@ -0,0 +1,85 @@
+// yuyv2rgb throughput of each kernel available on this cpu,
+// then of the band-parallel conversion for 1..threads workers
+// usage: bench-yuyv2rgb [width height [iterations [threads]]]
+#define _GNU_SOURCE
+#include "../capture.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char* argv[])
+{
+  uint32_t width = argc > 2 ? atoi(argv[1]) : 2048;
+  uint32_t height = argc > 2 ? atoi(argv[2]) : 1024;
+  int iterations = argc > 3 ? atoi(argv[3]) : 50;
+  int threads = argc > 4 ? atoi(argv[4]) : 4;
+  if (width == 0 || width % 2 || height == 0 || iterations <= 0 || 
+      threads <= 0) {
+    fprintf(stderr, "usage: %s [width height [iterations [threads]]]\n", 
+            argv[0]);
+    return 1;
+  }
+
+  size_t yuyv_size = (size_t) width * height * 2;
+  size_t rgb_size = (size_t) width * height * 3;
+  uint8_t* yuyv = malloc(yuyv_size);
+  uint8_t* expect = malloc(rgb_size);
+  uint8_t* rgb = malloc(rgb_size);
+  srand(360);
+  for (size_t i = 0; i < yuyv_size; i++) yuyv[i] = rand() & 0xff;
+
+  const camera_yuyv2rgb_kernel_t* kernels;
+  size_t count = camera_yuyv2rgb_kernels(&kernels);
+  camera_yuyv2rgb_row_t scalar = kernels[count - 1].row;
+  for (uint32_t i = 0; i < height; i++) {
+    scalar(yuyv + i * width * 2, expect + i * width * 3, width);
+  }
+
+  printf("%ux%u, %d iterations\n", width, height, iterations);
+  for (size_t k = 0; k < count; k++) {
+    memset(rgb, 0, rgb_size);
+    double start = now();
+    for (int n = 0; n < iterations; n++) {
+      for (uint32_t i = 0; i < height; i++) {
+        kernels[k].row(yuyv + i * width * 2, rgb + i * width * 3, width);
+      }
+    }
+    double elapsed = now() - start;
+    bool same = memcmp(rgb, expect, rgb_size) == 0;
+    printf("%-8s %8.1f Mpixel/s %s\n", kernels[k].name, 
+           (double) width * height * iterations / elapsed / 1e6,
+           same ? "" : "MISMATCH");
+  }
+
+  for (int t = 1; t <= threads; t++) {
+    camera_workers_t* workers = camera_workers_new(t);
+    if (workers == NULL) {
+      fprintf(stderr, "cannot create %d threads\n", t);
+      break;
+    }
+    memset(rgb, 0, rgb_size);
+    double start = now();
+    for (int n = 0; n < iterations; n++) {
+      camera_yuyv2rgb_parallel(workers, yuyv, width * 2, rgb, width * 3, 
+                               width, height);
+    }
+    double elapsed = now() - start;
+    bool same = memcmp(rgb, expect, rgb_size) == 0;
+    printf("%s x%-2d %8.1f Mpixel/s %s\n", kernels[0].name, t,
+           (double) width * height * iterations / elapsed / 1e6,
+           same ? "" : "MISMATCH");
+    camera_workers_delete(workers);
+  }
+
+  free(yuyv);
+  free(expect);
+  free(rgb);
+  return 0;
+}
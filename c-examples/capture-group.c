@@ -0,0 +1,62 @@
+// capture from several devices on one thread and print each frame with
+// its device and monotonic timestamp
+// usage: capture-group [seconds] device...
+#define _GNU_SOURCE
+#include "../group.h"
+#include <stdio.h>
+#include <unistd.h>
+
+static void on_frame(const camera_group_frame_t* frame, void* pointer)
+{
+  uint64_t* last = pointer;
+  printf("%zu %llu.%06llu %zu bytes", frame->device,
+         (unsigned long long) (frame->timestamp_us / 1000000),
+         (unsigned long long) (frame->timestamp_us % 1000000),
+         frame->frame.length);
+  if (last[frame->device] > 0)
+    printf(" +%llu us",
+           (unsigned long long) (frame->timestamp_us - last[frame->device]));
+  printf("\n");
+  last[frame->device] = frame->timestamp_us;
+}
+
+int main(int argc, char* argv[])
+{
+  int seconds = argc > 2 ? atoi(argv[1]) : 0;
+  int first = 2;
+  if (seconds <= 0 || argc - first > CAMERA_GROUP_MAX) {
+    fprintf(stderr, "usage: %s seconds device...\n", argv[0]);
+    return 1;
+  }
+
+  camera_group_t* group = camera_group_new();
+  camera_t* cameras[CAMERA_GROUP_MAX];
+  int count = 0;
+  for (int i = first; i < argc; i++) {
+    camera_t* camera = camera_open(argv[i]);
+    if (camera == NULL) {
+      fprintf(stderr, "cannot open %s\n", argv[i]);
+      continue;
+    }
+    if (!camera_start(camera)) {
+      camera_close(camera);
+      continue;
+    }
+    cameras[count++] = camera;
+    camera_group_add(group, camera);
+  }
+
+  uint64_t last[CAMERA_GROUP_MAX] = {0};
+  if (count > 0 && camera_group_start(group, on_frame, last)) {
+    sleep(seconds);
+    camera_group_stop(group);
+    camera_group_stats_t stats;
+    camera_group_stats(group, &stats);
+    fprintf(stderr, "%llu frames in %llu wakeups\n",
+            (unsigned long long) stats.frames,
+            (unsigned long long) stats.wakeups);
+  }
+  camera_group_delete(group);
+  for (int i = 0; i < count; i++) camera_close(cameras[i]);
+  return 0;
+}
@@ -0,0 +1,308 @@
+// behavior checks of the image copies, the fanout drop policies, sink
+// stops, the buffer count and the reconfigure state machine, on a file
+// backed camera. no device needed
+// usage: test-capture [scratch file]
+#define _GNU_SOURCE
+#include "../capture.h"
+#include "../fanout.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do {                                            \
+    if (!(cond)) {                                                  \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+      failures++;                                                   \
+    }                                                               \
+  } while (0)
+
+
+//[images]
+static void check_image_init(void)
+{
+  camera_image_t image;
+  // sized for the largest layout checked
+  uint8_t data[8 * 6 + 2 * 4 * 3];
+  CHECK(camera_image_init(&image, data, V4L2_PIX_FMT_RGB24, 6, 4, 0, 0)
+        == 6 * 3 * 4);
+  CHECK(image.stride[0] == 18);
+  CHECK(camera_image_init(&image, data, V4L2_PIX_FMT_YUYV, 6, 4, 16, 0)
+        == 16 * 4);
+
+  // YU12 padded to a stride of 8 and a slice of 6 rows
+  CHECK(camera_image_init(&image, data, V4L2_PIX_FMT_YUV420, 4, 4, 8, 6)
+        == 8 * 6 + 2 * 4 * 3);
+  CHECK(image.plane[1] == data + 8 * 6);
+  CHECK(image.plane[2] == data + 8 * 6 + 4 * 3);
+  CHECK(image.stride[1] == 4 && image.stride[2] == 4);
+
+  // NV12 chroma rows are as long as the luma ones
+  CHECK(camera_image_init(&image, data, V4L2_PIX_FMT_NV12, 4, 4, 8, 0)
+        == 8 * 4 + 8 * 2);
+  CHECK(image.plane[1] == data + 8 * 4 && image.stride[1] == 8);
+
+  CHECK(camera_image_init(&image, data, V4L2_PIX_FMT_MJPEG, 4, 4, 0, 0)
+        == 0);
+}
+
+static void check_image_copy(void)
+{
+  // padded YU12 into a packed one and back: padding stays untouched
+  uint8_t padded[8 * 6 + 2 * 4 * 3], packed[4 * 4 * 3 / 2];
+  uint8_t back[sizeof padded];
+  camera_image_t src, dst, out;
+  camera_image_init(&src, padded, V4L2_PIX_FMT_YUV420, 4, 4, 8, 6);
+  camera_image_init(&dst, packed, V4L2_PIX_FMT_YUV420, 4, 4, 0, 0);
+  camera_image_init(&out, back, V4L2_PIX_FMT_YUV420, 4, 4, 8, 6);
+  memset(padded, 0xee, sizeof padded);
+  memset(back, 0x55, sizeof back);
+  for (int i = 0; i < 3; i++) {
+    uint32_t width, height, bpp;
+    camera_image_plane_size(&src, i, &width, &height, &bpp);
+    for (uint32_t y = 0; y < height; y++) {
+      for (uint32_t x = 0; x < width; x++)
+        src.plane[i][y * src.stride[i] + x] = (uint8_t) (i * 64 + y * 8 + x);
+    }
+  }
+  CHECK(camera_image_copy(&src, &dst));
+  CHECK(packed[0] == 0 && packed[5] == 9 && packed[15] == 27);
+  CHECK(packed[16] == 64 && packed[18] == 72 && packed[20] == 128);
+  CHECK(camera_image_copy(&dst, &out));
+  CHECK(back[8] == 8 && back[4] == 0x55 && back[8 * 4] == 0x55);
+  CHECK(back[8 * 6] == 64 && back[8 * 6 + 4 * 3] == 128);
+
+  camera_image_t other;
+  camera_image_init(&other, packed, V4L2_PIX_FMT_YUV420, 4, 2, 0, 0);
+  CHECK(!camera_image_copy(&src, &other));
+  camera_image_init(&other, packed, V4L2_PIX_FMT_NV12, 4, 4, 0, 0);
+  CHECK(!camera_image_copy(&src, &other));
+}
+
+
+//[fanout]
+/* the sink blocks on its first frame until opened, so that the frames
+ * pushed meanwhile meet a full queue */
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool open;
+  bool busy;
+  int done[8];
+  size_t done_count;
+  int released[8];
+  size_t released_count;
+} gate_t;
+
+static void gate_sink(void* frame, void* pointer)
+{
+  gate_t* gate = pointer;
+  pthread_mutex_lock(&gate->mutex);
+  gate->busy = true;
+  pthread_cond_broadcast(&gate->cond);
+  while (!gate->open) pthread_cond_wait(&gate->cond, &gate->mutex);
+  gate->done[gate->done_count++] = *(int*) frame;
+  pthread_mutex_unlock(&gate->mutex);
+}
+
+static void gate_release(void* frame, void* pointer)
+{
+  gate_t* gate = pointer;
+  pthread_mutex_lock(&gate->mutex);
+  gate->released[gate->released_count++] = *(int*) frame;
+  pthread_cond_broadcast(&gate->cond);
+  pthread_mutex_unlock(&gate->mutex);
+}
+
+/* frame 0 is taken by the sink, 1 to 3 go to a queue of one. the frames
+ * the sink gets */
+static void check_drop(camera_drop_t drop, int expected)
+{
+  static int frames[] = {0, 1, 2, 3};
+  gate_t gate = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+                 .cond = PTHREAD_COND_INITIALIZER};
+  camera_fanout_t* fanout = camera_fanout_new(gate_release, &gate);
+  int sink = camera_fanout_add(fanout, gate_sink, &gate, 1, drop);
+  CHECK(sink == 0);
+  CHECK(camera_fanout_push(fanout, &frames[0]) == 1);
+  pthread_mutex_lock(&gate.mutex);
+  while (!gate.busy) pthread_cond_wait(&gate.cond, &gate.mutex);
+  pthread_mutex_unlock(&gate.mutex);
+  CHECK(camera_fanout_push(fanout, &frames[1]) == 1);
+  CHECK(camera_fanout_push(fanout, &frames[2]) ==
+        (drop == CAMERA_DROP_OLDEST ? 1 : 0));
+  CHECK(camera_fanout_push(fanout, &frames[3]) ==
+        (drop == CAMERA_DROP_OLDEST ? 1 : 0));
+
+  camera_fanout_stats_t stats;
+  CHECK(camera_fanout_stats(fanout, sink, &stats));
+  CHECK(stats.dropped == 2 && stats.length == 1);
+
+  pthread_mutex_lock(&gate.mutex);
+  gate.open = true;
+  pthread_cond_broadcast(&gate.cond);
+  // frames turned away by DROP_NEWEST were never retained
+  size_t retained = drop == CAMERA_DROP_OLDEST ? 4 : 2;
+  while (gate.released_count < retained)
+    pthread_cond_wait(&gate.cond, &gate.mutex);
+  pthread_mutex_unlock(&gate.mutex);
+  CHECK(gate.done_count == 2 && gate.done[0] == 0);
+  CHECK(gate.done[1] == expected);
+
+  CHECK(camera_fanout_stats(fanout, sink, &stats));
+  CHECK(stats.done == 2 && stats.length == 0);
+  camera_fanout_delete(fanout);
+}
+
+static void check_stop(void)
+{
+  static int frames[] = {0, 1};
+  gate_t gate = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+                 .cond = PTHREAD_COND_INITIALIZER};
+  camera_fanout_t* fanout = camera_fanout_new(gate_release, &gate);
+  int sink = camera_fanout_add(fanout, gate_sink, &gate, 2,
+                               CAMERA_DROP_OLDEST);
+  camera_fanout_push(fanout, &frames[0]);
+  pthread_mutex_lock(&gate.mutex);
+  while (!gate.busy) pthread_cond_wait(&gate.cond, &gate.mutex);
+  pthread_mutex_unlock(&gate.mutex);
+  camera_fanout_push(fanout, &frames[1]);
+
+  // stopping does not wait for the busy sink: the queued frame goes back
+  camera_fanout_stop(fanout, sink);
+  pthread_mutex_lock(&gate.mutex);
+  CHECK(gate.released_count == 1 && gate.released[0] == 1);
+  pthread_mutex_unlock(&gate.mutex);
+  CHECK(camera_fanout_push(fanout, &frames[1]) == 0);
+  // the index stays taken until joined
+  CHECK(camera_fanout_add(fanout, gate_sink, &gate, 1, CAMERA_DROP_OLDEST)
+        == 1);
+  camera_fanout_remove(fanout, 1);
+
+  pthread_mutex_lock(&gate.mutex);
+  gate.open = true;
+  pthread_cond_broadcast(&gate.cond);
+  pthread_mutex_unlock(&gate.mutex);
+  camera_fanout_join(fanout, sink);
+  CHECK(gate.released_count == 2 && gate.released[1] == 0);
+  camera_fanout_stats_t stats;
+  CHECK(!camera_fanout_stats(fanout, sink, &stats));
+  CHECK(stats.done == 1 && stats.dropped == 1);
+  CHECK(camera_fanout_add(fanout, gate_sink, &gate, 1, CAMERA_DROP_OLDEST)
+        == 0);
+  camera_fanout_delete(fanout);
+}
+
+
+//[file camera]
+/* the refusals checked below are expected */
+static void log_quiet(camera_log_t type, const char* msg, void* pointer)
+{
+}
+
+static bool acquire(camera_t* camera, camera_frame_t* frame)
+{
+  for (int i = 0; i < 100; i++) {
+    if (camera_frame_acquire(camera, frame)) return true;
+    usleep(10000);
+  }
+  return false;
+}
+
+/* two YUYV 64x48 frames at 100 fps, started */
+static camera_t* open_file(const char* path)
+{
+  FILE* out = fopen(path, "wb");
+  CHECK(out != NULL);
+  if (out == NULL) return NULL;
+  for (int i = 0; i < 2 * 64 * 48 * 2; i++) fputc(i & 0xff, out);
+  fclose(out);
+
+  char device[256];
+  snprintf(device, sizeof device, "file:YUYV:64x48@100:%s", path);
+  camera_t* camera = camera_open(device);
+  CHECK(camera != NULL);
+  if (camera == NULL) return NULL;
+  camera->context.log = log_quiet;
+  CHECK(camera_start(camera));
+  return camera;
+}
+
+static void check_reconfigure(const char* path)
+{
+  camera_t* camera = open_file(path);
+  if (camera == NULL) return;
+  camera_frame_t frame;
+  CHECK(acquire(camera, &frame));
+  CHECK(frame.length >= 64 * 48 * 2);
+  camera_image_t image;
+  CHECK(camera_image_frame(camera, &frame, &image) == 64 * 48 * 2);
+  CHECK(image.plane[0] == frame.start && image.stride[0] == 128);
+  camera_frame_release(camera, &frame);
+
+  // the frame rate alone: applied without leaving the stream
+  camera_format_t rate = {0, 0, 0, {1, 50}};
+  CHECK(camera_reconfigure(camera, &rate));
+  CHECK(camera->streaming);
+  camera_format_t format;
+  CHECK(camera_config_get(camera, &format));
+  CHECK(format.interval.numerator == 1 && format.interval.denominator == 50);
+  CHECK(acquire(camera, &frame));
+  camera_frame_release(camera, &frame);
+
+  // a size change goes through STREAMOFF and streams again. the file
+  // decides the size, like a driver adjusting it
+  camera_format_t size = {V4L2_PIX_FMT_YUYV, 32, 24, {0, 0}};
+  CHECK(camera_reconfigure(camera, &size));
+  CHECK(camera->streaming);
+  CHECK(camera->width == 64 && camera->height == 48);
+  CHECK(acquire(camera, &frame));
+  camera_frame_release(camera, &frame);
+  camera_close(camera);
+}
+
+static void check_buffer_count(const char* path)
+{
+  camera_t* camera = open_file(path);
+  if (camera == NULL) return;
+  // refused while streaming, the ring left as it is
+  size_t count = camera->buffer_count;
+  CHECK(!camera_buffer_count_set(camera, count + 2));
+  CHECK(camera->buffer_count == count);
+
+  // a frame never released is not counted after the restart
+  camera_frame_t frame;
+  CHECK(acquire(camera, &frame));
+  CHECK(camera->stats.outstanding == 1);
+  CHECK(camera_stop(camera));
+  CHECK(!camera->streaming);
+  CHECK(camera->stats.outstanding == 0);
+  CHECK(camera_buffer_count_set(camera, count + 2));
+  CHECK(camera_start(camera));
+  CHECK(camera->buffer_count == count + 2);
+  CHECK(acquire(camera, &frame));
+  CHECK(camera->stats.outstanding == 1 && camera->stats.queue_empty == 0);
+  camera_frame_release(camera, &frame);
+  camera_close(camera);
+}
+
+int main(int argc, char* argv[])
+{
+  const char* path = argc > 1 ? argv[1] : "test-capture.yuyv";
+  check_image_init();
+  check_image_copy();
+  check_drop(CAMERA_DROP_OLDEST, 3);
+  check_drop(CAMERA_DROP_NEWEST, 1);
+  check_stop();
+  check_buffer_count(path);
+  check_reconfigure(path);
+  unlink(path);
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
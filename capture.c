@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "capture.h"
 #include <stdio.h>
 #include <string.h>
@@ -7,8 +8,27 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
 #include <linux/videodev2.h>
 
+#define CAMERA_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/* camera->stats are written by the thread using the camera and read from 
+ * any other through camera_stats_get() */
+#define STAT_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define STAT_STORE(field, value) \
+  __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define STAT_ADD(field, value) \
+  __atomic_add_fetch(&(field), (value), __ATOMIC_RELAXED)
+#define STAT_SUB(field, value) \
+  __atomic_sub_fetch(&(field), (value), __ATOMIC_RELAXED)
+
 
 static void log_stderr(camera_log_t type, const char* msg, void* pointer) {
   switch (type) {
@@ -45,21 +65,517 @@ static int xioctl(int fd, unsigned long int request, void* arg)
 }
 
 
+//[file backend]
+/* a virtual camera replaying frames from a file, driven through the same
+ * ioctl requests as a V4L2 device. camera->fd is an epoll fd readable when
+ * a frame can be dequeued, or after STREAMOFF as a device reports POLLERR.
+ * buffers are filled by copying the next frame of the file on DQBUF */
+#define FILE_PREFIX "file:"
+
+typedef struct {
+  uint8_t* start; /* MMAP: owned by the backend */
+  size_t length;
+} file_buffer_t;
+
+struct camera_file {
+  uint8_t* data; /* the whole file, mmap'ed */
+  size_t size;
+  size_t* offsets;
+  size_t* lengths;
+  size_t frame_count;
+  uint32_t format;
+  uint32_t width;
+  uint32_t height;
+  uint32_t bytesperline;
+  uint32_t sizeimage; /* the largest frame */
+  struct v4l2_fract interval; /* numerator 0: as fast as possible */
+  int timer_fd;
+  int ready_fd; /* eventfd, unpaced readiness and stream off */
+  bool ready;
+  enum v4l2_memory memory;
+  file_buffer_t* buffers;
+  size_t buffer_count;
+  uint32_t* queue; /* fifo of queued indices */
+  size_t queue_head;
+  size_t queue_length;
+  bool streaming;
+  uint32_t sequence;
+  size_t next;
+  uint64_t start_us;
+};
+
+static uint64_t monotonic_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t file_interval_us(camera_file_t* file)
+{
+  if (file->interval.numerator == 0 || file->interval.denominator == 0)
+    return 0;
+  return (uint64_t) file->interval.numerator * 1000000 / 
+    file->interval.denominator;
+}
+
+static void file_ready_set(camera_file_t* file, bool ready)
+{
+  if (ready == file->ready) return;
+  uint64_t count = 1;
+  if (ready) {
+    while (write(file->ready_fd, &count, sizeof count) == -1 && 
+           errno == EINTR);
+  } else {
+    while (read(file->ready_fd, &count, sizeof count) == -1 && 
+           errno == EINTR);
+  }
+  file->ready = ready;
+}
+
+static void file_timer_set(camera_file_t* file, uint64_t interval_us)
+{
+  struct itimerspec its;
+  memset(&its, 0, sizeof its);
+  its.it_interval.tv_sec = interval_us / 1000000;
+  its.it_interval.tv_nsec = interval_us % 1000000 * 1000;
+  its.it_value = its.it_interval;
+  timerfd_settime(file->timer_fd, 0, &its, NULL);
+}
+
+static bool file_split_fail(int err)
+{
+  errno = err;
+  return false;
+}
+
+/* false with errno EINVAL when the file holds no frame, ENOMEM when the 
+ * frame table cannot be allocated */
+static bool file_split(camera_file_t* file)
+{
+  size_t capacity = 0;
+  if (file->format == V4L2_PIX_FMT_MJPEG || file->format == V4L2_PIX_FMT_JPEG) {
+    // a frame runs from one SOI marker to the next
+    for (size_t i = 0; i + 2 < file->size; i++) {
+      if (file->data[i] != 0xff || file->data[i + 1] != 0xd8 || 
+          file->data[i + 2] != 0xff) continue;
+      if (file->frame_count == capacity) {
+        capacity = capacity ? capacity * 2 : 64;
+        // the previous tables stay owned by the file when these fail
+        size_t* offsets = realloc(file->offsets, capacity * sizeof (size_t));
+        if (offsets == NULL) return file_split_fail(ENOMEM);
+        file->offsets = offsets;
+        size_t* lengths = realloc(file->lengths, capacity * sizeof (size_t));
+        if (lengths == NULL) return file_split_fail(ENOMEM);
+        file->lengths = lengths;
+      }
+      file->offsets[file->frame_count++] = i;
+      i += 2;
+    }
+    for (size_t i = 0; i < file->frame_count; i++) {
+      size_t end = i + 1 < file->frame_count ? 
+        file->offsets[i + 1] : file->size;
+      file->lengths[i] = end - file->offsets[i];
+      if (file->lengths[i] > file->sizeimage) 
+        file->sizeimage = file->lengths[i];
+    }
+    file->bytesperline = 0;
+    return file->frame_count > 0 || file_split_fail(EINVAL);
+  }
+  size_t pixels = (size_t) file->width * file->height;
+  switch (file->format) {
+  case V4L2_PIX_FMT_YUYV:
+    file->bytesperline = file->width * 2;
+    file->sizeimage = pixels * 2;
+    break;
+  case V4L2_PIX_FMT_RGB24:
+    file->bytesperline = file->width * 3;
+    file->sizeimage = pixels * 3;
+    break;
+  case V4L2_PIX_FMT_NV12:
+  case V4L2_PIX_FMT_YUV420:
+    file->bytesperline = file->width;
+    file->sizeimage = pixels * 3 / 2;
+    break;
+  default:
+    return file_split_fail(EINVAL);
+  }
+  file->frame_count = file->size / file->sizeimage;
+  if (file->frame_count == 0) return file_split_fail(EINVAL);
+  file->offsets = calloc(file->frame_count, sizeof (size_t));
+  file->lengths = calloc(file->frame_count, sizeof (size_t));
+  if (file->offsets == NULL || file->lengths == NULL) 
+    return file_split_fail(ENOMEM);
+  for (size_t i = 0; i < file->frame_count; i++) {
+    file->offsets[i] = i * file->sizeimage;
+    file->lengths[i] = file->sizeimage;
+  }
+  return true;
+}
+
+static void file_close(camera_file_t* file)
+{
+  for (size_t i = 0; i < file->buffer_count; i++) {
+    if (file->memory == V4L2_MEMORY_MMAP) free(file->buffers[i].start);
+  }
+  free(file->buffers);
+  free(file->queue);
+  free(file->offsets);
+  free(file->lengths);
+  if (file->data != NULL) munmap(file->data, file->size);
+  if (file->timer_fd != -1) close(file->timer_fd);
+  if (file->ready_fd != -1) close(file->ready_fd);
+  free(file);
+}
+
+/* "file:FOURCC:WIDTHxHEIGHT[@FPS]:PATH". without fps (or 0), frames are 
+ * delivered as fast as they are dequeued */
+static camera_file_t* file_open(const char* spec, int* fd)
+{
+  char fourcc[5] = {0};
+  unsigned width = 0, height = 0, fps = 0;
+  int path = 0;
+  if (sscanf(spec, FILE_PREFIX "%4[^:]:%ux%u@%u:%n", 
+             fourcc, &width, &height, &fps, &path) < 4 || path == 0) {
+    fps = 0;
+    path = 0;
+    if (sscanf(spec, FILE_PREFIX "%4[^:]:%ux%u:%n", 
+               fourcc, &width, &height, &path) < 3 || path == 0) {
+      errno = EINVAL;
+      return NULL;
+    }
+  }
+  if (strlen(fourcc) != 4) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  camera_file_t* file = calloc(1, sizeof (camera_file_t));
+  file->timer_fd = -1;
+  file->ready_fd = -1;
+  *fd = -1;
+  file->format = camera_format_id(fourcc);
+  file->width = width;
+  file->height = height;
+  file->interval.numerator = fps ? 1 : 0;
+  file->interval.denominator = fps ? fps : 1;
+  file->memory = V4L2_MEMORY_MMAP;
+
+  int data_fd = open(spec + path, O_RDONLY | O_CLOEXEC);
+  if (data_fd == -1) goto fail;
+  struct stat st;
+  if (fstat(data_fd, &st) == -1 || st.st_size == 0) {
+    close(data_fd);
+    goto fail;
+  }
+  file->size = st.st_size;
+  file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, data_fd, 0);
+  close(data_fd);
+  if (file->data == MAP_FAILED) {
+    file->data = NULL;
+    goto fail;
+  }
+  if (!file_split(file)) goto fail;
+
+  file->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  file->ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  *fd = epoll_create1(EPOLL_CLOEXEC);
+  if (file->timer_fd == -1 || file->ready_fd == -1 || *fd == -1) goto fail;
+  struct epoll_event ev = {.events = EPOLLIN};
+  if (epoll_ctl(*fd, EPOLL_CTL_ADD, file->timer_fd, &ev) == -1 ||
+      epoll_ctl(*fd, EPOLL_CTL_ADD, file->ready_fd, &ev) == -1) goto fail;
+  return file;
+fail:
+  if (*fd != -1) close(*fd);
+  file_close(file);
+  return NULL;
+}
+
+static int file_fail(int err)
+{
+  errno = err;
+  return -1;
+}
+
+static int file_reqbufs(camera_file_t* file, struct v4l2_requestbuffers* req)
+{
+  if (file->streaming) return file_fail(EBUSY);
+  if (req->memory != V4L2_MEMORY_MMAP && req->memory != V4L2_MEMORY_USERPTR)
+    return file_fail(EINVAL);
+  for (size_t i = 0; i < file->buffer_count; i++) {
+    if (file->memory == V4L2_MEMORY_MMAP) free(file->buffers[i].start);
+  }
+  free(file->buffers);
+  free(file->queue);
+  file->buffers = NULL;
+  file->queue = NULL;
+  file->buffer_count = 0;
+  file->queue_length = 0;
+  file->memory = req->memory;
+  if (req->count == 0) return 0;
+  if (req->count > VIDEO_MAX_FRAME) req->count = VIDEO_MAX_FRAME;
+  file->buffers = calloc(req->count, sizeof (file_buffer_t));
+  file->queue = calloc(req->count, sizeof (uint32_t));
+  if (file->buffers == NULL || file->queue == NULL) {
+    free(file->buffers);
+    free(file->queue);
+    file->buffers = NULL;
+    file->queue = NULL;
+    return file_fail(ENOMEM);
+  }
+  file->buffer_count = req->count;
+  if (req->memory == V4L2_MEMORY_MMAP) {
+    for (size_t i = 0; i < file->buffer_count; i++) {
+      file->buffers[i].start = malloc(file->sizeimage);
+      file->buffers[i].length = file->sizeimage;
+      if (file->buffers[i].start == NULL) {
+        file->buffer_count = i;
+        return file_fail(ENOMEM);
+      }
+    }
+  }
+  return 0;
+}
+
+static int file_qbuf(camera_file_t* file, struct v4l2_buffer* buf)
+{
+  if (buf->index >= file->buffer_count || buf->memory != file->memory)
+    return file_fail(EINVAL);
+  for (size_t i = 0; i < file->queue_length; i++) {
+    if (file->queue[(file->queue_head + i) % file->buffer_count] == buf->index)
+      return file_fail(EINVAL);
+  }
+  if (file->memory == V4L2_MEMORY_USERPTR) {
+    if (buf->length < file->sizeimage) return file_fail(EINVAL);
+    file->buffers[buf->index].start = (uint8_t*) buf->m.userptr;
+    file->buffers[buf->index].length = buf->length;
+  }
+  file->queue[(file->queue_head + file->queue_length) % file->buffer_count] =
+    buf->index;
+  file->queue_length++;
+  if (file->streaming && file_interval_us(file) == 0) 
+    file_ready_set(file, true);
+  return 0;
+}
+
+static int file_dqbuf(camera_file_t* file, struct v4l2_buffer* buf)
+{
+  if (!file->streaming) return file_fail(EINVAL);
+  uint64_t interval = file_interval_us(file);
+  uint64_t ticks = 1;
+  if (interval > 0) {
+    if (read(file->timer_fd, &ticks, sizeof ticks) == -1) return -1;
+    // the sensor kept going: frames due while no buffer was queued are lost
+    file->sequence += ticks - 1;
+    file->next += ticks - 1;
+    if (file->queue_length == 0) {
+      file->sequence++;
+      file->next++;
+      return file_fail(EAGAIN);
+    }
+  } else if (file->queue_length == 0) {
+    return file_fail(EAGAIN);
+  }
+
+  uint32_t index = file->queue[file->queue_head];
+  file->queue_head = (file->queue_head + 1) % file->buffer_count;
+  file->queue_length--;
+  if (interval == 0 && file->queue_length == 0) file_ready_set(file, false);
+
+  size_t frame = file->next++ % file->frame_count;
+  size_t length = file->lengths[frame];
+  memcpy(file->buffers[index].start, file->data + file->offsets[frame], length);
+  uint64_t timestamp = interval > 0 ? 
+    file->start_us + (uint64_t) (file->sequence + 1) * interval : 
+    monotonic_us();
+
+  memset(buf, 0, sizeof *buf);
+  buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buf->memory = file->memory;
+  buf->index = index;
+  buf->bytesused = length;
+  buf->length = file->buffers[index].length;
+  buf->field = V4L2_FIELD_NONE;
+  buf->sequence = file->sequence++;
+  buf->flags = V4L2_BUF_FLAG_DONE;
+#ifdef V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+  buf->flags |= V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+#endif
+  buf->timestamp.tv_sec = timestamp / 1000000;
+  buf->timestamp.tv_usec = timestamp % 1000000;
+  if (file->memory == V4L2_MEMORY_USERPTR)
+    buf->m.userptr = (unsigned long) file->buffers[index].start;
+  return 0;
+}
+
+static int file_stream(camera_file_t* file, bool on)
+{
+  if (on == file->streaming) return 0;
+  file->streaming = on;
+  if (on) {
+    file->sequence = 0;
+    file->next = 0;
+    file->start_us = monotonic_us();
+    uint64_t interval = file_interval_us(file);
+    file_ready_set(file, interval == 0 && file->queue_length > 0);
+    file_timer_set(file, interval);
+  } else {
+    file->queue_length = 0;
+    file_timer_set(file, 0);
+    file_ready_set(file, true);
+  }
+  return 0;
+}
+
+static void file_pix_format(camera_file_t* file, struct v4l2_pix_format* pix)
+{
+  memset(pix, 0, sizeof *pix);
+  pix->width = file->width;
+  pix->height = file->height;
+  pix->pixelformat = file->format;
+  pix->field = V4L2_FIELD_NONE;
+  pix->bytesperline = file->bytesperline;
+  pix->sizeimage = file->sizeimage;
+}
+
+static int file_ioctl(camera_file_t* file, unsigned long int request, 
+                      void* arg)
+{
+  switch (request) {
+  case VIDIOC_QUERYCAP: {
+    struct v4l2_capability* cap = arg;
+    memset(cap, 0, sizeof *cap);
+    strncpy((char*) cap->driver, "file", sizeof cap->driver - 1);
+    strncpy((char*) cap->card, "file backed camera", sizeof cap->card - 1);
+    cap->capabilities = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+    return 0;
+  }
+  case VIDIOC_G_FMT:
+  case VIDIOC_S_FMT: 
+  case VIDIOC_TRY_FMT: {
+    // the frames in the file decide: adjusted like a driver would do
+    struct v4l2_format* format = arg;
+    if (request == VIDIOC_S_FMT && file->buffer_count > 0) 
+      return file_fail(EBUSY);
+    file_pix_format(file, &format->fmt.pix);
+    return 0;
+  }
+  case VIDIOC_G_PARM:
+  case VIDIOC_S_PARM: {
+    struct v4l2_streamparm* parm = arg;
+    if (request == VIDIOC_S_PARM) {
+      file->interval = parm->parm.capture.timeperframe;
+      if (file->streaming) {
+        uint64_t interval = file_interval_us(file);
+        file_ready_set(file, interval == 0 && file->queue_length > 0);
+        file_timer_set(file, interval);
+      }
+    }
+    memset(&parm->parm, 0, sizeof parm->parm);
+    parm->parm.capture.timeperframe = file->interval;
+    return 0;
+  }
+  case VIDIOC_ENUM_FMT: {
+    struct v4l2_fmtdesc* fmt = arg;
+    if (fmt->index > 0) return file_fail(EINVAL);
+    fmt->pixelformat = file->format;
+    camera_format_name(file->format, (char*) fmt->description);
+    return 0;
+  }
+  case VIDIOC_ENUM_FRAMESIZES: {
+    struct v4l2_frmsizeenum* frmsize = arg;
+    if (frmsize->index > 0 || frmsize->pixel_format != file->format) 
+      return file_fail(EINVAL);
+    frmsize->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+    frmsize->discrete.width = file->width;
+    frmsize->discrete.height = file->height;
+    return 0;
+  }
+  case VIDIOC_ENUM_FRAMEINTERVALS: {
+    struct v4l2_frmivalenum* frmival = arg;
+    if (frmival->index > 0 || frmival->pixel_format != file->format ||
+        frmival->width != file->width || frmival->height != file->height) 
+      return file_fail(EINVAL);
+    frmival->type = V4L2_FRMIVAL_TYPE_DISCRETE;
+    frmival->discrete = file->interval;
+    return 0;
+  }
+  case VIDIOC_REQBUFS:
+    return file_reqbufs(file, arg);
+  case VIDIOC_QUERYBUF: {
+    struct v4l2_buffer* buf = arg;
+    if (buf->index >= file->buffer_count) return file_fail(EINVAL);
+    buf->length = file->sizeimage;
+    buf->m.offset = 0;
+    return 0;
+  }
+  case VIDIOC_QBUF:
+    return file_qbuf(file, arg);
+  case VIDIOC_DQBUF:
+    return file_dqbuf(file, arg);
+  case VIDIOC_STREAMON:
+  case VIDIOC_STREAMOFF:
+    return file_stream(file, request == VIDIOC_STREAMON);
+  default:
+    // no crop, controls or buffer export
+    return file_fail(ENOTTY);
+  }
+}
+
+static void* file_buffer(camera_file_t* file, uint32_t index)
+{
+  return file->buffers[index].start;
+}
+
+static int camera_ioctl(camera_t* camera, unsigned long int request, void* arg)
+{
+  if (camera->file != NULL) return file_ioctl(camera->file, request, arg);
+  return xioctl(camera->fd, request, arg);
+}
+
 
 camera_t* camera_open(const char * device)
 {
-  int fd = open(device, O_RDWR | O_NONBLOCK, 0);
-  if (fd == -1) return NULL;
+  int fd = -1;
+  camera_file_t* file = NULL;
+  if (strncmp(device, FILE_PREFIX, strlen(FILE_PREFIX)) == 0) {
+    file = file_open(device, &fd);
+    if (file == NULL) return NULL;
+  } else {
+    fd = open(device, O_RDWR | O_NONBLOCK, 0);
+    if (fd == -1) return NULL;
+  }
   
   camera_t* camera = malloc(sizeof (camera_t));
+  if (camera == NULL) {
+    if (file != NULL) file_close(file);
+    close(fd);
+    errno = ENOMEM;
+    return NULL;
+  }
   camera->fd = fd;
+  camera->file = file;
+  camera->controls = NULL;
+  camera->streaming = false;
   camera->initialized = false;
+  camera->format = 0;
   camera->width = 0;
   camera->height = 0;
+  camera->bytesperline = 0;
+  camera->image_size = 0;
+  camera->memory = CAMERA_MEMORY_MMAP;
+  camera->memory_request = CAMERA_MEMORY_MMAP;
+  camera->hugepages = false;
+  camera->buffer_request = 4;
+  camera->latest_only = false;
   camera->buffer_count = 0;
   camera->buffers = NULL;
   camera->head.length = 0;
   camera->head.start = NULL;
+  camera->head.dmabuf_fd = -1;
+  camera->head_capacity = 0;
+  memset(&camera->head_meta, 0, sizeof camera->head_meta);
+  camera_stats_reset(camera);
   camera->context.pointer = NULL;
   camera->context.log = &log_stderr;
   return camera;
@@ -68,7 +584,10 @@ camera_t* camera_open(const char * device)
 static void free_buffers(camera_t* camera, size_t count)
 {
   for (size_t i = 0; i < count; i++) {
-    munmap(camera->buffers[i].start, camera->buffers[i].length);
+    if (camera->buffers[i].dmabuf_fd != -1) close(camera->buffers[i].dmabuf_fd);
+    // MMAP buffers of a file camera belong to the backend
+    if (camera->file == NULL || camera->memory == CAMERA_MEMORY_USERPTR)
+      munmap(camera->buffers[i].start, camera->buffers[i].length);
   }
   free(camera->buffers);
   camera->buffers = NULL;
@@ -77,7 +596,7 @@ static void free_buffers(camera_t* camera, size_t count)
 
 static bool camera_init(camera_t* camera) {
   struct v4l2_capability cap;
-  if (xioctl(camera->fd, VIDIOC_QUERYCAP, &cap) == -1)
+  if (camera_ioctl(camera, VIDIOC_QUERYCAP, &cap) == -1)
     return error(camera, "VIDIOC_QUERYCAP");
   if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE))
     return failure(camera, "no capture");
@@ -87,11 +606,11 @@ static bool camera_init(camera_t* camera) {
   struct v4l2_cropcap cropcap;
   memset(&cropcap, 0, sizeof cropcap);
   cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  if (xioctl(camera->fd, VIDIOC_CROPCAP, &cropcap) == 0) {
+  if (camera_ioctl(camera, VIDIOC_CROPCAP, &cropcap) == 0) {
     struct v4l2_crop crop;
     crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     crop.c = cropcap.defrect;
-    if (xioctl(camera->fd, VIDIOC_S_CROP, &crop) == -1) {
+    if (camera_ioctl(camera, VIDIOC_S_CROP, &crop) == -1) {
       // cropping not supported
     }
   }
@@ -99,32 +618,166 @@ static bool camera_init(camera_t* camera) {
   return true;
 }
 
-static bool camera_buffer_prepare(camera_t* camera)
+/* gives the driver side of the buffers back, for allocations failing after 
+ * the driver granted them */
+static void camera_buffer_release_driver(camera_t* camera, 
+                                         enum v4l2_memory memory)
 {
+  int err = errno;
   struct v4l2_requestbuffers req;
   memset(&req, 0, sizeof req);
-  req.count = 4;
+  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  req.memory = memory;
+  camera_ioctl(camera, VIDIOC_REQBUFS, &req);
+  errno = err;
+}
+
+static void* pool_alloc(camera_t* camera, size_t* length)
+{
+  if (camera->hugepages) {
+    size_t huge = (*length + CAMERA_HUGEPAGE_SIZE - 1) & 
+      ~(size_t) (CAMERA_HUGEPAGE_SIZE - 1);
+    void* start = mmap(NULL, huge, PROT_READ | PROT_WRITE, 
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (start != MAP_FAILED) {
+      *length = huge;
+      return start;
+    }
+    camera->context.log(CAMERA_INFO, "MAP_HUGETLB failed, use small pages",
+                        camera->context.pointer);
+  }
+  size_t page = sysconf(_SC_PAGESIZE);
+  *length = (*length + page - 1) & ~(page - 1);
+  void* start = mmap(NULL, *length, PROT_READ | PROT_WRITE, 
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (start == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+  if (camera->hugepages) madvise(start, *length, MADV_HUGEPAGE);
+#endif
+  return start;
+}
+
+/* pool: user pointer buffers kept from a previous format, reused when
+ * large enough and unmapped otherwise */
+static bool camera_buffer_prepare_userptr(camera_t* camera, size_t count,
+                                          size_t sizeimage,
+                                          camera_buffer_t* pool, 
+                                          size_t pool_count)
+{
+  camera->memory = CAMERA_MEMORY_USERPTR;
+  camera->buffers = calloc(count, sizeof (camera_buffer_t));
+  if (camera->buffers == NULL) {
+    for (size_t i = 0; i < pool_count; i++) 
+      munmap(pool[i].start, pool[i].length);
+    free(pool);
+    errno = ENOMEM;
+    camera_buffer_release_driver(camera, V4L2_MEMORY_USERPTR);
+    return error(camera, "calloc buffers");
+  }
+  camera->buffer_count = count;
+
+  bool ok = true;
+  for (size_t i = 0; i < camera->buffer_count; i++) {
+    if (i < pool_count && pool[i].length >= camera->image_size) {
+      camera->buffers[i] = pool[i];
+      pool[i].start = NULL;
+      continue;
+    }
+    size_t length = sizeimage;
+    void* start = pool_alloc(camera, &length);
+    if (start == NULL) {
+      free_buffers(camera, i);
+      ok = error(camera, "mmap pool");
+      break;
+    }
+    camera->buffers[i].start = start;
+    camera->buffers[i].length = length;
+    camera->buffers[i].dmabuf_fd = -1;
+  }
+  for (size_t i = 0; i < pool_count; i++) {
+    if (pool[i].start != NULL) munmap(pool[i].start, pool[i].length);
+  }
+  free(pool);
+  return ok;
+}
+
+/* MMAP buffers of at least sizeimage bytes: VIDIOC_CREATE_BUFS when it is
+ * larger than the current format needs, VIDIOC_REQBUFS otherwise */
+static bool camera_buffer_request_mmap(camera_t* camera, size_t sizeimage)
+{
+#ifdef VIDIOC_CREATE_BUFS
+  if (sizeimage > camera->image_size) {
+    struct v4l2_create_buffers create;
+    memset(&create, 0, sizeof create);
+    create.count = camera->buffer_request;
+    create.memory = V4L2_MEMORY_MMAP;
+    create.format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (camera_ioctl(camera, VIDIOC_G_FMT, &create.format) != -1) {
+      create.format.fmt.pix.sizeimage = sizeimage;
+      if (camera_ioctl(camera, VIDIOC_CREATE_BUFS, &create) != -1 && 
+          create.count > 0) {
+        camera->buffer_count = create.count;
+        return true;
+      }
+    }
+    // not supported: buffers sized for the current format
+  }
+#endif
+  struct v4l2_requestbuffers req;
+  memset(&req, 0, sizeof req);
+  req.count = camera->buffer_request;
   req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   req.memory = V4L2_MEMORY_MMAP;
-  if (xioctl(camera->fd, VIDIOC_REQBUFS, &req) == -1)
+  if (camera_ioctl(camera, VIDIOC_REQBUFS, &req) == -1)
     return error(camera, "VIDIOC_REQBUFS");
+  if (req.count == 0) return failure(camera, "no buffers granted");
   camera->buffer_count = req.count;
-  camera->buffers = calloc(req.count, sizeof (camera_buffer_t));
+  return true;
+}
+
+static bool camera_buffer_prepare_pool(camera_t* camera, size_t sizeimage,
+                                       camera_buffer_t* pool, 
+                                       size_t pool_count)
+{
+  if (camera->memory_request == CAMERA_MEMORY_USERPTR) {
+    struct v4l2_requestbuffers req;
+    memset(&req, 0, sizeof req);
+    req.count = camera->buffer_request;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_USERPTR;
+    if (camera_ioctl(camera, VIDIOC_REQBUFS, &req) != -1 && req.count > 0)
+      return camera_buffer_prepare_userptr(camera, req.count, sizeimage,
+                                           pool, pool_count);
+    camera->context.log(CAMERA_INFO, "USERPTR refused, fallback to MMAP",
+                        camera->context.pointer);
+  }
+  for (size_t i = 0; i < pool_count; i++) 
+    munmap(pool[i].start, pool[i].length);
+  free(pool);
+  if (!camera_buffer_request_mmap(camera, sizeimage)) return false;
+  camera->memory = CAMERA_MEMORY_MMAP;
+  camera->buffers = calloc(camera->buffer_count, sizeof (camera_buffer_t));
+  if (camera->buffers == NULL) {
+    camera->buffer_count = 0;
+    errno = ENOMEM;
+    camera_buffer_release_driver(camera, V4L2_MEMORY_MMAP);
+    return error(camera, "calloc buffers");
+  }
 
-  size_t buf_max = 0;
   for (size_t i = 0; i < camera->buffer_count; i++) {
     struct v4l2_buffer buf;
     memset(&buf, 0, sizeof buf);
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     buf.memory = V4L2_MEMORY_MMAP;
     buf.index = i;
-    if (xioctl(camera->fd, VIDIOC_QUERYBUF, &buf) == -1) {
+    if (camera_ioctl(camera, VIDIOC_QUERYBUF, &buf) == -1) {
       free_buffers(camera, i);
       return error(camera, "VIDIOC_QUERYBUF");
     }
-    if (buf.length > buf_max) buf_max = buf.length;
     camera->buffers[i].length = buf.length;
-    camera->buffers[i].start = 
+    camera->buffers[i].dmabuf_fd = -1;
+    camera->buffers[i].start = camera->file != NULL ? 
+      file_buffer(camera->file, i) :
       mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, 
            camera->fd, buf.m.offset);
     if (camera->buffers[i].start == MAP_FAILED) {
@@ -132,16 +785,37 @@ static bool camera_buffer_prepare(camera_t* camera)
       return error(camera, "mmap");
     }
   }
-  camera->head.start = calloc(buf_max, sizeof (uint8_t));
   return true;
 }
 
+static bool camera_buffer_prepare(camera_t* camera)
+{
+  return camera_buffer_prepare_pool(camera, camera->image_size, NULL, 0);
+}
+
+static bool camera_buffer_queue(camera_t* camera, uint32_t index)
+{
+  struct v4l2_buffer buf;
+  memset(&buf, 0, sizeof buf);
+  buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buf.index = index;
+  if (camera->memory == CAMERA_MEMORY_USERPTR) {
+    buf.memory = V4L2_MEMORY_USERPTR;
+    buf.m.userptr = (unsigned long) camera->buffers[index].start;
+    buf.length = camera->buffers[index].length;
+  } else {
+    buf.memory = V4L2_MEMORY_MMAP;
+  }
+  return camera_ioctl(camera, VIDIOC_QBUF, &buf) != -1;
+}
+
 static void camera_buffer_finish(camera_t* camera)
 {
   free_buffers(camera, camera->buffer_count);
   free(camera->head.start);
   camera->head.length = 0;
   camera->head.start = NULL;
+  camera->head_capacity = 0;
 }
 
 static bool camera_load_settings(camera_t* camera)
@@ -149,10 +823,13 @@ static bool camera_load_settings(camera_t* camera)
   struct v4l2_format format;
   memset(&format, 0, sizeof format);
   format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  if (xioctl(camera->fd, VIDIOC_G_FMT, &format) == -1)
+  if (camera_ioctl(camera, VIDIOC_G_FMT, &format) == -1)
     return error(camera, "VIDIOC_G_FMT");
+  camera->format = format.fmt.pix.pixelformat;
   camera->width = format.fmt.pix.width;
   camera->height = format.fmt.pix.height;
+  camera->bytesperline = format.fmt.pix.bytesperline;
+  camera->image_size = format.fmt.pix.sizeimage;
   return true;
 }
 
@@ -171,17 +848,24 @@ static bool camera_load(camera_t* camera)
 bool camera_stop(camera_t* camera)
 {
   enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  if (xioctl(camera->fd, VIDIOC_STREAMOFF, &type) == -1) 
+  if (camera_ioctl(camera, VIDIOC_STREAMOFF, &type) == -1) 
     return error(camera, "VIDIOC_STREAMOFF");
-  camera_buffer_finish(camera);
+  camera->streaming = false;
+  // mmap'ed buffers must be unmapped before releasing them, while
+  // the user pointers must stay valid until the driver forgets them
+  bool userptr = camera->memory == CAMERA_MEMORY_USERPTR;
+  if (!userptr) camera_buffer_finish(camera);
   
   struct v4l2_requestbuffers req;
   memset(&req, 0, sizeof req);
   req.count = 0;
   req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  req.memory = V4L2_MEMORY_MMAP;
-  if (xioctl(camera->fd, VIDIOC_REQBUFS, &req) == -1)
-    return error(camera, "VIDIOC_REQBUFS 0");
+  req.memory = userptr ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
+  bool released = camera_ioctl(camera, VIDIOC_REQBUFS, &req) != -1;
+  if (userptr) camera_buffer_finish(camera);
+  if (!released) return error(camera, "VIDIOC_REQBUFS 0");
+  // buffers held or lost to the ring are gone with them
+  STAT_STORE(camera->stats.outstanding, 0);
   return true;
 }
 
@@ -190,18 +874,14 @@ bool camera_start(camera_t* camera)
   if (!camera_load(camera)) return false;
 
   for (size_t i = 0; i < camera->buffer_count; i++) {
-    struct v4l2_buffer buf;
-    memset(&buf, 0, sizeof buf);
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
-    buf.index = i;
-    if (xioctl(camera->fd, VIDIOC_QBUF, &buf) == -1) 
-      return error(camera, "VIDIOC_QBUF");
+    if (!camera_buffer_queue(camera, i)) return error(camera, "VIDIOC_QBUF");
   }
+  camera_stats_reset(camera);
   
   enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  if (xioctl(camera->fd, VIDIOC_STREAMON, &type) == -1) 
+  if (camera_ioctl(camera, VIDIOC_STREAMON, &type) == -1) 
     return error(camera, "VIDIOC_STREAMON");
+  camera->streaming = true;
   return true;
 }
 
@@ -214,26 +894,517 @@ bool camera_close(camera_t* camera)
   for (int i = 0; i < 10; i++) {
     if (close(camera->fd) != -1) break;
   }
+  if (camera->file != NULL) file_close(camera->file);
+  if (camera->controls != NULL) camera_controls_delete(camera->controls);
   free(camera);
   return true;
 }
 
+bool camera_buffer_count_set(camera_t* camera, size_t count)
+{
+  if (count == 0) return failure(camera, "buffer count must be positive");
+  if (count == camera->buffer_request) return true;
+  if (camera->streaming)
+    return failure(camera, "streaming: stop before changing the buffer count");
+  camera->buffer_request = count;
+  // buffers are reallocated with the new depth at the next camera_start()
+  if (camera->buffer_count > 0) return camera_stop(camera);
+  return true;
+}
+
+void camera_latest_only_set(camera_t* camera, bool latest_only)
+{
+  // read by the thread using the camera
+  STAT_STORE(camera->latest_only, latest_only);
+}
+
+bool camera_latest_only(camera_t* camera)
+{
+  return STAT_LOAD(camera->latest_only);
+}
+
+void camera_stats_reset(camera_t* camera)
+{
+  // outstanding is the state of the buffers, not a counter
+  camera_stats_t* stats = &camera->stats;
+  STAT_STORE(stats->frames, 0);
+  STAT_STORE(stats->dropped, 0);
+  STAT_STORE(stats->queue_empty, 0);
+  STAT_STORE(stats->skipped, 0);
+  STAT_STORE(stats->max_outstanding, STAT_LOAD(stats->outstanding));
+  STAT_STORE(stats->last_sequence, 0);
+}
+
+void camera_stats_get(camera_t* camera, camera_stats_t* stats)
+{
+  stats->frames = STAT_LOAD(camera->stats.frames);
+  stats->dropped = STAT_LOAD(camera->stats.dropped);
+  stats->queue_empty = STAT_LOAD(camera->stats.queue_empty);
+  stats->skipped = STAT_LOAD(camera->stats.skipped);
+  stats->outstanding = STAT_LOAD(camera->stats.outstanding);
+  stats->max_outstanding = STAT_LOAD(camera->stats.max_outstanding);
+  stats->last_sequence = STAT_LOAD(camera->stats.last_sequence);
+}
+
+bool camera_memory_set(camera_t* camera, camera_memory_t memory, 
+                       bool hugepages)
+{
+  if (memory == camera->memory_request && hugepages == camera->hugepages)
+    return true;
+  if (camera->streaming)
+    return failure(camera, "streaming: stop before changing the memory type");
+  camera->memory_request = memory;
+  camera->hugepages = hugepages;
+  // buffers are reallocated from the new memory at the next camera_start()
+  if (camera->buffer_count > 0) return camera_stop(camera);
+  return true;
+}
+
+bool camera_buffers_export(camera_t* camera)
+{
+  if (!camera_load(camera)) return false;
+  if (camera->memory != CAMERA_MEMORY_MMAP)
+    return failure(camera, "dma-buf export requires MMAP buffers");
+#ifdef VIDIOC_EXPBUF
+  for (size_t i = 0; i < camera->buffer_count; i++) {
+    if (camera->buffers[i].dmabuf_fd != -1) continue;
+    struct v4l2_exportbuffer expbuf;
+    memset(&expbuf, 0, sizeof expbuf);
+    expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    expbuf.index = i;
+    expbuf.flags = O_RDONLY | O_CLOEXEC;
+    if (camera_ioctl(camera, VIDIOC_EXPBUF, &expbuf) == -1)
+      return error(camera, "VIDIOC_EXPBUF");
+    camera->buffers[i].dmabuf_fd = expbuf.fd;
+  }
+  return true;
+#else
+  return failure(camera, "VIDIOC_EXPBUF not supported");
+#endif
+}
+
 
 //[[capturing]
-bool camera_capture(camera_t* camera)
+static bool camera_buffer_dequeue(camera_t* camera, struct v4l2_buffer* buf)
+{
+  memset(buf, 0, sizeof *buf);
+  buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buf->memory = camera->memory == CAMERA_MEMORY_USERPTR ? 
+    V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
+  if (camera_ioctl(camera, VIDIOC_DQBUF, buf) == -1) return false;
+
+  camera_stats_t* stats = &camera->stats;
+  uint32_t last = STAT_LOAD(stats->last_sequence);
+  if (STAT_LOAD(stats->frames) > 0 && buf->sequence > last + 1) {
+    STAT_ADD(stats->dropped, buf->sequence - last - 1);
+  }
+  STAT_STORE(stats->last_sequence, buf->sequence);
+  STAT_ADD(stats->frames, 1);
+  size_t outstanding = STAT_ADD(stats->outstanding, 1);
+  if (outstanding > STAT_LOAD(stats->max_outstanding))
+    STAT_STORE(stats->max_outstanding, outstanding);
+  if (outstanding >= camera->buffer_count) STAT_ADD(stats->queue_empty, 1);
+  return true;
+}
+
+bool camera_frame_acquire(camera_t* camera, camera_frame_t* frame)
 {
   struct v4l2_buffer buf;
-  memset(&buf, 0, sizeof buf);
-  buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  buf.memory = V4L2_MEMORY_MMAP;
-  if (xioctl(camera->fd, VIDIOC_DQBUF, &buf) == -1) return false;
-  memcpy(camera->head.start, camera->buffers[buf.index].start, buf.bytesused);
-  camera->head.length = buf.bytesused;
-  if (xioctl(camera->fd, VIDIOC_QBUF, &buf) == -1) return false;
+  if (!camera_buffer_dequeue(camera, &buf)) return false;
+  if (STAT_LOAD(camera->latest_only)) {
+    // keep the newest ready frame and give the older ones straight back.
+    // one the driver refuses stays counted as outstanding: it is lost to
+    // the ring until the buffers are freed, so the drain stops there
+    struct v4l2_buffer next;
+    while (camera_buffer_dequeue(camera, &next)) {
+      bool queued = camera_buffer_queue(camera, buf.index);
+      if (queued) STAT_SUB(camera->stats.outstanding, 1);
+      else error(camera, "VIDIOC_QBUF skipped frame");
+      STAT_ADD(camera->stats.skipped, 1);
+      buf = next;
+      if (!queued) break;
+    }
+  }
+  frame->start = camera->buffers[buf.index].start;
+  frame->length = buf.bytesused;
+  frame->index = buf.index;
+  frame->dmabuf_fd = camera->buffers[buf.index].dmabuf_fd;
+  frame->meta.timestamp_us = (uint64_t) buf.timestamp.tv_sec * 1000000 + 
+    buf.timestamp.tv_usec;
+  frame->meta.sequence = buf.sequence;
+  frame->meta.bytesused = buf.bytesused;
+  frame->meta.flags = buf.flags;
+  frame->meta.field = buf.field;
+  return true;
+}
+
+bool camera_frame_release(camera_t* camera, camera_frame_t* frame)
+{
+  if (!camera_buffer_queue(camera, frame->index)) return false;
+  if (STAT_LOAD(camera->stats.outstanding) > 0)
+    STAT_SUB(camera->stats.outstanding, 1);
+  frame->start = NULL;
+  frame->length = 0;
   return true;
 }
 
+bool camera_capture(camera_t* camera)
+{
+  if (camera->head.start == NULL) {
+    size_t buf_max = 0;
+    for (size_t i = 0; i < camera->buffer_count; i++) {
+      if (camera->buffers[i].length > buf_max) 
+        buf_max = camera->buffers[i].length;
+    }
+    camera->head.start = calloc(buf_max, sizeof (uint8_t));
+    if (camera->head.start == NULL) {
+      errno = ENOMEM;
+      return error(camera, "calloc head");
+    }
+    camera->head_capacity = buf_max;
+  }
+  camera_frame_t frame;
+  if (!camera_frame_acquire(camera, &frame)) return false;
+  memcpy(camera->head.start, frame.start, frame.length);
+  camera->head.length = frame.length;
+  camera->head_meta = frame.meta;
+  return camera_frame_release(camera, &frame);
+}
+
+
+//[capture thread]
+/* single producer/single consumer ring: head is only written by the 
+ * producer and tail by the consumer, each publishing with release order */
+typedef struct {
+  camera_frame_t* slots;
+  size_t capacity;
+  size_t head;
+  size_t tail;
+} frame_ring_t;
 
+static bool ring_push(frame_ring_t* ring, const camera_frame_t* frame)
+{
+  size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (head - tail == ring->capacity) return false;
+  ring->slots[head % ring->capacity] = *frame;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+static bool ring_pop(frame_ring_t* ring, camera_frame_t* frame)
+{
+  size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  if (head == tail) return false;
+  *frame = ring->slots[tail % ring->capacity];
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+struct camera_thread {
+  camera_t* camera;
+  pthread_t thread;
+  frame_ring_t frames; /* capture thread -> consumer */
+  frame_ring_t returns; /* consumer -> capture thread, to be queued again */
+  int ready_fd; /* eventfd: frames are waiting in the ring */
+  int wake_fd; /* eventfd: returns are waiting, or stop */
+  bool stop;
+  int error; /* errno the capture ended on, 0 while it runs */
+  camera_thread_stats_t stats;
+};
+
+static void eventfd_signal(int fd)
+{
+  uint64_t one = 1;
+  while (write(fd, &one, sizeof one) == -1 && errno == EINTR);
+}
+static void eventfd_clear(int fd)
+{
+  uint64_t count;
+  while (read(fd, &count, sizeof count) == -1 && errno == EINTR);
+}
+
+static void camera_thread_requeue(camera_thread_t* thread)
+{
+  camera_frame_t frame;
+  while (ring_pop(&thread->returns, &frame)) {
+    if (!camera_frame_release(thread->camera, &frame))
+      error(thread->camera, "VIDIOC_QBUF");
+  }
+}
+
+/* ends the capture on a device failure: the consumer drains what is left
+ * in the ring, then camera_thread_pop() fails with the error. returns are
+ * queued again by camera_thread_delete() */
+static void camera_thread_fail(camera_thread_t* thread, int err)
+{
+  __atomic_store_n(&thread->error, err, __ATOMIC_RELEASE);
+  eventfd_signal(thread->ready_fd);
+}
+
+/* the camera is only touched by this thread while it runs: released
+ * frames come back through the returns ring instead of being queued by
+ * the consumer, so the driver calls stay single threaded */
+static void* camera_thread_main(void* arg)
+{
+  camera_thread_t* thread = arg;
+  camera_t* camera = thread->camera;
+  struct pollfd fds[2] = {
+    {.fd = thread->wake_fd, .events = POLLIN},
+    {.fd = camera->fd, .events = POLLIN},
+  };
+  for (;;) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      int err = errno;
+      error(camera, "capture thread: poll");
+      camera_thread_fail(thread, err);
+      break;
+    }
+    if (fds[0].revents & POLLIN) {
+      eventfd_clear(thread->wake_fd);
+      if (__atomic_load_n(&thread->stop, __ATOMIC_ACQUIRE)) break;
+      camera_thread_requeue(thread);
+    }
+    if (fds[1].revents & POLLERR) {
+      // not streaming any more
+      failure(camera, "capture thread: device error");
+      camera_thread_fail(thread, EIO);
+      break;
+    }
+    if (!(fds[1].revents & POLLIN)) continue;
+    camera_frame_t frame;
+    if (!camera_frame_acquire(camera, &frame)) {
+      if (errno == EAGAIN) continue;
+      int err = errno;
+      error(camera, "capture thread: dequeue");
+      camera_thread_fail(thread, err);
+      break;
+    }
+    if (ring_push(&thread->frames, &frame)) {
+      __atomic_fetch_add(&thread->stats.frames, 1, __ATOMIC_RELAXED);
+      eventfd_signal(thread->ready_fd);
+    } else {
+      // the consumer is behind: the frame goes straight back to the driver
+      __atomic_fetch_add(&thread->stats.overruns, 1, __ATOMIC_RELAXED);
+      camera_frame_release(camera, &frame);
+    }
+  }
+  return NULL;
+}
+
+camera_thread_t* camera_thread_new(camera_t* camera, size_t depth)
+{
+  if (camera->buffer_count == 0) {
+    failure(camera, "capture thread: camera not started");
+    return NULL;
+  }
+  if (depth == 0 || depth >= camera->buffer_count) 
+    depth = camera->buffer_count - 1;
+  if (depth == 0) depth = 1;
+  camera_thread_t* thread = calloc(1, sizeof (camera_thread_t));
+  if (thread == NULL) return NULL;
+  thread->camera = camera;
+  thread->frames.capacity = depth;
+  thread->frames.slots = calloc(depth, sizeof (camera_frame_t));
+  // every buffer can be on its way back at once
+  thread->returns.capacity = camera->buffer_count;
+  thread->returns.slots = calloc(camera->buffer_count, sizeof (camera_frame_t));
+  thread->ready_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  thread->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (thread->frames.slots == NULL || thread->returns.slots == NULL ||
+      thread->ready_fd == -1 || thread->wake_fd == -1) {
+    error(camera, "capture thread: allocation");
+    goto fail;
+  }
+  if (pthread_create(&thread->thread, NULL, camera_thread_main, thread) != 0) {
+    failure(camera, "capture thread: pthread_create");
+    goto fail;
+  }
+  return thread;
+fail:
+  if (thread->ready_fd != -1) close(thread->ready_fd);
+  if (thread->wake_fd != -1) close(thread->wake_fd);
+  free(thread->frames.slots);
+  free(thread->returns.slots);
+  free(thread);
+  return NULL;
+}
+
+void camera_thread_delete(camera_thread_t* thread)
+{
+  if (thread == NULL) return;
+  __atomic_store_n(&thread->stop, true, __ATOMIC_RELEASE);
+  eventfd_signal(thread->wake_fd);
+  pthread_join(thread->thread, NULL);
+  camera_frame_t frame;
+  while (ring_pop(&thread->frames, &frame)) 
+    camera_frame_release(thread->camera, &frame);
+  camera_thread_requeue(thread);
+  close(thread->ready_fd);
+  close(thread->wake_fd);
+  free(thread->frames.slots);
+  free(thread->returns.slots);
+  free(thread);
+}
+
+int camera_thread_fd(camera_thread_t* thread)
+{
+  return thread->ready_fd;
+}
+
+bool camera_thread_pop(camera_thread_t* thread, camera_frame_t* frame, 
+                       bool latest)
+{
+  int err = __atomic_load_n(&thread->error, __ATOMIC_ACQUIRE);
+  // after a failure ready_fd stays readable, so that nobody waits on it
+  if (err == 0) eventfd_clear(thread->ready_fd);
+  if (!ring_pop(&thread->frames, frame)) {
+    errno = err != 0 ? err : EAGAIN;
+    return false;
+  }
+  if (latest) {
+    camera_frame_t next;
+    while (ring_pop(&thread->frames, &next)) {
+      camera_thread_release(thread, frame);
+      __atomic_fetch_add(&thread->stats.skipped, 1, __ATOMIC_RELAXED);
+      *frame = next;
+    }
+  }
+  return true;
+}
+
+void camera_thread_release(camera_thread_t* thread, camera_frame_t* frame)
+{
+  // cannot be full: it holds at most every buffer of the camera
+  ring_push(&thread->returns, frame);
+  eventfd_signal(thread->wake_fd);
+  frame->start = NULL;
+  frame->length = 0;
+}
+
+void camera_thread_stats(camera_thread_t* thread, camera_thread_stats_t* stats)
+{
+  stats->frames = __atomic_load_n(&thread->stats.frames, __ATOMIC_RELAXED);
+  stats->overruns = __atomic_load_n(&thread->stats.overruns, __ATOMIC_RELAXED);
+  stats->skipped = __atomic_load_n(&thread->stats.skipped, __ATOMIC_RELAXED);
+  stats->error = __atomic_load_n(&thread->error, __ATOMIC_ACQUIRE);
+}
+
+size_t camera_thread_memory(camera_thread_t* thread)
+{
+  return sizeof *thread + (thread->frames.capacity + thread->returns.capacity)
+    * sizeof (camera_frame_t);
+}
+
+
+//[images]
+size_t camera_image_planes(uint32_t format)
+{
+  switch (format) {
+  case V4L2_PIX_FMT_RGB24: 
+  case V4L2_PIX_FMT_YUYV: return 1;
+  case V4L2_PIX_FMT_NV12: return 2;
+  case V4L2_PIX_FMT_YUV420: return 3;
+  default: return 0;
+  }
+}
+
+void camera_image_plane_size(const camera_image_t* image, size_t plane,
+                             uint32_t* width, uint32_t* height, 
+                             uint32_t* bpp)
+{
+  bool chroma = plane > 0;
+  *width = chroma ? image->width / 2 : image->width;
+  *height = chroma ? image->height / 2 : image->height;
+  switch (image->format) {
+  case V4L2_PIX_FMT_RGB24: *bpp = 3; break;
+  case V4L2_PIX_FMT_YUYV: *bpp = 2; break;
+  case V4L2_PIX_FMT_NV12: *bpp = chroma ? 2 : 1; break;
+  default: *bpp = 1; break;
+  }
+}
+
+size_t camera_image_init(camera_image_t* image, uint8_t* data, 
+                         uint32_t format, uint32_t width, uint32_t height,
+                         uint32_t stride, uint32_t slice_height)
+{
+  memset(image, 0, sizeof *image);
+  image->width = width;
+  image->height = height;
+  image->format = format;
+  image->timestamp_us = -1;
+  size_t planes = camera_image_planes(format);
+  size_t size = 0;
+  for (size_t i = 0; i < planes; i++) {
+    uint32_t plane_width, plane_height, bpp;
+    camera_image_plane_size(image, i, &plane_width, &plane_height, &bpp);
+    /* YU12 chroma rows are half the luma rows, NV12 ones as long */
+    uint32_t plane_stride = stride == 0 ? plane_width * bpp :
+      format == V4L2_PIX_FMT_YUV420 && i > 0 ? stride / 2 : stride;
+    uint32_t rows = slice_height == 0 ? plane_height :
+      i > 0 ? slice_height / 2 : slice_height;
+    image->plane[i] = data + size;
+    image->stride[i] = plane_stride;
+    size += (size_t) plane_stride * rows;
+  }
+  return size;
+}
+
+/* rows of a planar format's luma plane, chroma starting after them: drivers
+ * pad the height to their alignment (bcm2835 1080 to 1088) and say so only
+ * through sizeimage. 0 (the height) unless sizeimage is exactly that */
+static uint32_t camera_slice_height(camera_t* camera)
+{
+  if (camera->format != V4L2_PIX_FMT_YUV420 &&
+      camera->format != V4L2_PIX_FMT_NV12) return 0;
+  size_t stride = camera->bytesperline;
+  if (stride == 0) return 0;
+  size_t slice = camera->image_size * 2 / 3 / stride;
+  if (slice <= camera->height || slice % 2 != 0 ||
+      stride * slice * 3 / 2 != camera->image_size) return 0;
+  return (uint32_t) slice;
+}
+
+size_t camera_image_frame(camera_t* camera, const camera_frame_t* frame,
+                          camera_image_t* image)
+{
+  size_t size = camera_image_init(image, frame->start, camera->format, 
+                                  camera->width, camera->height,
+                                  camera->bytesperline,
+                                  camera_slice_height(camera));
+  image->timestamp_us = frame->meta.timestamp_us;
+  return size <= frame->length ? size : 0;
+}
+
+bool camera_image_copy(const camera_image_t* src, camera_image_t* dst)
+{
+  if (src->format != dst->format || src->width != dst->width ||
+      src->height != dst->height) return false;
+  size_t planes = camera_image_planes(src->format);
+  for (size_t i = 0; i < planes; i++) {
+    uint32_t width, height, bpp;
+    camera_image_plane_size(src, i, &width, &height, &bpp);
+    size_t row = (size_t) width * bpp;
+    if (height == 0) continue;
+    if (src->stride[i] == dst->stride[i]) {
+      /* the last row may end without its padding */
+      memcpy(dst->plane[i], src->plane[i], 
+             (size_t) src->stride[i] * (height - 1) + row);
+      continue;
+    }
+    for (uint32_t y = 0; y < height; y++) {
+      memcpy(dst->plane[i] + (size_t) y * dst->stride[i], 
+             src->plane[i] + (size_t) y * src->stride[i], row);
+    }
+  }
+  dst->timestamp_us = src->timestamp_us;
+  return true;
+}
+
+
+//[color conversion]
 static inline int minmax(int min, int v, int max)
 {
   return (v < min) ? min : (max < v) ? max : v;
@@ -250,42 +1421,393 @@ static inline uint8_t yuv2b(int y, int u, int v)
 {
   return minmax(0, (y + 454 * u) >> 8, 255);
 }
-uint8_t* yuyv2rgb(uint8_t* yuyv, uint32_t width, uint32_t height)
+static void 
+yuyv2rgb_row_scalar(const uint8_t* yuyv, uint8_t* rgb, uint32_t width)
 {
-  uint8_t* rgb = calloc(width * height * 3, sizeof (uint8_t));
-  uint8_t* rgbp = rgb;
-  for (size_t i = 0; i < height; i++) {
-    for (size_t j = 0; j < width; j += 2) {
-#if 0
-      size_t index = i * width + j;
-      int y0 = yuyv[index * 2 + 0] << 8;
-      int u = yuyv[index * 2 + 1] - 128;
-      int y1 = yuyv[index * 2 + 2] << 8;
-      int v = yuyv[index * 2 + 3] - 128;
-      rgb[index * 3 + 0] = yuv2r(y0, u, v);
-      rgb[index * 3 + 1] = yuv2g(y0, u, v);
-      rgb[index * 3 + 2] = yuv2b(y0, u, v);
-      rgb[index * 3 + 3] = yuv2r(y1, u, v);
-      rgb[index * 3 + 4] = yuv2g(y1, u, v);
-      rgb[index * 3 + 5] = yuv2b(y1, u, v);
-#else
-      int y0 = *yuyv++ << 8;
-      int u = *yuyv++ - 128;
-      int y1 = *yuyv++ << 8;
-      int v = *yuyv++ - 128;
-      *rgbp++ = yuv2r(y0, u, v);
-      *rgbp++ = yuv2g(y0, u, v);
-      *rgbp++ = yuv2b(y0, u, v);
-      *rgbp++ = yuv2r(y1, u, v);
-      *rgbp++ = yuv2g(y1, u, v);
-      *rgbp++ = yuv2b(y1, u, v);
+  for (uint32_t j = 0; j < width; j += 2) {
+    int y0 = *yuyv++ << 8;
+    int u = *yuyv++ - 128;
+    int y1 = *yuyv++ << 8;
+    int v = *yuyv++ - 128;
+    *rgb++ = yuv2r(y0, u, v);
+    *rgb++ = yuv2g(y0, u, v);
+    *rgb++ = yuv2b(y0, u, v);
+    *rgb++ = yuv2r(y1, u, v);
+    *rgb++ = yuv2g(y1, u, v);
+    *rgb++ = yuv2b(y1, u, v);
+  }
+}
+
+/* the vector kernels compute (y << 8 + k * c) >> 8 as y + ((k * c) >> 8),
+ * which is the same value, so the output is bit-identical to the scalar one.
+ * the products are done in 32 bits and saturation replaces the clamps */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CAMERA_YUYV2RGB_X86
+
+__attribute__((target("sse2"))) static void 
+yuyv2rgb_row_sse2(const uint8_t* yuyv, uint8_t* rgb, uint32_t width)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i mask = _mm_set1_epi16(0x00ff);
+  const __m128i bias = _mm_set1_epi16(128);
+  // (u, v) pairs of each macro pixel are multiplied by (lo, hi) words
+  const __m128i kr = _mm_set_epi16(359, 0, 359, 0, 359, 0, 359, 0);
+  const __m128i kg = 
+    _mm_set_epi16(88, -183, 88, -183, 88, -183, 88, -183);
+  const __m128i kb = _mm_set_epi16(0, 454, 0, 454, 0, 454, 0, 454);
+  uint32_t x = 0;
+  // each step stores one byte past its 8 pixels: keep a pixel behind it
+  for (; x + 8 < width; x += 8) {
+    __m128i in = _mm_loadu_si128((const __m128i*) (yuyv + x * 2));
+    __m128i y = _mm_and_si128(in, mask);
+    __m128i uv = _mm_sub_epi16(_mm_srli_epi16(in, 8), bias);
+    __m128i dr = _mm_srai_epi32(_mm_madd_epi16(uv, kr), 8);
+    __m128i dg = _mm_srai_epi32(_mm_madd_epi16(uv, kg), 8);
+    __m128i db = _mm_srai_epi32(_mm_madd_epi16(uv, kb), 8);
+    dr = _mm_packs_epi32(dr, dr);
+    dg = _mm_packs_epi32(dg, dg);
+    db = _mm_packs_epi32(db, db);
+    __m128i r = _mm_add_epi16(y, _mm_unpacklo_epi16(dr, dr));
+    __m128i g = _mm_add_epi16(y, _mm_unpacklo_epi16(dg, dg));
+    __m128i b = _mm_add_epi16(y, _mm_unpacklo_epi16(db, db));
+    r = _mm_packus_epi16(r, zero);
+    g = _mm_packus_epi16(g, zero);
+    b = _mm_packus_epi16(b, zero);
+    __m128i rg = _mm_unpacklo_epi8(r, g);
+    __m128i bz = _mm_unpacklo_epi8(b, zero);
+    __m128i rgbx[2] = {
+      _mm_unpacklo_epi16(rg, bz), _mm_unpackhi_epi16(rg, bz),
+    };
+    uint8_t* out = rgb + x * 3;
+    for (int h = 0; h < 2; h++) {
+      for (int i = 0; i < 4; i++) {
+        uint32_t pixel = _mm_cvtsi128_si32(rgbx[h]);
+        memcpy(out, &pixel, sizeof pixel);
+        out += 3;
+        rgbx[h] = _mm_srli_si128(rgbx[h], 4);
+      }
+    }
+  }
+  yuyv2rgb_row_scalar(yuyv + x * 2, rgb + x * 3, width - x);
+}
+
+__attribute__((target("avx2"))) static void 
+yuyv2rgb_row_avx2(const uint8_t* yuyv, uint8_t* rgb, uint32_t width)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i mask = _mm256_set1_epi16(0x00ff);
+  const __m256i bias = _mm256_set1_epi16(128);
+  const __m256i kr = _mm256_set1_epi32(359 << 16);
+  const __m256i kg = _mm256_set1_epi32((88 << 16) | (uint16_t) -183);
+  const __m256i kb = _mm256_set1_epi32(454);
+  const __m256i pack = 
+    _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                     0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  uint32_t x = 0;
+  // all steps stay inside 128-bit lanes: pixels 0-7 low, 8-15 high.
+  // each step stores 4 bytes past its 16 pixels: keep 2 pixels behind it
+  for (; x + 18 <= width; x += 16) {
+    __m256i in = _mm256_loadu_si256((const __m256i*) (yuyv + x * 2));
+    __m256i y = _mm256_and_si256(in, mask);
+    __m256i uv = _mm256_sub_epi16(_mm256_srli_epi16(in, 8), bias);
+    __m256i dr = _mm256_srai_epi32(_mm256_madd_epi16(uv, kr), 8);
+    __m256i dg = _mm256_srai_epi32(_mm256_madd_epi16(uv, kg), 8);
+    __m256i db = _mm256_srai_epi32(_mm256_madd_epi16(uv, kb), 8);
+    dr = _mm256_packs_epi32(dr, dr);
+    dg = _mm256_packs_epi32(dg, dg);
+    db = _mm256_packs_epi32(db, db);
+    __m256i r = _mm256_add_epi16(y, _mm256_unpacklo_epi16(dr, dr));
+    __m256i g = _mm256_add_epi16(y, _mm256_unpacklo_epi16(dg, dg));
+    __m256i b = _mm256_add_epi16(y, _mm256_unpacklo_epi16(db, db));
+    r = _mm256_packus_epi16(r, zero);
+    g = _mm256_packus_epi16(g, zero);
+    b = _mm256_packus_epi16(b, zero);
+    __m256i rg = _mm256_unpacklo_epi8(r, g);
+    __m256i bz = _mm256_unpacklo_epi8(b, zero);
+    __m256i lo = _mm256_shuffle_epi8(_mm256_unpacklo_epi16(rg, bz), pack);
+    __m256i hi = _mm256_shuffle_epi8(_mm256_unpackhi_epi16(rg, bz), pack);
+    uint8_t* out = rgb + x * 3;
+    _mm_storeu_si128((__m128i*) (out + 0), _mm256_castsi256_si128(lo));
+    _mm_storeu_si128((__m128i*) (out + 12), _mm256_castsi256_si128(hi));
+    _mm_storeu_si128((__m128i*) (out + 24), _mm256_extracti128_si256(lo, 1));
+    _mm_storeu_si128((__m128i*) (out + 36), _mm256_extracti128_si256(hi, 1));
+  }
+  yuyv2rgb_row_sse2(yuyv + x * 2, rgb + x * 3, width - x);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CAMERA_YUYV2RGB_NEON
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
 #endif
+
+static inline int16x8_t neon_shift8(int32x4_t lo, int32x4_t hi)
+{
+  return vcombine_s16(vmovn_s32(vshrq_n_s32(lo, 8)), 
+                      vmovn_s32(vshrq_n_s32(hi, 8)));
+}
+static inline uint8x8x2_t 
+neon_channel(uint8x8_t y0, uint8x8_t y1, int16x8_t d)
+{
+  uint8x8_t c0 = vqmovun_s16(vaddq_s16(vreinterpretq_s16_u16(vmovl_u8(y0)), d));
+  uint8x8_t c1 = vqmovun_s16(vaddq_s16(vreinterpretq_s16_u16(vmovl_u8(y1)), d));
+  return vzip_u8(c0, c1);
+}
+static void 
+yuyv2rgb_row_neon(const uint8_t* yuyv, uint8_t* rgb, uint32_t width)
+{
+  const int16x8_t bias = vdupq_n_s16(128);
+  uint32_t x = 0;
+  for (; x + 16 <= width; x += 16) {
+    // val[0]: even y, val[1]: u, val[2]: odd y, val[3]: v
+    uint8x8x4_t in = vld4_u8(yuyv + x * 2);
+    int16x8_t u = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(in.val[1])), bias);
+    int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(in.val[3])), bias);
+    int16x4_t ul = vget_low_s16(u), uh = vget_high_s16(u);
+    int16x4_t vl = vget_low_s16(v), vh = vget_high_s16(v);
+    int16x8_t dr = neon_shift8(vmull_n_s16(vl, 359), vmull_n_s16(vh, 359));
+    int16x8_t dg = neon_shift8(vmlal_n_s16(vmull_n_s16(vl, 88), ul, -183),
+                               vmlal_n_s16(vmull_n_s16(vh, 88), uh, -183));
+    int16x8_t db = neon_shift8(vmull_n_s16(ul, 454), vmull_n_s16(uh, 454));
+    uint8x8x2_t r = neon_channel(in.val[0], in.val[2], dr);
+    uint8x8x2_t g = neon_channel(in.val[0], in.val[2], dg);
+    uint8x8x2_t b = neon_channel(in.val[0], in.val[2], db);
+    for (int h = 0; h < 2; h++) {
+      uint8x8x3_t out = {{ r.val[h], g.val[h], b.val[h] }};
+      vst3_u8(rgb + x * 3 + h * 24, out);
     }
   }
+  yuyv2rgb_row_scalar(yuyv + x * 2, rgb + x * 3, width - x);
+}
+#endif
+
+static camera_yuyv2rgb_kernel_t yuyv2rgb_kernel_list[4];
+static size_t yuyv2rgb_kernel_count = 0;
+
+static void yuyv2rgb_kernels_init(void)
+{
+  size_t n = 0;
+#ifdef CAMERA_YUYV2RGB_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    yuyv2rgb_kernel_list[n++] = 
+      (camera_yuyv2rgb_kernel_t) {"avx2", &yuyv2rgb_row_avx2};
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    yuyv2rgb_kernel_list[n++] = 
+      (camera_yuyv2rgb_kernel_t) {"sse2", &yuyv2rgb_row_sse2};
+  }
+#endif
+#ifdef CAMERA_YUYV2RGB_NEON
+#if defined(__aarch64__)
+  bool neon = true;
+#else
+  bool neon = (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+  if (neon) {
+    yuyv2rgb_kernel_list[n++] = 
+      (camera_yuyv2rgb_kernel_t) {"neon", &yuyv2rgb_row_neon};
+  }
+#endif
+  yuyv2rgb_kernel_list[n++] = 
+    (camera_yuyv2rgb_kernel_t) {"scalar", &yuyv2rgb_row_scalar};
+  yuyv2rgb_kernel_count = n;
+}
+
+size_t camera_yuyv2rgb_kernels(const camera_yuyv2rgb_kernel_t** kernels)
+{
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, &yuyv2rgb_kernels_init);
+  *kernels = yuyv2rgb_kernel_list;
+  return yuyv2rgb_kernel_count;
+}
+
+void camera_yuyv2rgb(const uint8_t* yuyv, size_t yuyv_stride, 
+                     uint8_t* rgb, size_t rgb_stride, 
+                     uint32_t width, uint32_t height)
+{
+  const camera_yuyv2rgb_kernel_t* kernels;
+  camera_yuyv2rgb_kernels(&kernels);
+  camera_yuyv2rgb_row_t row = kernels[0].row;
+  for (uint32_t i = 0; i < height; i++) {
+    row(yuyv + i * yuyv_stride, rgb + i * rgb_stride, width);
+  }
+}
+
+uint8_t* yuyv2rgb(uint8_t* yuyv, uint32_t width, uint32_t height)
+{
+  uint8_t* rgb = malloc((size_t) width * height * 3);
+  if (rgb == NULL) return NULL;
+  camera_yuyv2rgb(yuyv, width * 2, rgb, width * 3, width, height);
   return rgb;
 }
 
 
+//[workers]
+struct camera_workers {
+  size_t count;
+  pthread_t* threads;
+  pthread_mutex_t mutex;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  uint64_t generation;
+  size_t pending;
+  bool stop;
+  camera_workers_job_t job;
+  void* arg;
+};
+
+typedef struct {
+  camera_workers_t* workers;
+  size_t index;
+} worker_arg_t;
+
+static void* worker_main(void* pointer)
+{
+  worker_arg_t* warg = pointer;
+  camera_workers_t* workers = warg->workers;
+  size_t index = warg->index;
+  free(warg);
+
+  uint64_t seen = 0;
+  pthread_mutex_lock(&workers->mutex);
+  for (;;) {
+    while (!workers->stop && workers->generation == seen) 
+      pthread_cond_wait(&workers->start, &workers->mutex);
+    if (workers->stop) break;
+    seen = workers->generation;
+    camera_workers_job_t job = workers->job;
+    void* arg = workers->arg;
+    pthread_mutex_unlock(&workers->mutex);
+    job(arg, index, workers->count);
+    pthread_mutex_lock(&workers->mutex);
+    if (--workers->pending == 0) pthread_cond_signal(&workers->done);
+  }
+  pthread_mutex_unlock(&workers->mutex);
+  return NULL;
+}
+
+camera_workers_t* camera_workers_new(size_t count)
+{
+  if (count == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    count = online > 0 ? online : 1;
+  }
+  if (count > CAMERA_WORKERS_MAX) count = CAMERA_WORKERS_MAX;
+  camera_workers_t* workers = malloc(sizeof (camera_workers_t));
+  if (workers == NULL) return NULL;
+  workers->threads = calloc(count, sizeof (pthread_t));
+  if (workers->threads == NULL) {
+    free(workers);
+    return NULL;
+  }
+  workers->count = count;
+  pthread_mutex_init(&workers->mutex, NULL);
+  pthread_cond_init(&workers->start, NULL);
+  pthread_cond_init(&workers->done, NULL);
+  workers->generation = 0;
+  workers->pending = 0;
+  workers->stop = false;
+  workers->job = NULL;
+  workers->arg = NULL;
+  // the calling thread runs band 0 itself: with the threads that started,
+  // the bands are fewer
+  for (size_t i = 1; i < count; i++) {
+    worker_arg_t* warg = malloc(sizeof (worker_arg_t));
+    if (warg == NULL) {
+      workers->count = i;
+      break;
+    }
+    warg->workers = workers;
+    warg->index = i;
+    if (pthread_create(&workers->threads[i], NULL, &worker_main, warg) != 0) {
+      free(warg);
+      workers->count = i;
+      break;
+    }
+  }
+  return workers;
+}
+
+void camera_workers_delete(camera_workers_t* workers)
+{
+  pthread_mutex_lock(&workers->mutex);
+  workers->stop = true;
+  pthread_cond_broadcast(&workers->start);
+  pthread_mutex_unlock(&workers->mutex);
+  for (size_t i = 1; i < workers->count; i++) {
+    pthread_join(workers->threads[i], NULL);
+  }
+  pthread_cond_destroy(&workers->done);
+  pthread_cond_destroy(&workers->start);
+  pthread_mutex_destroy(&workers->mutex);
+  free(workers->threads);
+  free(workers);
+}
+
+size_t camera_workers_count(camera_workers_t* workers)
+{
+  return workers->count;
+}
+
+void camera_workers_run(camera_workers_t* workers, 
+                        camera_workers_job_t job, void* arg)
+{
+  pthread_mutex_lock(&workers->mutex);
+  workers->job = job;
+  workers->arg = arg;
+  workers->pending = workers->count - 1;
+  workers->generation++;
+  pthread_cond_broadcast(&workers->start);
+  pthread_mutex_unlock(&workers->mutex);
+
+  job(arg, 0, workers->count);
+
+  pthread_mutex_lock(&workers->mutex);
+  while (workers->pending > 0) 
+    pthread_cond_wait(&workers->done, &workers->mutex);
+  pthread_mutex_unlock(&workers->mutex);
+}
+
+typedef struct {
+  camera_yuyv2rgb_row_t row;
+  const uint8_t* yuyv;
+  size_t yuyv_stride;
+  uint8_t* rgb;
+  size_t rgb_stride;
+  uint32_t width;
+  uint32_t height;
+} yuyv2rgb_band_t;
+
+static void yuyv2rgb_band(void* arg, size_t band, size_t bands)
+{
+  yuyv2rgb_band_t* job = arg;
+  uint32_t top = (uint64_t) job->height * band / bands;
+  uint32_t bottom = (uint64_t) job->height * (band + 1) / bands;
+  for (uint32_t i = top; i < bottom; i++) {
+    job->row(job->yuyv + i * job->yuyv_stride, 
+             job->rgb + i * job->rgb_stride, job->width);
+  }
+}
+
+void camera_yuyv2rgb_parallel(camera_workers_t* workers, 
+                              const uint8_t* yuyv, size_t yuyv_stride, 
+                              uint8_t* rgb, size_t rgb_stride, 
+                              uint32_t width, uint32_t height)
+{
+  const camera_yuyv2rgb_kernel_t* kernels;
+  camera_yuyv2rgb_kernels(&kernels);
+  yuyv2rgb_band_t job = {
+    kernels[0].row, yuyv, yuyv_stride, rgb, rgb_stride, width, height,
+  };
+  camera_workers_run(workers, &yuyv2rgb_band, &job);
+}
+
+
 //[formats and config]
 uint32_t camera_format_id(const char* name)
 {
@@ -302,7 +1824,7 @@ void camera_format_name(uint32_t format_id, char* name)
   name[4] = '\0';
 }
 
-static bool camera_format_set(camera_t* camera, camera_format_t* format)
+static int camera_format_apply(camera_t* camera, camera_format_t* format)
 {
   if (format->width > 0 && format->height > 0) {
     uint32_t pixformat = format->format ? format->format : V4L2_PIX_FMT_YUYV;
@@ -313,16 +1835,22 @@ static bool camera_format_set(camera_t* camera, camera_format_t* format)
     vformat.fmt.pix.height = format->height;
     vformat.fmt.pix.pixelformat = pixformat;
     vformat.fmt.pix.field = V4L2_FIELD_NONE;
-    if (xioctl(camera->fd, VIDIOC_S_FMT, &vformat) == -1)
-      return error(camera, "VIDIOC_S_FMT");
+    if (camera_ioctl(camera, VIDIOC_S_FMT, &vformat) == -1) return -1;
   }
+  return 0;
+}
+
+static bool camera_format_set(camera_t* camera, camera_format_t* format)
+{
+  if (camera_format_apply(camera, format) == -1)
+    return error(camera, "VIDIOC_S_FMT");
   if (format->interval.numerator != 0 && format->interval.denominator != 0) {
     struct v4l2_streamparm parm;
     memset(&parm, 0, sizeof parm);
     parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     parm.parm.capture.timeperframe.numerator = format->interval.numerator;
     parm.parm.capture.timeperframe.denominator = format->interval.denominator;
-    if (xioctl(camera->fd, VIDIOC_S_PARM, &parm) == -1)
+    if (camera_ioctl(camera, VIDIOC_S_PARM, &parm) == -1)
       return error(camera, "VIDIOC_S_PARM");    
   }
   return true;
@@ -333,7 +1861,7 @@ static bool camera_format_get(camera_t* camera, camera_format_t* format)
   struct v4l2_format vformat;
   memset(&vformat, 0, sizeof vformat);
   vformat.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  if (xioctl(camera->fd, VIDIOC_G_FMT, &vformat) == -1)
+  if (camera_ioctl(camera, VIDIOC_G_FMT, &vformat) == -1)
     return error(camera, "VIDIOC_G_FMT");
   
   format->format = vformat.fmt.pix.pixelformat;
@@ -343,7 +1871,7 @@ static bool camera_format_get(camera_t* camera, camera_format_t* format)
   struct v4l2_streamparm parm;
   memset(&parm, 0, sizeof parm);
   parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  if (xioctl(camera->fd, VIDIOC_G_PARM, &parm) == -1)
+  if (camera_ioctl(camera, VIDIOC_G_PARM, &parm) == -1)
     return error(camera, "VIDIOC_G_PARM");
   format->interval.numerator = parm.parm.capture.timeperframe.numerator;
   format->interval.denominator = parm.parm.capture.timeperframe.denominator;
@@ -356,6 +1884,7 @@ bool camera_config_get(camera_t* camera, camera_format_t* format)
 }
 bool camera_config_set(camera_t* camera, camera_format_t* format)
 {
+  camera_controls_invalidate(camera);
   if (camera->buffer_count > 0) {
     if (!camera_stop(camera)) return false;
   }
@@ -367,6 +1896,227 @@ bool camera_config_set(camera_t* camera, camera_format_t* format)
   return camera_buffer_prepare(camera);
 }
 
+static size_t camera_buffer_length(camera_t* camera, bool largest)
+{
+  size_t length = largest ? 0 : SIZE_MAX;
+  for (size_t i = 0; i < camera->buffer_count; i++) {
+    size_t l = camera->buffers[i].length;
+    if (largest ? l > length : l < length) length = l;
+  }
+  return length;
+}
+
+/* the format change itself, with the stream off. false when the camera 
+ * is left with the previous format or with no buffers */
+static bool camera_reconfigure_stopped(camera_t* camera, 
+                                       camera_format_t* format)
+{
+  size_t largest = camera_buffer_length(camera, true);
+  size_t previous = camera->image_size;
+
+  // some drivers take S_FMT while buffers exist: keep them when they fit
+  bool applied = camera_format_apply(camera, format) != -1;
+  if (!applied && errno != EBUSY) return error(camera, "VIDIOC_S_FMT");
+  if (applied) {
+    camera_format_t rate = {0, 0, 0, {format->interval.numerator, 
+                                      format->interval.denominator}};
+    if (!camera_format_set(camera, &rate)) return false;
+    if (!camera_load_settings(camera)) return false;
+    if (camera->image_size <= camera_buffer_length(camera, false)) 
+      return true;
+  }
+
+  // release the driver side only: the user pointer pool is kept for reuse
+  camera_buffer_t* pool = NULL;
+  size_t pool_count = 0;
+  bool userptr = camera->memory == CAMERA_MEMORY_USERPTR;
+  if (userptr) {
+    pool = camera->buffers;
+    pool_count = camera->buffer_count;
+    camera->buffers = NULL;
+    camera->buffer_count = 0;
+  } else {
+    free_buffers(camera, camera->buffer_count);
+  }
+  struct v4l2_requestbuffers req;
+  memset(&req, 0, sizeof req);
+  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  req.memory = userptr ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
+  bool ok = camera_ioctl(camera, VIDIOC_REQBUFS, &req) != -1;
+  if (!ok) error(camera, "VIDIOC_REQBUFS 0");
+  else STAT_STORE(camera->stats.outstanding, 0);
+  if (ok && !applied) {
+    ok = camera_format_set(camera, format) && camera_load_settings(camera);
+  }
+  if (!ok) {
+    for (size_t i = 0; i < pool_count; i++) 
+      munmap(pool[i].start, pool[i].length);
+    free(pool);
+    return false;
+  }
+  // sized for both formats, so switching back may keep the buffers
+  size_t sizeimage = camera->image_size > previous ? 
+    camera->image_size : previous;
+  if (!camera_buffer_prepare_pool(camera, sizeimage, pool, pool_count)) 
+    return false;
+  if (camera_buffer_length(camera, true) > largest) {
+    // reallocated by camera_capture() at the new size
+    free(camera->head.start);
+    camera->head.start = NULL;
+    camera->head.length = 0;
+    camera->head_capacity = 0;
+  }
+  return true;
+}
+
+/* after camera_reconfigure_stopped() failed: the previous format back, on 
+ * the buffers left or on new ones, and streaming again when it was. errno
+ * and the logged reason are those of the original failure unless this 
+ * fails too */
+static void camera_reconfigure_rollback(camera_t* camera, 
+                                        camera_format_t* previous,
+                                        bool restart)
+{
+  int err = errno;
+  bool ok = camera_format_apply(camera, previous) != -1;
+  if (!ok && errno == EBUSY && camera->buffer_count > 0) {
+    // the driver takes no format change over its buffers
+    ok = camera_stop(camera) && camera_format_apply(camera, previous) != -1;
+  }
+  camera_format_t rate = {0, 0, 0, {previous->interval.numerator, 
+                                    previous->interval.denominator}};
+  ok = ok && camera_format_set(camera, &rate) && camera_load_settings(camera);
+  if (ok && camera->buffer_count > 0 && 
+      camera->image_size > camera_buffer_length(camera, false)) {
+    ok = camera_stop(camera);
+  }
+  if (ok && camera->buffer_count == 0) ok = camera_buffer_prepare(camera);
+  if (ok && restart) ok = camera_start(camera);
+  if (!ok) 
+    failure(camera, "reconfigure failed and the previous format could not "
+            "be restored: camera stopped");
+  errno = err;
+}
+
+bool camera_reconfigure(camera_t* camera, camera_format_t* format)
+{
+  camera_controls_invalidate(camera);
+  if (camera->buffer_count == 0) return camera_config_set(camera, format);
+  bool same = (format->format == 0 || format->format == camera->format) &&
+    (format->width == 0 || format->width == camera->width) &&
+    (format->height == 0 || format->height == camera->height);
+  if (same) {
+    // frame rate alone: S_PARM, which drivers take while streaming. never
+    // through STREAMOFF, so that a refusal leaves the stream untouched
+    if (format->interval.numerator == 0 || format->interval.denominator == 0)
+      return true;
+    camera_format_t rate = {0, 0, 0, {format->interval.numerator, 
+                                      format->interval.denominator}};
+    return camera_format_set(camera, &rate);
+  }
+
+  camera_format_t previous;
+  if (!camera_format_get(camera, &previous)) return false;
+  bool restart = camera->streaming;
+  if (restart) {
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (camera_ioctl(camera, VIDIOC_STREAMOFF, &type) == -1) 
+      return error(camera, "VIDIOC_STREAMOFF");
+    camera->streaming = false;
+  }
+  if (!camera_reconfigure_stopped(camera, format)) {
+    camera_reconfigure_rollback(camera, &previous, restart);
+    return false;
+  }
+  return restart ? camera_start(camera) : true;
+}
+
+
+//[crop]
+static void rect_from_v4l2(camera_rect_t* rect, const struct v4l2_rect* r)
+{
+  rect->left = r->left;
+  rect->top = r->top;
+  rect->width = r->width;
+  rect->height = r->height;
+}
+
+bool camera_crop_get(camera_t* camera, camera_rect_t* bounds, 
+                     camera_rect_t* crop)
+{
+  struct v4l2_selection sel;
+  memset(&sel, 0, sizeof sel);
+  sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  sel.target = V4L2_SEL_TGT_CROP_BOUNDS;
+  if (camera_ioctl(camera, VIDIOC_G_SELECTION, &sel) == 0) {
+    rect_from_v4l2(bounds, &sel.r);
+    sel.target = V4L2_SEL_TGT_CROP;
+    if (camera_ioctl(camera, VIDIOC_G_SELECTION, &sel) == -1)
+      return error(camera, "VIDIOC_G_SELECTION");
+    rect_from_v4l2(crop, &sel.r);
+    return true;
+  }
+  if (errno != ENOTTY && errno != EINVAL) 
+    return error(camera, "VIDIOC_G_SELECTION");
+
+  // drivers predating the selection API
+  struct v4l2_cropcap cropcap;
+  memset(&cropcap, 0, sizeof cropcap);
+  cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (camera_ioctl(camera, VIDIOC_CROPCAP, &cropcap) == -1) {
+    if (errno != ENOTTY && errno != EINVAL) 
+      return error(camera, "VIDIOC_CROPCAP");
+    // no cropping at all: the frame is the whole sensor
+    if (camera->width == 0 && !camera_load_settings(camera)) return false;
+    camera_rect_t whole = {0, 0, camera->width, camera->height};
+    *bounds = *crop = whole;
+    return true;
+  }
+  rect_from_v4l2(bounds, &cropcap.bounds);
+  struct v4l2_crop c;
+  memset(&c, 0, sizeof c);
+  c.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (camera_ioctl(camera, VIDIOC_G_CROP, &c) == -1) {
+    rect_from_v4l2(crop, &cropcap.defrect);
+    return true;
+  }
+  rect_from_v4l2(crop, &c.c);
+  return true;
+}
+
+bool camera_crop_set(camera_t* camera, camera_rect_t* crop)
+{
+  if (!camera->initialized) {
+    if (!camera_init(camera)) return false;
+  }
+  camera_controls_invalidate(camera);
+  struct v4l2_rect r = {crop->left, crop->top, crop->width, crop->height};
+  struct v4l2_selection sel;
+  memset(&sel, 0, sizeof sel);
+  sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  sel.target = V4L2_SEL_TGT_CROP;
+  sel.r = r;
+  if (camera_ioctl(camera, VIDIOC_S_SELECTION, &sel) == 0) {
+    rect_from_v4l2(crop, &sel.r);
+  } else {
+    if (errno != ENOTTY && errno != EINVAL) 
+      return error(camera, "VIDIOC_S_SELECTION");
+    struct v4l2_crop c;
+    memset(&c, 0, sizeof c);
+    c.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    c.c = r;
+    if (camera_ioctl(camera, VIDIOC_S_CROP, &c) == -1) {
+      if (errno == ENOTTY) return failure(camera, "cropping not supported");
+      return error(camera, "VIDIOC_S_CROP");
+    }
+    // S_CROP does not return the rectangle the driver settled on
+    if (camera_ioctl(camera, VIDIOC_G_CROP, &c) == 0) rect_from_v4l2(crop, &c.c);
+  }
+  // some drivers shrink the format along with the crop
+  if (camera->buffer_count == 0) return camera_load_settings(camera);
+  return true;
+}
+
 camera_formats_t*  camera_formats_new(camera_t* camera)
 {
   camera_formats_t* ret = malloc(sizeof (camera_formats_t));
@@ -377,14 +2127,14 @@ camera_formats_t*  camera_formats_new(camera_t* camera)
     memset(&fmt, 0, sizeof fmt);
     fmt.index = i;
     fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (ioctl(camera->fd, VIDIOC_ENUM_FMT, &fmt) == -1) break;
+    if (camera_ioctl(camera, VIDIOC_ENUM_FMT, &fmt) == -1) break;
     //printf("[%s]\n", fmt.description);
     for (uint32_t j = 0; ; j++) {
       struct v4l2_frmsizeenum frmsize;
       memset(&frmsize, 0, sizeof frmsize);
       frmsize.index = j;
       frmsize.pixel_format = fmt.pixelformat;
-      if (ioctl(camera->fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) == -1) break;
+      if (camera_ioctl(camera, VIDIOC_ENUM_FRAMESIZES, &frmsize) == -1) break;
       if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
         //printf("- w: %d, h: %d\n", 
         //       frmsize.discrete.width, frmsize.discrete.height);
@@ -395,7 +2145,7 @@ camera_formats_t*  camera_formats_new(camera_t* camera)
           frmival.pixel_format = fmt.pixelformat;
           frmival.width = frmsize.discrete.width;
           frmival.height = frmsize.discrete.height;
-          if (ioctl(camera->fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) == -1) 
+          if (camera_ioctl(camera, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) == -1) 
             break;
           if (frmival.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
             //printf("  - fps: %d/%d\n", 
@@ -474,52 +2224,90 @@ camera_controls_menus(camera_t* camera, camera_control_t* control)
     memset(&qmenu, 0, sizeof qmenu);
     qmenu.id = control->id;
     qmenu.index = mindex;
-    if (ioctl(camera->fd, VIDIOC_QUERYMENU, &qmenu) == 0) {
+    if (camera_ioctl(camera, VIDIOC_QUERYMENU, &qmenu) == 0) {
       copy(&control->menus.head[mindex], &qmenu);
     }
   }
 }
-static camera_control_t* 
-camera_controls_query(camera_t* camera, camera_control_t* control_list)
+static void camera_controls_append(camera_t* camera, 
+                                   camera_controls_t* controls,
+                                   size_t* capacity, 
+                                   struct v4l2_queryctrl* qctrl)
 {
-  camera_control_t* control_list_last = control_list;
-  
+  if (qctrl->type == V4L2_CTRL_TYPE_CTRL_CLASS) return;
+  if (controls->length == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 32;
+    controls->head = 
+      realloc(controls->head, *capacity * sizeof (camera_control_t));
+  }
+  camera_control_t* control = &controls->head[controls->length++];
+  control->id = qctrl->id;
+  memcpy(control->name, qctrl->name, sizeof qctrl->name);
+  control->flags.disabled = (qctrl->flags & V4L2_CTRL_FLAG_DISABLED) != 0;
+  control->flags.grabbed = (qctrl->flags & V4L2_CTRL_FLAG_GRABBED) != 0;
+  control->flags.read_only = (qctrl->flags & V4L2_CTRL_FLAG_READ_ONLY) != 0;
+  control->flags.update = (qctrl->flags & V4L2_CTRL_FLAG_UPDATE) != 0;
+  control->flags.inactive = (qctrl->flags & V4L2_CTRL_FLAG_INACTIVE) != 0;
+  control->flags.slider = (qctrl->flags & V4L2_CTRL_FLAG_SLIDER) != 0;
+  control->flags.write_only = (qctrl->flags & V4L2_CTRL_FLAG_WRITE_ONLY) != 0;
+  control->flags.volatile_value = 
+    (qctrl->flags & V4L2_CTRL_FLAG_VOLATILE) != 0;
+  control->type = qctrl->type;
+  control->max = qctrl->maximum;
+  control->min = qctrl->minimum;
+  control->step = qctrl->step;
+  control->default_value = qctrl->default_value;
+  camera_controls_menus(camera, control);
+}
+static camera_controls_t* camera_controls_query(camera_t* camera)
+{
+  camera_controls_t* controls = calloc(1, sizeof (camera_controls_t));
+  size_t capacity = 0;
+  // walk every control class when the driver supports NEXT_CTRL,
+  // otherwise probe the user class ids one by one
+  struct v4l2_queryctrl qctrl;
+  memset(&qctrl, 0, sizeof qctrl);
+  qctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+  if (camera_ioctl(camera, VIDIOC_QUERYCTRL, &qctrl) == 0) {
+    do {
+      camera_controls_append(camera, controls, &capacity, &qctrl);
+      qctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+    } while (camera_ioctl(camera, VIDIOC_QUERYCTRL, &qctrl) == 0);
+    return controls;
+  }
   for (uint32_t cid = V4L2_CID_USER_BASE; cid < V4L2_CID_LASTP1; cid++) {
-    struct v4l2_queryctrl qctrl;
     memset(&qctrl, 0, sizeof qctrl);
     qctrl.id = cid;
-    if (ioctl(camera->fd, VIDIOC_QUERYCTRL, &qctrl) == -1) continue;
-    camera_control_t* control = control_list_last++;
-    control->id = qctrl.id;
-    memcpy(control->name, qctrl.name, sizeof qctrl.name);
-    control->flags.disabled = (qctrl.flags & V4L2_CTRL_FLAG_DISABLED) != 0;
-    control->flags.grabbed = (qctrl.flags & V4L2_CTRL_FLAG_GRABBED) != 0;
-    control->flags.read_only = (qctrl.flags & V4L2_CTRL_FLAG_READ_ONLY) != 0;
-    control->flags.update = (qctrl.flags & V4L2_CTRL_FLAG_UPDATE) != 0;
-    control->flags.inactive = (qctrl.flags & V4L2_CTRL_FLAG_INACTIVE) != 0;
-    control->flags.slider = (qctrl.flags & V4L2_CTRL_FLAG_SLIDER) != 0;
-    control->flags.write_only = (qctrl.flags & V4L2_CTRL_FLAG_WRITE_ONLY) != 0;
-    control->flags.volatile_value = 
-      (qctrl.flags & V4L2_CTRL_FLAG_VOLATILE) != 0;
-    control->type = qctrl.type;
-    control->max = qctrl.maximum;
-    control->min = qctrl.minimum;
-    control->step = qctrl.step;
-    control->default_value = qctrl.default_value;
-    camera_controls_menus(camera, control);
-  }
-  return control_list_last;
+    if (camera_ioctl(camera, VIDIOC_QUERYCTRL, &qctrl) == -1) continue;
+    camera_controls_append(camera, controls, &capacity, &qctrl);
+  }
+  return controls;
+}
+const camera_controls_t* camera_controls_cache(camera_t* camera)
+{
+  if (camera->controls == NULL) 
+    camera->controls = camera_controls_query(camera);
+  return camera->controls;
+}
+void camera_controls_invalidate(camera_t* camera)
+{
+  if (camera->controls != NULL) camera_controls_delete(camera->controls);
+  camera->controls = NULL;
 }
 camera_controls_t* camera_controls_new(camera_t* camera)
 {
-  camera_control_t control_list[V4L2_CID_LASTP1 - V4L2_CID_USER_BASE];
-  camera_control_t* control_list_last = 
-    camera_controls_query(camera, control_list);
+  const camera_controls_t* cache = camera_controls_cache(camera);
   camera_controls_t* controls = malloc(sizeof (camera_controls_t));
-  controls->length = control_list_last - control_list;
+  controls->length = cache->length;
   controls->head = calloc(controls->length, sizeof (camera_control_t));
   for (size_t i = 0; i < controls->length; i++) {
-    controls->head[i] = control_list[i];
+    camera_control_t* control = &controls->head[i];
+    *control = cache->head[i];
+    if (control->menus.length == 0) continue;
+    control->menus.head = 
+      calloc(control->menus.length, sizeof (camera_menu_t));
+    memcpy(control->menus.head, cache->head[i].menus.head, 
+           control->menus.length * sizeof (camera_menu_t));
   }
   return controls;
 }
@@ -529,15 +2317,25 @@ void camera_controls_delete(camera_controls_t* controls)
   for (size_t i = 0; i < controls->length; i++) {
     free(controls->head[i].menus.head);
   }
+  free(controls->head);
   free(controls);
 }
 
+const camera_control_t* camera_control_find(camera_t* camera, uint32_t id)
+{
+  const camera_controls_t* controls = camera_controls_cache(camera);
+  for (size_t i = 0; i < controls->length; i++) {
+    if (controls->head[i].id == id) return &controls->head[i];
+  }
+  return NULL;
+}
+
 bool camera_control_get(camera_t* camera, uint32_t id, int32_t* value)
 {
   struct v4l2_control ctrl;
   ctrl.id = id;
   ctrl.value = 0;
-  if (ioctl(camera->fd, VIDIOC_G_CTRL, &ctrl) == -1) 
+  if (camera_ioctl(camera, VIDIOC_G_CTRL, &ctrl) == -1) 
     return error(camera, "VIDIOC_G_CTRL");
   *value = ctrl.value;
   return true;
@@ -548,7 +2346,77 @@ bool camera_control_set(camera_t* camera, uint32_t id, int32_t value)
   struct v4l2_control ctrl;
   ctrl.id = id;
   ctrl.value = value;
-  if (ioctl(camera->fd, VIDIOC_S_CTRL, &ctrl) == -1) 
+  if (camera_ioctl(camera, VIDIOC_S_CTRL, &ctrl) == -1) 
     return error(camera, "VIDIOC_S_CTRL");
   return true;
 }
+
+static bool camera_controls_each(camera_t* camera, unsigned long request,
+                                 camera_control_value_t* values, size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    struct v4l2_control ctrl;
+    ctrl.id = values[i].id;
+    ctrl.value = values[i].value;
+    if (camera_ioctl(camera, request, &ctrl) == -1) 
+      return error(camera, request == VIDIOC_S_CTRL ? 
+                   "VIDIOC_S_CTRL" : "VIDIOC_G_CTRL");
+    values[i].value = ctrl.value;
+  }
+  return true;
+}
+static bool camera_controls_ext(camera_t* camera, bool set,
+                                camera_control_value_t* values, size_t count)
+{
+  if (count == 0) return true;
+  struct v4l2_ext_control* ctrls = calloc(count, sizeof *ctrls);
+  for (size_t i = 0; i < count; i++) {
+    const camera_control_t* control = camera_control_find(camera, values[i].id);
+    ctrls[i].id = values[i].id;
+    if (control != NULL && control->type == CAMERA_CTRL_INTEGER64) {
+      ctrls[i].value64 = values[i].value;
+    } else {
+      ctrls[i].value = values[i].value;
+    }
+  }
+  struct v4l2_ext_controls ext;
+  memset(&ext, 0, sizeof ext);
+#ifdef V4L2_CTRL_WHICH_CUR_VAL
+  ext.which = V4L2_CTRL_WHICH_CUR_VAL; /* controls of any class */
+#else
+  ext.ctrl_class = V4L2_CTRL_ID2CLASS(values[0].id);
+#endif
+  ext.count = count;
+  ext.controls = ctrls;
+  unsigned long request = set ? VIDIOC_S_EXT_CTRLS : VIDIOC_G_EXT_CTRLS;
+  int ret = camera_ioctl(camera, request, &ext);
+  int err = errno;
+  if (ret == 0 && !set) {
+    for (size_t i = 0; i < count; i++) {
+      const camera_control_t* control = 
+        camera_control_find(camera, values[i].id);
+      values[i].value = control != NULL && 
+        control->type == CAMERA_CTRL_INTEGER64 ? 
+        ctrls[i].value64 : ctrls[i].value;
+    }
+  }
+  free(ctrls);
+  if (ret == 0) return true;
+  errno = err;
+  if (err == ENOTTY) {
+    // no extended controls: one by one, without the atomicity
+    return camera_controls_each(camera, set ? VIDIOC_S_CTRL : VIDIOC_G_CTRL,
+                                values, count);
+  }
+  return error(camera, set ? "VIDIOC_S_EXT_CTRLS" : "VIDIOC_G_EXT_CTRLS");
+}
+bool camera_controls_get(camera_t* camera, 
+                         camera_control_value_t* values, size_t count)
+{
+  return camera_controls_ext(camera, false, values, count);
+}
+bool camera_controls_set(camera_t* camera, 
+                         camera_control_value_t* values, size_t count)
+{
+  return camera_controls_ext(camera, true, values, count);
+}
@@ -30,27 +30,213 @@ typedef struct {
 typedef struct {
   uint8_t* start;
   size_t length;
+  int dmabuf_fd; /* -1 until exported with camera_buffers_export() */
 } camera_buffer_t;
 
+typedef struct {
+  uint64_t frames;
+  uint64_t dropped; /* gaps in the driver sequence numbers */
+  uint64_t queue_empty; /* dequeues that left the driver no buffer to fill */
+  uint64_t skipped; /* superseded by a newer frame in latest only mode */
+  size_t outstanding; /* buffers currently held by the application */
+  size_t max_outstanding;
+  uint32_t last_sequence;
+} camera_stats_t;
+
+/* per frame metadata reported by the driver on dequeue */
+typedef struct {
+  uint64_t timestamp_us; /* CLOCK_MONOTONIC if V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC */
+  uint32_t sequence;
+  uint32_t bytesused;
+  uint32_t flags; /* V4L2_BUF_FLAG_* */
+  uint32_t field; /* enum v4l2_field */
+} camera_frame_meta_t;
+
+typedef enum {
+  CAMERA_MEMORY_MMAP = 0,
+  CAMERA_MEMORY_USERPTR = 1,
+} camera_memory_t;
+
+typedef struct camera_file camera_file_t;
+typedef struct camera_controls camera_controls_t;
+
 typedef struct {
   int fd;
+  camera_file_t* file; /* file backed virtual camera, NULL for a device */
+  camera_controls_t* controls; /* see camera_controls_cache() */
   bool initialized;
+  bool streaming;
+  uint32_t format;
   uint32_t width;
   uint32_t height;
+  uint32_t bytesperline; /* of the first plane */
+  size_t image_size;
+  camera_memory_t memory; /* memory type of the allocated buffers */
+  camera_memory_t memory_request;
+  bool hugepages;
+  size_t buffer_request;
+  bool latest_only; /* see camera_latest_only() */
   size_t buffer_count;
   camera_buffer_t* buffers;
   camera_buffer_t head;
+  size_t head_capacity; /* allocated for head, 0 before camera_capture() */
+  camera_frame_meta_t head_meta;
+  camera_stats_t stats;
   camera_context_t context;
 } camera_t;
 
+/* device: a V4L2 device path, or "file:FOURCC:WIDTHxHEIGHT[@FPS]:PATH"
+ * for a virtual camera looping over the raw (YUYV, NV12, YU12, RGB3) or
+ * concatenated MJPEG frames of a file, paced at FPS or, without it, as
+ * fast as frames are dequeued */
 camera_t* camera_open(const char * device);
 bool camera_start(camera_t* camera);
 bool camera_stop(camera_t* camera);
 bool camera_close(camera_t* camera);
 
+/* ring depth requested at the next buffer allocation (default 4).
+ * camera->buffer_count holds the count the driver actually granted.
+ * refused while streaming: stop first */
+bool camera_buffer_count_set(camera_t* camera, size_t count);
+void camera_stats_reset(camera_t* camera);
+/* camera->stats may be updated by another thread using the camera */
+void camera_stats_get(camera_t* camera, camera_stats_t* stats);
+
+/* low latency mode: every acquire drains the ready buffers, hands out the
+ * newest one and queues the older ones back (counted in stats.skipped).
+ * may be switched from another thread than the one using the camera */
+void camera_latest_only_set(camera_t* camera, bool latest_only);
+bool camera_latest_only(camera_t* camera);
+
+/* capture into our own page aligned (optionally MAP_HUGETLB) buffer pool
+ * instead of driver allocated buffers. falls back to MMAP when the driver
+ * refuses USERPTR; camera->memory tells which one is in use. refused while
+ * streaming: stop first */
+bool camera_memory_set(camera_t* camera, camera_memory_t memory, 
+                       bool hugepages);
+
+/* export every mmap'ed buffer as a dma-buf fd (VIDIOC_EXPBUF).
+ * the fds are owned by the camera and closed when the buffers are freed */
+bool camera_buffers_export(camera_t* camera);
+
+/* frame lease: points straight into the mmap'ed driver buffer.
+ * the buffer stays dequeued until camera_frame_release() */
+typedef struct {
+  uint8_t* start;
+  size_t length;
+  uint32_t index;
+  int dmabuf_fd;
+  camera_frame_meta_t meta;
+} camera_frame_t;
+
+bool camera_frame_acquire(camera_t* camera, camera_frame_t* frame);
+bool camera_frame_release(camera_t* camera, camera_frame_t* frame);
+
+/* an uncompressed image as handed between stages (capture, conversion, 
+ * transform, encoders): each plane with its own stride, so that none of 
+ * them assumes tightly packed rows. planes are Y, U, V for YU12, Y and 
+ * interleaved UV for NV12 and the only one for RGB3 and YUYV */
+#define CAMERA_PLANES_MAX 3
+typedef struct {
+  uint8_t* plane[CAMERA_PLANES_MAX];
+  uint32_t stride[CAMERA_PLANES_MAX]; /* bytes from a row to the next */
+  uint32_t width;
+  uint32_t height;
+  uint32_t format;
+  int64_t timestamp_us; /* negative when unknown */
+} camera_image_t;
+
+/* describes data holding the planes one after the other, of slice_height 
+ * rows of stride bytes each (halved for subsampled chroma). stride and 
+ * slice_height 0 for tightly packed. the size of the data, 0 when the 
+ * format is not one of the above */
+size_t camera_image_init(camera_image_t* image, uint8_t* data, 
+                         uint32_t format, uint32_t width, uint32_t height,
+                         uint32_t stride, uint32_t slice_height);
+/* the camera's frame, with the driver's bytesperline and, for planar
+ * formats, the luma height it pads to as sizeimage tells */
+size_t camera_image_frame(camera_t* camera, const camera_frame_t* frame,
+                          camera_image_t* image);
+size_t camera_image_planes(uint32_t format);
+/* pixels in a row and rows of a plane, and bytes per pixel */
+void camera_image_plane_size(const camera_image_t* image, size_t plane,
+                             uint32_t* width, uint32_t* height, 
+                             uint32_t* bpp);
+/* row by row, skipping the padding of either. same format and size only */
+bool camera_image_copy(const camera_image_t* src, camera_image_t* dst);
+
+/* copying wrapper of acquire/release: the frame is stored in camera->head
+ * and its metadata in camera->head_meta */
 bool camera_capture(camera_t* camera);
+
+/* native capture thread dequeuing continuously into a bounded single 
+ * producer/single consumer ring, so a late consumer does not delay DQBUF.
+ * when the ring is full the new frame goes back to the driver and counts 
+ * as an overrun. the camera must be started, and must not be used
+ * directly (acquire/release, stop) until the thread is deleted */
+typedef struct camera_thread camera_thread_t;
+
+typedef struct {
+  uint64_t frames; /* pushed into the ring */
+  uint64_t overruns; /* given back because the ring was full */
+  uint64_t skipped; /* popped over by camera_thread_pop(latest) */
+  int error; /* errno the capture ended on, 0 while it runs */
+} camera_thread_stats_t;
+
+/* depth 0 (or too large): one less than the camera's buffer count */
+camera_thread_t* camera_thread_new(camera_t* camera, size_t depth);
+/* leases popped and not yet released must be released before */
+void camera_thread_delete(camera_thread_t* thread);
+/* eventfd readable while frames wait in the ring */
+int camera_thread_fd(camera_thread_t* thread);
+/* consumer side, from one thread only. latest: drop all but the newest
+ * frame in the ring. false with errno EAGAIN when the ring is empty; once 
+ * the device failed (the thread then exits) with the error it failed on */
+bool camera_thread_pop(camera_thread_t* thread, camera_frame_t* frame, 
+                       bool latest);
+void camera_thread_release(camera_thread_t* thread, camera_frame_t* frame);
+void camera_thread_stats(camera_thread_t* thread, camera_thread_stats_t* stats);
+/* bytes the thread allocated, its rings included */
+size_t camera_thread_memory(camera_thread_t* thread);
+
+/* color conversion: the vector kernels are picked at runtime and give the 
+ * same bytes as the scalar one. width must be even */
+typedef void (*camera_yuyv2rgb_row_t)(const uint8_t* yuyv, uint8_t* rgb,
+                                      uint32_t width);
+typedef struct {
+  const char* name;
+  camera_yuyv2rgb_row_t row;
+} camera_yuyv2rgb_kernel_t;
+
+/* kernels usable on this cpu, fastest first (the one camera_yuyv2rgb uses) */
+size_t camera_yuyv2rgb_kernels(const camera_yuyv2rgb_kernel_t** kernels);
+void camera_yuyv2rgb(const uint8_t* yuyv, size_t yuyv_stride, 
+                     uint8_t* rgb, size_t rgb_stride, 
+                     uint32_t width, uint32_t height);
+/* returns a malloc'ed packed rgb frame, NULL when out of memory */
 uint8_t* yuyv2rgb(uint8_t* yuyv, uint32_t width, uint32_t height);
 
+/* persistent worker threads: a job runs once per band, the calling thread
+ * takes band 0 and camera_workers_run() returns when all bands are done */
+typedef struct camera_workers camera_workers_t;
+typedef void (*camera_workers_job_t)(void* arg, size_t band, size_t bands);
+
+#define CAMERA_WORKERS_MAX 64
+
+/* count 0: one thread per online cpu, at most CAMERA_WORKERS_MAX. fewer 
+ * when threads cannot start (see camera_workers_count()), NULL when out 
+ * of memory */
+camera_workers_t* camera_workers_new(size_t count);
+void camera_workers_delete(camera_workers_t* workers);
+size_t camera_workers_count(camera_workers_t* workers);
+void camera_workers_run(camera_workers_t* workers, 
+                        camera_workers_job_t job, void* arg);
+/* converts row bands on the workers; same bytes as camera_yuyv2rgb() */
+void camera_yuyv2rgb_parallel(camera_workers_t* workers, 
+                              const uint8_t* yuyv, size_t yuyv_stride, 
+                              uint8_t* rgb, size_t rgb_stride, 
+                              uint32_t width, uint32_t height);
+
 
 typedef struct {
   uint32_t format;
@@ -75,6 +261,29 @@ camera_formats_t* camera_formats_new(camera_t* camera);
 void camera_formats_delete(camera_formats_t* formats);
 bool camera_config_get(camera_t* camera, camera_format_t* format);
 bool camera_config_set(camera_t* camera, camera_format_t* format);
+/* switches format/size/frame rate keeping what can be kept: a frame rate
+ * change alone is applied while streaming, and fails without stopping when
+ * the driver refuses it. buffers stay when the driver accepts the format 
+ * with them and they fit, and otherwise only the driver side is released 
+ * (the USERPTR pool is reused). streaming resumes when it was on. on 
+ * failure the previous format, buffers and streaming state are restored; 
+ * only when that fails too is the camera left stopped */
+bool camera_reconfigure(camera_t* camera, camera_format_t* format);
+
+/* sensor area captured, in sensor pixels. bounds is the whole sensor. on
+ * drivers that scale, the crop alone keeps the frame size: reconfigure to
+ * the crop size for the frame to shrink with it */
+typedef struct {
+  int32_t left;
+  int32_t top;
+  uint32_t width;
+  uint32_t height;
+} camera_rect_t;
+
+bool camera_crop_get(camera_t* camera, camera_rect_t* bounds, 
+                     camera_rect_t* crop);
+/* the driver may adjust the rectangle: crop is updated to the one applied */
+bool camera_crop_set(camera_t* camera, camera_rect_t* crop);
 
 
 typedef enum {
@@ -120,16 +329,35 @@ typedef struct {
   camera_menus_t menus;
 } camera_control_t;
 
-typedef struct {
+struct camera_controls {
   size_t length;
   camera_control_t* head;
-} camera_controls_t;
-  
+};
+
+/* controls of every class, queried once and owned by the camera. format 
+ * and crop changes drop the cache, as ranges and availability may follow */
+const camera_controls_t* camera_controls_cache(camera_t* camera);
+void camera_controls_invalidate(camera_t* camera);
+const camera_control_t* camera_control_find(camera_t* camera, uint32_t id);
+/* a copy of the cache, to be deleted */
 camera_controls_t* camera_controls_new(camera_t* camera);
 void camera_controls_delete(camera_controls_t* controls);
 bool camera_control_get(camera_t* camera, uint32_t id, int32_t* value);
 bool camera_control_set(camera_t* camera, uint32_t id, int32_t value);
 
+typedef struct {
+  uint32_t id;
+  int64_t value;
+} camera_control_value_t;
+
+/* batches in one VIDIOC_[GS]_EXT_CTRLS: a set is applied atomically, on
+ * the same frame, or not at all. without extended controls (ENOTTY) the
+ * values are read/written one by one */
+bool camera_controls_get(camera_t* camera, 
+                         camera_control_value_t* values, size_t count);
+bool camera_controls_set(camera_t* camera, 
+                         camera_control_value_t* values, size_t count);
+
 
 #ifdef __cplusplus
 }
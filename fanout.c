@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include "fanout.h"
+
+#include <pthread.h>
+
+
+typedef struct {
+  void* frame;
+  size_t refs; /* queues and sinks still holding it */
+} fanout_frame_t;
+
+typedef struct {
+  camera_fanout_t* fanout;
+  bool active;
+  bool stop;
+  camera_fanout_func_t func;
+  void* pointer;
+  camera_drop_t drop;
+  pthread_t thread;
+  pthread_cond_t queued;
+  // ring of waiting frames, the oldest at head
+  fanout_frame_t* queue[CAMERA_FANOUT_DEPTH_MAX];
+  size_t depth;
+  size_t head;
+  size_t length;
+  camera_fanout_stats_t stats;
+} fanout_sink_t;
+
+struct camera_fanout {
+  pthread_mutex_t mutex;
+  camera_fanout_release_t release;
+  void* pointer;
+  fanout_sink_t sinks[CAMERA_FANOUT_MAX];
+};
+
+
+//[frames]
+/* under the mutex: true when that was the last reference */
+static bool frame_unref(fanout_frame_t* frame)
+{
+  return --frame->refs == 0;
+}
+
+/* outside the mutex: the producer's release may take its own locks */
+static void frame_release(camera_fanout_t* fanout, fanout_frame_t* frame)
+{
+  fanout->release(frame->frame, fanout->pointer);
+  free(frame);
+}
+
+static fanout_frame_t* sink_pop(fanout_sink_t* sink)
+{
+  fanout_frame_t* frame = sink->queue[sink->head];
+  sink->head = (sink->head + 1) % sink->depth;
+  sink->length--;
+  return frame;
+}
+
+
+//[thread]
+static void* sink_main(void* arg)
+{
+  fanout_sink_t* sink = arg;
+  camera_fanout_t* fanout = sink->fanout;
+  pthread_mutex_lock(&fanout->mutex);
+  for (;;) {
+    while (!sink->stop && sink->length == 0)
+      pthread_cond_wait(&sink->queued, &fanout->mutex);
+    /* what is still queued is dropped by camera_fanout_stop() */
+    if (sink->stop) break;
+    fanout_frame_t* frame = sink_pop(sink);
+    pthread_mutex_unlock(&fanout->mutex);
+    sink->func(frame->frame, sink->pointer);
+    pthread_mutex_lock(&fanout->mutex);
+    sink->stats.done++;
+    if (frame_unref(frame)) {
+      pthread_mutex_unlock(&fanout->mutex);
+      frame_release(fanout, frame);
+      pthread_mutex_lock(&fanout->mutex);
+    }
+  }
+  pthread_mutex_unlock(&fanout->mutex);
+  return NULL;
+}
+
+
+//[fanout]
+camera_fanout_t* camera_fanout_new(camera_fanout_release_t release,
+                                   void* pointer)
+{
+  camera_fanout_t* fanout = calloc(1, sizeof (camera_fanout_t));
+  if (fanout == NULL) return NULL;
+  if (pthread_mutex_init(&fanout->mutex, NULL) != 0) {
+    free(fanout);
+    return NULL;
+  }
+  fanout->release = release;
+  fanout->pointer = pointer;
+  return fanout;
+}
+
+void camera_fanout_delete(camera_fanout_t* fanout)
+{
+  if (fanout == NULL) return;
+  for (int i = 0; i < CAMERA_FANOUT_MAX; i++) {
+    if (fanout->sinks[i].active) camera_fanout_remove(fanout, i);
+  }
+  pthread_mutex_destroy(&fanout->mutex);
+  free(fanout);
+}
+
+int camera_fanout_add(camera_fanout_t* fanout, camera_fanout_func_t func,
+                      void* pointer, size_t depth, camera_drop_t drop)
+{
+  if (depth == 0 || depth > CAMERA_FANOUT_DEPTH_MAX) return -1;
+  int index = 0;
+  pthread_mutex_lock(&fanout->mutex);
+  while (index < CAMERA_FANOUT_MAX && fanout->sinks[index].active) index++;
+  if (index == CAMERA_FANOUT_MAX) goto fail;
+  fanout_sink_t* sink = &fanout->sinks[index];
+  *sink = (fanout_sink_t) {
+    .fanout = fanout, .func = func, .pointer = pointer, .drop = drop,
+    .depth = depth,
+  };
+  if (pthread_cond_init(&sink->queued, NULL) != 0) goto fail;
+  if (pthread_create(&sink->thread, NULL, sink_main, sink) != 0) {
+    pthread_cond_destroy(&sink->queued);
+    goto fail;
+  }
+  sink->active = true;
+  pthread_mutex_unlock(&fanout->mutex);
+  return index;
+fail:
+  pthread_mutex_unlock(&fanout->mutex);
+  return -1;
+}
+
+void camera_fanout_stop(camera_fanout_t* fanout, int index)
+{
+  if (index < 0 || index >= CAMERA_FANOUT_MAX) return;
+  fanout_sink_t* sink = &fanout->sinks[index];
+  fanout_frame_t* released[CAMERA_FANOUT_DEPTH_MAX];
+  size_t count = 0;
+  pthread_mutex_lock(&fanout->mutex);
+  if (!sink->active || sink->stop) {
+    pthread_mutex_unlock(&fanout->mutex);
+    return;
+  }
+  sink->stop = true;
+  while (sink->length > 0) {
+    fanout_frame_t* frame = sink_pop(sink);
+    sink->stats.dropped++;
+    if (frame_unref(frame)) released[count++] = frame;
+  }
+  pthread_cond_signal(&sink->queued);
+  pthread_mutex_unlock(&fanout->mutex);
+  for (size_t i = 0; i < count; i++) frame_release(fanout, released[i]);
+}
+
+void camera_fanout_join(camera_fanout_t* fanout, int index)
+{
+  if (index < 0 || index >= CAMERA_FANOUT_MAX) return;
+  fanout_sink_t* sink = &fanout->sinks[index];
+  pthread_mutex_lock(&fanout->mutex);
+  bool stopped = sink->active && sink->stop;
+  pthread_mutex_unlock(&fanout->mutex);
+  if (!stopped) return;
+  pthread_join(sink->thread, NULL);
+  pthread_mutex_lock(&fanout->mutex);
+  pthread_cond_destroy(&sink->queued);
+  sink->active = false;
+  pthread_mutex_unlock(&fanout->mutex);
+}
+
+void camera_fanout_remove(camera_fanout_t* fanout, int index)
+{
+  camera_fanout_stop(fanout, index);
+  camera_fanout_join(fanout, index);
+}
+
+size_t camera_fanout_push(camera_fanout_t* fanout, void* data)
+{
+  fanout_frame_t* frame = malloc(sizeof (fanout_frame_t));
+  if (frame == NULL) return 0;
+  frame->frame = data;
+  frame->refs = 0;
+  fanout_frame_t* released[CAMERA_FANOUT_MAX];
+  size_t count = 0;
+  pthread_mutex_lock(&fanout->mutex);
+  for (int i = 0; i < CAMERA_FANOUT_MAX; i++) {
+    fanout_sink_t* sink = &fanout->sinks[i];
+    if (!sink->active || sink->stop) continue;
+    if (sink->length == sink->depth) {
+      sink->stats.dropped++;
+      if (sink->drop == CAMERA_DROP_NEWEST) continue;
+      fanout_frame_t* oldest = sink_pop(sink);
+      if (frame_unref(oldest)) released[count++] = oldest;
+    }
+    sink->queue[(sink->head + sink->length) % sink->depth] = frame;
+    sink->length++;
+    sink->stats.queued++;
+    frame->refs++;
+    pthread_cond_signal(&sink->queued);
+  }
+  size_t taken = frame->refs;
+  pthread_mutex_unlock(&fanout->mutex);
+  for (size_t i = 0; i < count; i++) frame_release(fanout, released[i]);
+  if (taken == 0) free(frame);
+  return taken;
+}
+
+bool camera_fanout_stats(camera_fanout_t* fanout, int index,
+                         camera_fanout_stats_t* stats)
+{
+  if (index < 0 || index >= CAMERA_FANOUT_MAX) return false;
+  fanout_sink_t* sink = &fanout->sinks[index];
+  pthread_mutex_lock(&fanout->mutex);
+  bool active = sink->active;
+  *stats = sink->stats;
+  stats->length = sink->length;
+  pthread_mutex_unlock(&fanout->mutex);
+  return active;
+}
@@ -0,0 +1,67 @@
+#ifndef CAMERA_FANOUT_H
+#define CAMERA_FANOUT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* one frame handed to several sinks at once. each sink runs on its own
+ * thread behind a bounded queue, so a slow sink drops frames instead of
+ * holding up the others. frames are reference counted: a frame goes back to
+ * the producer through the release function once every sink it was queued
+ * on has consumed or dropped it */
+typedef struct camera_fanout camera_fanout_t;
+
+#define CAMERA_FANOUT_MAX 8
+#define CAMERA_FANOUT_DEPTH_MAX 8
+
+typedef enum {
+  CAMERA_DROP_OLDEST, /* a full queue makes room by dropping its oldest */
+  CAMERA_DROP_NEWEST, /* a full queue turns the new frame away */
+} camera_drop_t;
+
+/* called on the sink's thread */
+typedef void (*camera_fanout_func_t)(void* frame, void* pointer);
+/* called on the thread that dropped the last reference */
+typedef void (*camera_fanout_release_t)(void* frame, void* pointer);
+
+typedef struct {
+  uint64_t queued;
+  uint64_t done;
+  uint64_t dropped;
+  size_t length; /* frames waiting in the queue now */
+} camera_fanout_stats_t;
+
+camera_fanout_t* camera_fanout_new(camera_fanout_release_t release,
+                                   void* pointer);
+/* removes every sink */
+void camera_fanout_delete(camera_fanout_t* fanout);
+
+/* the sink index, -1 when full, for a depth out of 1..DEPTH_MAX, or when
+ * the thread cannot start */
+int camera_fanout_add(camera_fanout_t* fanout, camera_fanout_func_t func,
+                      void* pointer, size_t depth, camera_drop_t drop);
+/* stops the sink without waiting: its queued frames are dropped, the one
+ * it is on is released when done. the index stays taken until joined */
+void camera_fanout_stop(camera_fanout_t* fanout, int sink);
+/* waits for the thread of a stopped sink, which can be a slow one: called
+ * from a thread that may block */
+void camera_fanout_join(camera_fanout_t* fanout, int sink);
+/* stops the sink and joins it */
+void camera_fanout_remove(camera_fanout_t* fanout, int sink);
+
+/* the count of sinks the frame was queued on. with 0 the frame is not
+ * retained and release is not called for it */
+size_t camera_fanout_push(camera_fanout_t* fanout, void* frame);
+bool camera_fanout_stats(camera_fanout_t* fanout, int sink,
+                         camera_fanout_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
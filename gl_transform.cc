@@ -10,10 +10,13 @@
 #include <GLES2/gl2.h>
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
+#include <linux/videodev2.h>
 #include <sstream>
 #include <stdexcept>
+#include <string>
 #include <cstring>
 #include <chrono>
+#include <algorithm>
 
 #include <mat4/type.h>
 #include <mat4/create.h>
@@ -36,8 +39,19 @@ using std::chrono::duration_cast;
 
 using namespace openblw;
 
-GLTransform::GLTransform(int width, int height, int tex_width, int tex_height) :
-		m_width(width), m_height(height) {
+//Calibration of the two fisheye images, stacked vertically on the sensor.
+//Centers and radius are relative to the half frame holding the circle, the
+//radius in units of its height.
+static const float ASPECT = 480.0 / 640.0;
+static const float IMAGE_R = 0.92;
+static const float CENTER1[2] = { 0.55, 0.50 };
+static const float CENTER2[2] = { 0.555, 0.52 };
+
+GLTransform::GLTransform(int width, int height, int tex_width, int tex_height,
+		uint32_t in_format, uint32_t out_format, int out_stride) :
+		m_width(width), m_height(height), m_in_format(in_format), m_out_format(
+				out_format), m_texture_count(0), m_texture_dst_count(0), m_crop {
+				0, 0, 1, 1 } {
 	EGLBoolean result;
 	EGLint num_config;
 
@@ -71,19 +85,19 @@ GLTransform::GLTransform(int width, int height, int tex_width, int tex_height) :
 	GLCHECKED(result == EGL_FALSE, "Could not bind EGL API.");
 
 	//Create an EGL rendering context
-	EGLContext context = eglCreateContext(m_display, config, EGL_NO_CONTEXT,
+	m_context = eglCreateContext(m_display, config, EGL_NO_CONTEXT,
 			context_attributes);
-	GLCHECKED(context == EGL_NO_CONTEXT, "Could not create EGL context.");
+	GLCHECKED(m_context == EGL_NO_CONTEXT, "Could not create EGL context.");
 
-	//Create an offscreen rendering surface
-	static const EGLint rendering_attributes[] = { EGL_WIDTH, width, EGL_HEIGHT,
+	//Create an offscreen rendering surface, sized for this instance
+	const EGLint rendering_attributes[] = { EGL_WIDTH, width, EGL_HEIGHT,
 			height, EGL_NONE };
 	m_surface = eglCreatePbufferSurface(m_display, config,
 			rendering_attributes);
 	GLCHECKED(m_surface == EGL_NO_SURFACE, "Could not create PBuffer surface.");
 
 	//Bind the context to the current thread
-	result = eglMakeCurrent(m_display, m_surface, m_surface, context);
+	result = eglMakeCurrent(m_display, m_surface, m_surface, m_context);
 	GLCHECKED(result == EGL_FALSE, "Failed to bind context.");
 
 	//xyzw
@@ -98,33 +112,171 @@ GLTransform::GLTransform(int width, int height, int tex_width, int tex_height) :
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
 	//Setup the shaders and texture buffer.
-	m_program = new GLProgram("simplevertshader.glsl", "simplefragshader.glsl");
-	m_texture = new GLTexture(tex_width, tex_height, GL_RGB);
-	m_texture_dst = new GLTexture(width, height, GL_RGB);
-
-	//Allocate the frame buffer
-	glGenFramebuffers(1, &m_framebuffer_id);
-	glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer_id);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
-			m_texture_dst->GetTextureId(), 0);
-	if (glGetError() != GL_NO_ERROR) {
-		throw std::invalid_argument(
-				"glFramebufferTexture2D failed. Could not allocate framebuffer.");
+	CreateInputTextures(tex_width, tex_height);
+	//Output planes, as wide as their stride
+	camera_image_t layout;
+	camera_image_init(&layout, NULL, out_format, width, height, out_stride, 0);
+	switch (out_format) {
+	case V4L2_PIX_FMT_RGB24:
+		CHECKED(layout.stride[0] % 3 || (int) layout.stride[0] < width * 3,
+				"Unsupported output stride.");
+		m_dst_width[0] = width;
+		m_dst_stride[0] = layout.stride[0];
+		m_textures_dst[m_texture_dst_count++] = new GLTexture(
+				layout.stride[0] / 3, height, GL_RGB);
+		break;
+	case V4L2_PIX_FMT_YUV420:
+		//Each RGBA texel packs 4 samples of a plane, the chroma ones too
+		CHECKED(width % 8 || height % 2,
+				"I420 output needs a width multiple of 8 and an even height.");
+		for (int i = 0; i < 3; i++) {
+			int scale = (i == 0) ? 1 : 2;
+			CHECKED(layout.stride[i] % 4
+					|| (int) layout.stride[i] < width / scale,
+					"Unsupported output stride.");
+			m_dst_width[i] = width / scale / 4;
+			m_dst_stride[i] = layout.stride[i];
+			m_textures_dst[m_texture_dst_count++] = new GLTexture(
+					layout.stride[i] / 4, height / scale, GL_RGBA);
+		}
+		break;
+	default:
+		throw std::invalid_argument("Unsupported output format.");
+	}
+	m_program = new GLProgram("simplevertshader.glsl", "simplefragshader.glsl",
+			Defines().c_str());
+
+	//Allocate the frame buffers
+	glGenFramebuffers(m_texture_dst_count, m_framebuffer_ids);
+	for (int i = 0; i < m_texture_dst_count; i++) {
+		glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer_ids[i]);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+				GL_TEXTURE_2D, m_textures_dst[i]->GetTextureId(), 0);
+		if (glGetError() != GL_NO_ERROR) {
+			throw std::invalid_argument(
+					"glFramebufferTexture2D failed. Could not allocate framebuffer.");
+		}
 	}
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
+void GLTransform::CreateInputTextures(int tex_width, int tex_height) {
+	switch (m_in_format) {
+	case V4L2_PIX_FMT_RGB24:
+		m_textures[m_texture_count++] = new GLTexture(tex_width, tex_height,
+				GL_RGB);
+		break;
+	case V4L2_PIX_FMT_YUV420:
+		m_textures[m_texture_count++] = new GLTexture(tex_width, tex_height,
+				GL_LUMINANCE);
+		m_textures[m_texture_count++] = new GLTexture(tex_width / 2,
+				tex_height / 2, GL_LUMINANCE);
+		m_textures[m_texture_count++] = new GLTexture(tex_width / 2,
+				tex_height / 2, GL_LUMINANCE);
+		break;
+	case V4L2_PIX_FMT_NV12:
+		m_textures[m_texture_count++] = new GLTexture(tex_width, tex_height,
+				GL_LUMINANCE);
+		m_textures[m_texture_count++] = new GLTexture(tex_width / 2,
+				tex_height / 2, GL_LUMINANCE_ALPHA);
+		break;
+	default:
+		throw std::invalid_argument("Unsupported input format.");
+	}
+}
+
+/**
+ * The shader variant for the current input and output formats.
+ */
+std::string GLTransform::Defines() {
+	std::string defines;
+	if (m_in_format == V4L2_PIX_FMT_YUV420) {
+		defines += "#define INPUT_I420\n";
+	} else if (m_in_format == V4L2_PIX_FMT_NV12) {
+		defines += "#define INPUT_NV12\n";
+	}
+	if (m_out_format == V4L2_PIX_FMT_YUV420) {
+		defines += "#define OUTPUT_I420\n";
+	}
+	return defines;
+}
+
+/**
+ * Replaces the input textures for another capture size or format, keeping
+ * the EGL context, the output framebuffers and, for the same format, the
+ * shader program.
+ */
+void GLTransform::SetInput(int tex_width, int tex_height, uint32_t in_format) {
+	for (int i = 0; i < m_texture_count; i++) {
+		delete m_textures[i];
+	}
+	m_texture_count = 0;
+	bool reload = in_format != m_in_format;
+	m_in_format = in_format;
+	CreateInputTextures(tex_width, tex_height);
+	if (reload) {
+		delete m_program;
+		m_program = new GLProgram("simplevertshader.glsl",
+				"simplefragshader.glsl", Defines().c_str());
+	}
+}
+
+void GLTransform::SetCrop(float left, float top, float width,
+		float height) {
+	m_crop[0] = left;
+	m_crop[1] = top;
+	m_crop[2] = width;
+	m_crop[3] = height;
+}
+
+void GLTransform::GetImageCircleBounds(float bounds[4]) {
+	//the shader reaches half the radius from the center
+	float ru = ASPECT * IMAGE_R * 0.5;
+	float rv = IMAGE_R * 0.5;
+	float left = std::min(CENTER1[0], CENTER2[0]) - ru;
+	float right = std::max(CENTER1[0], CENTER2[0]) + ru;
+	float top = (CENTER1[1] - rv) * 0.5;
+	float bottom = (CENTER2[1] + rv) * 0.5 + 0.5;
+	left = std::max(left, 0.0f);
+	top = std::max(top, 0.0f);
+	bounds[0] = left;
+	bounds[1] = top;
+	bounds[2] = std::min(right, 1.0f) - left;
+	bounds[3] = std::min(bottom, 1.0f) - top;
+}
+
 GLTransform::~GLTransform() {
-	glDeleteFramebuffers(1, &m_framebuffer_id);
-	eglDestroySurface(m_display, m_surface);
+	//The GL objects belong to this context
+	eglMakeCurrent(m_display, m_surface, m_surface, m_context);
+	glDeleteFramebuffers(m_texture_dst_count, m_framebuffer_ids);
+	glDeleteBuffers(1, &m_quad_buffer);
 	delete m_program;
-	delete m_texture;
-	delete m_texture_dst;
+	for (int i = 0; i < m_texture_count; i++) {
+		delete m_textures[i];
+	}
+	for (int i = 0; i < m_texture_dst_count; i++) {
+		delete m_textures_dst[i];
+	}
+	eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroySurface(m_display, m_surface);
+	eglDestroyContext(m_display, m_context);
+}
+
+/**
+ * Binds the context of this instance to the calling thread, for switching
+ * between instances.
+ */
+void GLTransform::MakeCurrent() {
+	EGLBoolean result = eglMakeCurrent(m_display, m_surface, m_surface,
+			m_context);
+	GLCHECKED(result == EGL_FALSE, "Failed to bind context.");
 }
 
-void GLTransform::GetRenderedData(void *buffer) {
-	glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer_id);
-	glReadPixels(0, 0, m_width, m_height, GL_RGB, GL_UNSIGNED_BYTE, buffer);
+void GLTransform::GetRenderedData(GLuint framebuffer_id, int width, int height,
+		GLenum type, void *buffer) {
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_id);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, width, height, type, GL_UNSIGNED_BYTE, buffer);
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
@@ -134,20 +286,45 @@ void GLTransform::SetRotation(float x_deg, float y_deg, float z_deg) {
 	m_z_deg = z_deg;
 }
 
-void GLTransform::Transform(const unsigned char *in_data, unsigned char *out_Data) {
+void GLTransform::Draw(GLuint framebuffer_id, int width, int height) {
+	//Blank the display
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_id);
+	glViewport(0, 0, width, height);
+	check();
+	glClear (GL_COLOR_BUFFER_BIT);
+	check();
+
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	check();
+}
+
+/**
+ * Renders in into out. false, with nothing rendered, when they differ from
+ * the textures and framebuffers this instance was built for; GL failures
+ * still throw.
+ */
+bool GLTransform::Transform(const camera_image_t *in,
+		const camera_image_t *out) {
 	float x_rad = m_x_deg * M_PI / 180.0;
 	float y_rad = m_y_deg * M_PI / 180.0;
 	float z_rad = m_z_deg * M_PI / 180.0;
 
-	//Load the data into a texture.
-	m_texture->SetData((void*)in_data);
+	if (in->format != m_in_format
+			|| (int) in->width != m_textures[0]->GetWidth()
+			|| (int) in->height != m_textures[0]->GetHeight())
+		return false;
+	if (out->format != m_out_format || (int) out->width != m_width
+			|| (int) out->height != m_height)
+		return false;
+	for (int i = 0; i < m_texture_dst_count; i++) {
+		if (out->stride[i] != m_dst_stride[i])
+			return false;
+	}
 
-	//Blank the display
-	glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer_id);
-	glViewport(0, 0, m_width, m_height);
-	check();
-	glClear (GL_COLOR_BUFFER_BIT);
-	check();
+	//Load the data into the textures, plane after plane.
+	for (int i = 0; i < m_texture_count; i++) {
+		m_textures[i]->SetData(in->plane[i], in->stride[i]);
+	}
 
 	glUseProgram(m_program->GetId());
 	check();
@@ -159,19 +336,31 @@ void GLTransform::Transform(const unsigned char *in_data, unsigned char *out_Dat
 	mat4_rotateZ(unif_matrix, unif_matrix, -z_rad);
 
 	//Load in the texture and thresholding parameters.
-	glUniform1i(glGetUniformLocation(m_program->GetId(), "tex"), 0);
+	static const char *samplers[][MAX_PLANES] = { { "tex", "tex_u", "tex_v" }, {
+			"tex", "tex_uv", NULL } };
+	const char **names =
+			m_in_format == V4L2_PIX_FMT_NV12 ? samplers[1] : samplers[0];
+	for (int i = 0; i < m_texture_count; i++) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_2D, m_textures[i]->GetTextureId());
+		glUniform1i(glGetUniformLocation(m_program->GetId(), names[i]), i);
+	}
+	glActiveTexture(GL_TEXTURE0);
 	glUniformMatrix4fv(glGetUniformLocation(m_program->GetId(), "unif_matrix"),
 			1, GL_FALSE, (GLfloat*) unif_matrix);
-	//glUniform4f(glGetUniformLocation(m_program->GetId(), "threshLow"),0,167/255.0, 86/255.0,0);
-	//glUniform4f(glGetUniformLocation(m_program->GetId(), "threshHigh"),255/255.0,255/255.0, 141/255.0,1);
+	glUniform1f(glGetUniformLocation(m_program->GetId(), "aspect"), ASPECT);
+	glUniform1f(glGetUniformLocation(m_program->GetId(), "image_r"), IMAGE_R);
+	glUniform2fv(glGetUniformLocation(m_program->GetId(), "center1"), 1,
+			CENTER1);
+	glUniform2fv(glGetUniformLocation(m_program->GetId(), "center2"), 1,
+			CENTER2);
+	glUniform4fv(glGetUniformLocation(m_program->GetId(), "crop"), 1, m_crop);
 	check();
 
 	free(unif_matrix);
 
 	glBindBuffer(GL_ARRAY_BUFFER, m_quad_buffer);
 	check();
-	glBindTexture(GL_TEXTURE_2D, m_texture->GetTextureId());
-	check();
 
 	//Initialize the vertex position attribute from the vertex shader
 	GLuint loc = glGetAttribLocation(m_program->GetId(), "vPosition");
@@ -180,11 +369,26 @@ void GLTransform::Transform(const unsigned char *in_data, unsigned char *out_Dat
 	glEnableVertexAttribArray(loc);
 	check();
 
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	check();
+	if (m_out_format == V4L2_PIX_FMT_YUV420) {
+		GLint plane_loc = glGetUniformLocation(m_program->GetId(), "plane");
+		GLint size_loc = glGetUniformLocation(m_program->GetId(),
+				"plane_size");
+		for (int i = 0; i < m_texture_dst_count; i++) {
+			int scale = (i == 0) ? 1 : 2;
+			glUniform1i(plane_loc, i);
+			glUniform2f(size_loc, m_width / scale, m_height / scale);
+			Draw(m_framebuffer_ids[i], m_dst_width[i],
+					m_textures_dst[i]->GetHeight());
+		}
+	} else {
+		Draw(m_framebuffer_ids[0], m_width, m_height);
+	}
 
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	for (int i = m_texture_count - 1; i >= 0; i--) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
 	glFinish();
@@ -198,7 +402,12 @@ void GLTransform::Transform(const unsigned char *in_data, unsigned char *out_Dat
 
 	glFinish();
 
-	this->GetRenderedData(out_Data);
+	//Whole rows, padding included: each lands at its stride
+	for (int i = 0; i < m_texture_dst_count; i++) {
+		GLTexture *dst = m_textures_dst[i];
+		this->GetRenderedData(m_framebuffer_ids[i], dst->GetWidth(),
+				dst->GetHeight(), dst->GetType(), out->plane[i]);
+	}
 
 //    {
 //    FILE *fp = fopen("/tmp/in.rgb", "wb");
@@ -210,14 +419,16 @@ void GLTransform::Transform(const unsigned char *in_data, unsigned char *out_Dat
 //    fwrite(out.data, 3 * m_width * m_height, 1, fp);
 //    fclose(fp);
 //    }
+	return true;
 }
 
-GLProgram::GLProgram(const char *vertex_file, const char *fragment_file) {
+GLProgram::GLProgram(const char *vertex_file, const char *fragment_file,
+		const char *defines) {
 	GLint status;
 	m_program_id = glCreateProgram();
 
-	m_vertex_id = LoadShader(GL_VERTEX_SHADER, vertex_file);
-	m_fragment_id = LoadShader(GL_FRAGMENT_SHADER, fragment_file);
+	m_vertex_id = LoadShader(GL_VERTEX_SHADER, vertex_file, defines);
+	m_fragment_id = LoadShader(GL_FRAGMENT_SHADER, fragment_file, defines);
 	glAttachShader(m_program_id, m_vertex_id);
 	glAttachShader(m_program_id, m_fragment_id);
 
@@ -248,7 +459,8 @@ GLuint GLProgram::GetId() {
 	return m_program_id;
 }
 
-GLuint GLProgram::LoadShader(GLenum shader_type, const char *source_file) {
+GLuint GLProgram::LoadShader(GLenum shader_type, const char *source_file,
+		const char *defines) {
 	GLint status;
 	GLuint shader_id;
 	char *shader_source = ReadFile(source_file);
@@ -261,7 +473,9 @@ GLuint GLProgram::LoadShader(GLenum shader_type, const char *source_file) {
 	}
 
 	shader_id = glCreateShader(shader_type);
-	glShaderSource(shader_id, 1, (const GLchar**) &shader_source, NULL);
+	//The defines select the input/output variants of the shader.
+	const GLchar *sources[] = { defines, shader_source };
+	glShaderSource(shader_id, 2, sources, NULL);
 	glCompileShader(shader_id);
 	delete[] shader_source;
 
@@ -303,6 +517,19 @@ char* GLProgram::ReadFile(const char *file) {
 	return ret;
 }
 
+static int TexelSize(GLint type) {
+	switch (type) {
+	case GL_LUMINANCE:
+		return 1;
+	case GL_LUMINANCE_ALPHA:
+		return 2;
+	case GL_RGB:
+		return 3;
+	default:
+		return 4;
+	}
+}
+
 GLTexture::GLTexture(GLsizei width, GLsizei height, GLint type) :
 		m_width(width), m_height(height), m_type(type) {
 	if (width % 4 || height % 4) {
@@ -341,10 +568,29 @@ GLsizei GLTexture::GetHeight() {
 	return m_height;
 }
 
-void GLTexture::SetData(void *data) {
+GLint GLTexture::GetType() {
+	return m_type;
+}
+
+size_t GLTexture::GetDataSize() {
+	return (size_t) m_width * m_height * TexelSize(m_type);
+}
+
+void GLTexture::SetData(const void *data, size_t stride) {
 	glBindTexture(GL_TEXTURE_2D, m_texture_id);
-	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_width, m_height, m_type,
-			GL_UNSIGNED_BYTE, data);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	size_t row = (size_t) m_width * TexelSize(m_type);
+	if (stride == 0 || stride == row) {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_width, m_height, m_type,
+				GL_UNSIGNED_BYTE, data);
+	} else {
+		//GLES2 has no GL_UNPACK_ROW_LENGTH: a row at a time
+		const unsigned char *src = (const unsigned char*) data;
+		for (GLsizei y = 0; y < m_height; y++) {
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, m_width, 1, m_type,
+					GL_UNSIGNED_BYTE, src + y * stride);
+		}
+	}
 	// Create Mipmap
 //    glGenerateMipmap(GL_TEXTURE_2D);
 //	if (glGetError() != GL_NO_ERROR) {
@@ -7,13 +7,18 @@
 #define _GLRENDERER_H
 
 //#include <opencv2/opencv.hpp>
+#include "capture.h"
 #include <EGL/egl.h>
 #include <GLES2/gl2.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
 
 namespace openblw {
 class GLProgram {
 public:
-	GLProgram(const char *vertex_file, const char *fragment_file);
+	GLProgram(const char *vertex_file, const char *fragment_file,
+			const char *defines = "");
 	virtual ~GLProgram();
 
 	GLuint GetId();
@@ -24,7 +29,8 @@ public:
 private:
 	GLuint m_vertex_id, m_fragment_id, m_program_id;
 
-	GLuint LoadShader(GLenum shader_type, const char *source_file);
+	GLuint LoadShader(GLenum shader_type, const char *source_file,
+			const char *defines);
 	char* ReadFile(const char *file);
 };
 
@@ -35,8 +41,11 @@ public:
 
 	GLsizei GetWidth();
 	GLsizei GetHeight();
+	GLint GetType();
+	size_t GetDataSize();
 
-	void SetData(void *data);
+	/** stride: bytes from a row of data to the next, 0 for packed */
+	void SetData(const void *data, size_t stride = 0);
 	GLuint GetTextureId();
 	operator GLuint() {
 		return m_texture_id;
@@ -50,31 +59,64 @@ private:
 
 /**
  * Class to perform colour thresholding using OpenGL.
+ * Formats are V4L2 fourccs: RGB3 (packed RGB), YU12 (I420) or NV12 in,
+ * RGB3 or YU12 out. Input rows may have any stride. Output rows are
+ * out_stride bytes (of the first plane, 0 for packed), which the output
+ * framebuffers are as wide as, so that padded images are rendered
+ * into directly.
  */
 class GLTransform {
 public:
-	GLTransform(int width, int height, int tex_width, int tex_height);
+	GLTransform(int width, int height, int tex_width, int tex_height,
+			uint32_t in_format, uint32_t out_format, int out_stride = 0);
 	virtual ~GLTransform();
 
-	void Transform(const unsigned char *in_data, unsigned char *out_Data);
+	bool Transform(const camera_image_t *in, const camera_image_t *out);
 	void SetRotation(float x_deg, float y_deg, float z_deg);
+	void SetInput(int tex_width, int tex_height, uint32_t in_format);
+	void MakeCurrent();
+	/**
+	 * The captured area when the sensor is cropped, relative to the whole
+	 * sensor (0..1). The default is the whole sensor.
+	 */
+	void SetCrop(float left, float top, float width, float height);
+	/**
+	 * Bounding box of both image circles relative to the whole sensor, as
+	 * left, top, width, height: the smallest crop losing nothing.
+	 */
+	static void GetImageCircleBounds(float bounds[4]);
 
 private:
-	void GetRenderedData(void *buffer);
+	static const int MAX_PLANES = 3;
+
+	void CreateInputTextures(int tex_width, int tex_height);
+	std::string Defines();
+
+	void Draw(GLuint framebuffer_id, int width, int height);
+	void GetRenderedData(GLuint framebuffer_id, int width, int height,
+			GLenum type, void *buffer);
 
 	int m_width, m_height;
+	uint32_t m_in_format, m_out_format;
 	GLProgram *m_program;
-	GLTexture *m_texture;
-	GLTexture *m_texture_dst;
+	int m_texture_count;
+	GLTexture *m_textures[MAX_PLANES];
+	int m_texture_dst_count;
+	GLTexture *m_textures_dst[MAX_PLANES];
+	//output texels drawn per row, less than the texture width when padded
+	int m_dst_width[MAX_PLANES];
+	uint32_t m_dst_stride[MAX_PLANES];
+	GLuint m_framebuffer_ids[MAX_PLANES];
 
 	EGLDisplay m_display;
+	EGLContext m_context;
 	EGLSurface m_surface;
 	GLuint m_quad_buffer;
-	GLuint m_framebuffer_id;
 
 	float m_x_deg;
 	float m_y_deg;
 	float m_z_deg;
+	float m_crop[4];
 };
 
 }
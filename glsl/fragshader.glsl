@@ -1,14 +1,46 @@
 varying vec2 tcoord;
 uniform mat4 unif_matrix;
 uniform sampler2D tex;
+#if defined(INPUT_I420)
+uniform sampler2D tex_u;
+uniform sampler2D tex_v;
+#elif defined(INPUT_NV12)
+uniform sampler2D tex_uv;
+#endif
+#ifdef OUTPUT_I420
+//0:y 1:u 2:v, each texel packs 4 horizontal samples of the plane
+uniform int plane;
+uniform vec2 plane_size;
+#endif
+
+//calibration of the image circles, see GLTransform
+uniform float aspect;
+uniform float image_r;
+uniform vec2 center1;
+uniform vec2 center2;
+//captured area (left, top, width, height) relative to the whole sensor
+uniform vec4 crop;
 
 const float M_PI = 3.1415926535;
-const float aspect = 480.0 / 640.0;
-const float image_r = 0.92;
-const vec2 center1 = vec2(0.55, 0.50);
-const vec2 center2 = vec2(0.555, 0.52);
 
-void main(void) {
+vec3 sample_rgb(vec2 uv) {
+#if defined(INPUT_I420) || defined(INPUT_NV12)
+        float y = texture2D(tex, uv).r;
+#if defined(INPUT_I420)
+        float cb = texture2D(tex_u, uv).r - 0.5;
+        float cr = texture2D(tex_v, uv).r - 0.5;
+#else
+        vec4 cbcr = texture2D(tex_uv, uv);
+        float cb = cbcr.r - 0.5;
+        float cr = cbcr.a - 0.5;
+#endif
+        return vec3(y + 1.402 * cr, y - 0.344 * cb - 0.714 * cr, y + 1.772 * cb);
+#else
+        return texture2D(tex, uv).rgb;
+#endif
+}
+
+vec3 equirectangular(vec2 tcoord) {
         float u_factor = aspect*image_r;
         float v_factor = image_r;
         float u = 0.0;
@@ -48,10 +80,36 @@ void main(void) {
                 }
         }
         if (u == 0.0 && v == 0.0) {
-                gl_FragColor = vec4(0.0, 0.0, 0.0, 1.0);
+                return vec3(0.0, 0.0, 0.0);
+        }
+        vec2 uv = (vec2(u, v) - crop.xy) / crop.zw;
+        if (any(lessThan(uv, vec2(0.0))) || any(greaterThan(uv, vec2(1.0)))) {
+                return vec3(0.0, 0.0, 0.0);
         }
-        else {
-                gl_FragColor = texture2D(tex, vec2(u, v));
+        return sample_rgb(uv);
+}
+
+#ifdef OUTPUT_I420
+float plane_sample(float x, float y) {
+        //chroma samples land on the center of their 2x2 luma block
+        vec3 c = equirectangular(vec2(x + 0.5, y) / plane_size);
+        if (plane == 0) {
+                return dot(c, vec3(0.299, 0.587, 0.114));
+        } else if (plane == 1) {
+                return dot(c, vec3(-0.169, -0.331, 0.5)) + 0.5;
+        } else {
+                return dot(c, vec3(0.5, -0.419, -0.081)) + 0.5;
         }
 }
 
+void main(void) {
+        float x = floor(gl_FragCoord.x) * 4.0;
+        float y = gl_FragCoord.y;
+        gl_FragColor = vec4(plane_sample(x, y), plane_sample(x + 1.0, y),
+                        plane_sample(x + 2.0, y), plane_sample(x + 3.0, y));
+}
+#else
+void main(void) {
+        gl_FragColor = vec4(equirectangular(tcoord), 1.0);
+}
+#endif
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+#include "group.h"
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+
+/* epoll data of the eventfd used to wake the thread up for stopping */
+#define GROUP_STOP UINT64_MAX
+
+struct camera_group {
+  camera_t* cameras[CAMERA_GROUP_MAX];
+  size_t count;
+  int epfd;
+  int stopfd;
+  pthread_t thread;
+  bool running;
+  camera_group_func_t func;
+  void* pointer;
+  camera_group_stats_t stats;
+};
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+//[thread]
+static void group_remove(camera_group_t* group, size_t device,
+                         const char* msg)
+{
+  camera_t* camera = group->cameras[device];
+  epoll_ctl(group->epfd, EPOLL_CTL_DEL, camera->fd, NULL);
+  camera->context.log(CAMERA_FAIL, msg, camera->context.pointer);
+}
+
+static void* group_main(void* arg)
+{
+  camera_group_t* group = arg;
+  struct epoll_event events[CAMERA_GROUP_MAX + 1];
+  for (;;) {
+    int n = epoll_wait(group->epfd, events, group->count + 1, -1);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    __atomic_fetch_add(&group->stats.wakeups, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.u64 == GROUP_STOP) return NULL;
+      size_t device = events[i].data.u64;
+      camera_group_frame_t frame;
+      frame.device = device;
+      frame.camera = group->cameras[device];
+      if (events[i].events & EPOLLERR) {
+        /* streaming stopped underneath us: stop polling the device */
+        group_remove(group, device, "group: device error, removed");
+        continue;
+      }
+      /* level triggered: a backlog of frames is drained one per wakeup,
+       * interleaved fairly with the other devices */
+      if (!camera_frame_acquire(frame.camera, &frame.frame)) {
+        if (errno != EAGAIN)
+          group_remove(group, device, "group: dequeue failed, removed");
+        continue;
+      }
+      frame.timestamp_us = now_us();
+      __atomic_fetch_add(&group->stats.frames, 1, __ATOMIC_RELAXED);
+      group->func(&frame, group->pointer);
+      camera_frame_release(frame.camera, &frame.frame);
+    }
+  }
+  return NULL;
+}
+
+
+//[group]
+camera_group_t* camera_group_new(void)
+{
+  camera_group_t* group = calloc(1, sizeof (camera_group_t));
+  if (group == NULL) return NULL;
+  group->epfd = epoll_create1(EPOLL_CLOEXEC);
+  group->stopfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (group->epfd == -1 || group->stopfd == -1) goto fail;
+  struct epoll_event ev = {.events = EPOLLIN, .data.u64 = GROUP_STOP};
+  if (epoll_ctl(group->epfd, EPOLL_CTL_ADD, group->stopfd, &ev) == -1)
+    goto fail;
+  return group;
+fail:
+  if (group->epfd != -1) close(group->epfd);
+  if (group->stopfd != -1) close(group->stopfd);
+  free(group);
+  return NULL;
+}
+
+void camera_group_delete(camera_group_t* group)
+{
+  if (group == NULL) return;
+  camera_group_stop(group);
+  close(group->epfd);
+  close(group->stopfd);
+  free(group);
+}
+
+int camera_group_add(camera_group_t* group, camera_t* camera)
+{
+  if (group->running || group->count == CAMERA_GROUP_MAX) return -1;
+  group->cameras[group->count] = camera;
+  return group->count++;
+}
+
+size_t camera_group_size(camera_group_t* group)
+{
+  return group->count;
+}
+
+bool camera_group_start(camera_group_t* group,
+                        camera_group_func_t func, void* pointer)
+{
+  if (group->running) return false;
+  size_t added = 0;
+  for (; added < group->count; added++) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = added};
+    if (epoll_ctl(group->epfd, EPOLL_CTL_ADD,
+                  group->cameras[added]->fd, &ev) == -1) goto fail;
+  }
+  uint64_t drain;
+  while (read(group->stopfd, &drain, sizeof drain) > 0);
+  group->func = func;
+  group->pointer = pointer;
+  if (pthread_create(&group->thread, NULL, group_main, group) != 0)
+    goto fail;
+  group->running = true;
+  return true;
+fail:
+  for (size_t i = 0; i < added; i++)
+    epoll_ctl(group->epfd, EPOLL_CTL_DEL, group->cameras[i]->fd, NULL);
+  return false;
+}
+
+void camera_group_stop(camera_group_t* group)
+{
+  if (!group->running) return;
+  uint64_t one = 1;
+  while (write(group->stopfd, &one, sizeof one) == -1 && errno == EINTR);
+  pthread_join(group->thread, NULL);
+  /* fails harmlessly for devices already removed on error */
+  for (size_t i = 0; i < group->count; i++)
+    epoll_ctl(group->epfd, EPOLL_CTL_DEL, group->cameras[i]->fd, NULL);
+  group->running = false;
+}
+
+void camera_group_stats(camera_group_t* group, camera_group_stats_t* stats)
+{
+  stats->wakeups = __atomic_load_n(&group->stats.wakeups, __ATOMIC_RELAXED);
+  stats->frames = __atomic_load_n(&group->stats.frames, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,50 @@
+#ifndef CAMERA_GROUP_H
+#define CAMERA_GROUP_H
+
+#include "capture.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* several cameras serviced by one thread blocked on a single epoll set.
+ * frames are handed to the callback on that thread, tagged with the device
+ * index and a CLOCK_MONOTONIC timestamp taken on dequeue, so timestamps of
+ * different cameras are directly comparable */
+typedef struct camera_group camera_group_t;
+
+#define CAMERA_GROUP_MAX 16
+
+typedef struct {
+  size_t device; /* index returned by camera_group_add() */
+  camera_t* camera;
+  camera_frame_t frame; /* released when the callback returns */
+  uint64_t timestamp_us;
+} camera_group_frame_t;
+
+typedef void (*camera_group_func_t)(const camera_group_frame_t* frame,
+                                    void* pointer);
+
+typedef struct {
+  uint64_t wakeups; /* epoll_wait() returns */
+  uint64_t frames;
+} camera_group_stats_t;
+
+camera_group_t* camera_group_new(void);
+void camera_group_delete(camera_group_t* group);
+
+/* the device index, -1 when the group is full or already started */
+int camera_group_add(camera_group_t* group, camera_t* camera);
+size_t camera_group_size(camera_group_t* group);
+
+/* the cameras must be started (camera_start()) beforehand */
+bool camera_group_start(camera_group_t* group,
+                        camera_group_func_t func, void* pointer);
+void camera_group_stop(camera_group_t* group);
+void camera_group_stats(camera_group_t* group, camera_group_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -5,3 +5,7 @@ exports.Camera = function Camera() {
     var ctor = raw.Camera.bind.apply(raw.Camera, args);
     return new ctor;
 };
+
+exports.CameraGroup = function CameraGroup() {
+    return new raw.CameraGroup();
+};
@@ -0,0 +1,344 @@
+#define _GNU_SOURCE
+#include "mjpeg.h"
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <jpeglib.h>
+
+
+typedef enum {
+  SLOT_FREE = 0,
+  SLOT_QUEUED,
+  SLOT_DECODING,
+  SLOT_DONE,
+  SLOT_HELD,
+} slot_state_t;
+
+typedef struct {
+  slot_state_t state;
+  uint8_t* data;
+  size_t length;
+  size_t capacity;
+  uint8_t* rgb;
+  size_t rgb_capacity;
+  uint32_t width;
+  uint32_t height;
+  bool ok;
+  camera_frame_meta_t meta;
+  uint64_t submitted;
+  uint64_t decoded;
+} slot_t;
+
+struct camera_mjpeg {
+  size_t thread_count;
+  pthread_t* threads;
+  pthread_mutex_t mutex;
+  pthread_cond_t queued;
+  pthread_cond_t decoded;
+  bool stop;
+  // ring of in flight frames, the oldest at head
+  size_t slot_count;
+  slot_t* slots;
+  size_t head;
+  size_t pending;
+  size_t held;
+  camera_mjpeg_stats_t stats;
+};
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+//[decoding]
+typedef struct {
+  struct jpeg_error_mgr mgr;
+  jmp_buf jump;
+} decode_error_t;
+
+static void decode_error_exit(j_common_ptr cinfo)
+{
+  decode_error_t* err = (decode_error_t*) cinfo->err;
+  longjmp(err->jump, 1);
+}
+static void decode_output_message(j_common_ptr cinfo)
+{
+  // corrupt frames are counted as failed, not printed
+}
+
+/* libjpeg-turbo falls back to the standard huffman tables when
+ * the frame has no DHT segment, as is usual for MJPEG */
+static bool decode(struct jpeg_decompress_struct* cinfo, slot_t* slot)
+{
+  decode_error_t* err = (decode_error_t*) cinfo->err;
+  // assigned between setjmp and longjmp, so it has to be read from memory
+  JSAMPROW* volatile rows = NULL;
+  if (setjmp(err->jump)) {
+    free(rows);
+    jpeg_abort_decompress(cinfo);
+    return false;
+  }
+  jpeg_mem_src(cinfo, slot->data, slot->length);
+  jpeg_read_header(cinfo, TRUE);
+  cinfo->out_color_space = JCS_RGB;
+  cinfo->dct_method = JDCT_IFAST;
+  jpeg_start_decompress(cinfo);
+
+  size_t stride = (size_t) cinfo->output_width * 3;
+  size_t size = stride * cinfo->output_height;
+  if (size > slot->rgb_capacity) {
+    free(slot->rgb);
+    slot->rgb = malloc(size);
+    // read by camera_mjpeg_memory() from any thread
+    __atomic_store_n(&slot->rgb_capacity, slot->rgb == NULL ? 0 : size,
+                     __ATOMIC_RELAXED);
+  }
+  slot->width = cinfo->output_width;
+  slot->height = cinfo->output_height;
+  if (slot->rgb != NULL)
+    rows = malloc(cinfo->rec_outbuf_height * sizeof (JSAMPROW));
+  if (rows == NULL) {
+    jpeg_abort_decompress(cinfo);
+    return false;
+  }
+  while (cinfo->output_scanline < cinfo->output_height) {
+    JDIMENSION line = cinfo->output_scanline;
+    for (int i = 0; i < cinfo->rec_outbuf_height; i++) {
+      JDIMENSION row = line + i;
+      if (row >= cinfo->output_height) row = cinfo->output_height - 1;
+      rows[i] = slot->rgb + row * stride;
+    }
+    jpeg_read_scanlines(cinfo, rows, cinfo->rec_outbuf_height);
+  }
+  jpeg_finish_decompress(cinfo);
+  free(rows);
+  return true;
+}
+
+static void* decode_main(void* pointer)
+{
+  camera_mjpeg_t* mjpeg = pointer;
+  struct jpeg_decompress_struct cinfo;
+  decode_error_t err;
+  cinfo.err = jpeg_std_error(&err.mgr);
+  err.mgr.error_exit = &decode_error_exit;
+  err.mgr.output_message = &decode_output_message;
+  jpeg_create_decompress(&cinfo);
+
+  pthread_mutex_lock(&mjpeg->mutex);
+  for (;;) {
+    slot_t* slot = NULL;
+    while (!mjpeg->stop) {
+      for (size_t i = 0; i < mjpeg->pending; i++) {
+        slot_t* s = &mjpeg->slots[(mjpeg->head + i) % mjpeg->slot_count];
+        if (s->state == SLOT_QUEUED) {
+          slot = s;
+          break;
+        }
+      }
+      if (slot != NULL) break;
+      pthread_cond_wait(&mjpeg->queued, &mjpeg->mutex);
+    }
+    if (mjpeg->stop) break;
+    slot->state = SLOT_DECODING;
+    pthread_mutex_unlock(&mjpeg->mutex);
+
+    bool ok = decode(&cinfo, slot);
+    uint64_t decoded = now_us();
+
+    pthread_mutex_lock(&mjpeg->mutex);
+    slot->ok = ok;
+    slot->decoded = decoded;
+    slot->state = SLOT_DONE;
+    pthread_cond_broadcast(&mjpeg->decoded);
+  }
+  pthread_mutex_unlock(&mjpeg->mutex);
+  jpeg_destroy_decompress(&cinfo);
+  return NULL;
+}
+
+
+//[decoder]
+camera_mjpeg_t* camera_mjpeg_new(size_t threads, size_t depth)
+{
+  if (threads == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = online > 0 ? online : 1;
+  }
+  if (depth == 0) depth = threads + 1;
+  camera_mjpeg_t* mjpeg = malloc(sizeof (camera_mjpeg_t));
+  if (mjpeg == NULL) return NULL;
+  pthread_mutex_init(&mjpeg->mutex, NULL);
+  pthread_cond_init(&mjpeg->queued, NULL);
+  pthread_cond_init(&mjpeg->decoded, NULL);
+  mjpeg->stop = false;
+  // one more slot for the frame the caller holds since the last collect
+  mjpeg->slot_count = depth + 1;
+  mjpeg->slots = calloc(mjpeg->slot_count, sizeof (slot_t));
+  if (mjpeg->slots == NULL) mjpeg->slot_count = 0;
+  mjpeg->head = 0;
+  mjpeg->pending = 0;
+  mjpeg->held = mjpeg->slot_count;
+  memset(&mjpeg->stats, 0, sizeof mjpeg->stats);
+  mjpeg->threads = calloc(threads, sizeof (pthread_t));
+  mjpeg->thread_count = 0;
+  if (mjpeg->slots == NULL || mjpeg->threads == NULL) threads = 0;
+  for (size_t i = 0; i < threads; i++) {
+    if (pthread_create(&mjpeg->threads[i], NULL, &decode_main, mjpeg) != 0) 
+      break;
+    mjpeg->thread_count++;
+  }
+  if (mjpeg->thread_count == 0) {
+    camera_mjpeg_delete(mjpeg);
+    return NULL;
+  }
+  return mjpeg;
+}
+
+void camera_mjpeg_delete(camera_mjpeg_t* mjpeg)
+{
+  pthread_mutex_lock(&mjpeg->mutex);
+  mjpeg->stop = true;
+  pthread_cond_broadcast(&mjpeg->queued);
+  pthread_mutex_unlock(&mjpeg->mutex);
+  for (size_t i = 0; i < mjpeg->thread_count; i++) {
+    pthread_join(mjpeg->threads[i], NULL);
+  }
+  for (size_t i = 0; i < mjpeg->slot_count; i++) {
+    free(mjpeg->slots[i].data);
+    free(mjpeg->slots[i].rgb);
+  }
+  free(mjpeg->slots);
+  free(mjpeg->threads);
+  pthread_cond_destroy(&mjpeg->decoded);
+  pthread_cond_destroy(&mjpeg->queued);
+  pthread_mutex_destroy(&mjpeg->mutex);
+  free(mjpeg);
+}
+
+size_t camera_mjpeg_threads(camera_mjpeg_t* mjpeg)
+{
+  return mjpeg->thread_count;
+}
+
+size_t camera_mjpeg_pending(camera_mjpeg_t* mjpeg)
+{
+  pthread_mutex_lock(&mjpeg->mutex);
+  size_t pending = mjpeg->pending;
+  pthread_mutex_unlock(&mjpeg->mutex);
+  return pending;
+}
+
+bool camera_mjpeg_submit(camera_mjpeg_t* mjpeg, 
+                         const uint8_t* data, size_t length,
+                         const camera_frame_meta_t* meta)
+{
+  pthread_mutex_lock(&mjpeg->mutex);
+  size_t index = (mjpeg->head + mjpeg->pending) % mjpeg->slot_count;
+  slot_t* slot = &mjpeg->slots[index];
+  if (mjpeg->pending >= mjpeg->slot_count - 1 || slot->state != SLOT_FREE) {
+    mjpeg->stats.dropped++;
+    pthread_mutex_unlock(&mjpeg->mutex);
+    return false;
+  }
+  pthread_mutex_unlock(&mjpeg->mutex);
+
+  // free slots are not touched by the decoding threads
+  if (length > slot->capacity) {
+    free(slot->data);
+    slot->data = malloc(length);
+    __atomic_store_n(&slot->capacity, slot->data == NULL ? 0 : length,
+                     __ATOMIC_RELAXED);
+    if (slot->data == NULL) {
+      pthread_mutex_lock(&mjpeg->mutex);
+      mjpeg->stats.dropped++;
+      pthread_mutex_unlock(&mjpeg->mutex);
+      return false;
+    }
+  }
+  memcpy(slot->data, data, length);
+  slot->length = length;
+  slot->meta = *meta;
+  slot->submitted = now_us();
+
+  pthread_mutex_lock(&mjpeg->mutex);
+  slot->state = SLOT_QUEUED;
+  mjpeg->pending++;
+  pthread_cond_signal(&mjpeg->queued);
+  pthread_mutex_unlock(&mjpeg->mutex);
+  return true;
+}
+
+bool camera_mjpeg_collect(camera_mjpeg_t* mjpeg, 
+                          camera_mjpeg_frame_t* frame, bool wait)
+{
+  pthread_mutex_lock(&mjpeg->mutex);
+  if (mjpeg->held < mjpeg->slot_count) {
+    mjpeg->slots[mjpeg->held].state = SLOT_FREE;
+    mjpeg->held = mjpeg->slot_count;
+  }
+  if (mjpeg->pending == 0) {
+    pthread_mutex_unlock(&mjpeg->mutex);
+    return false;
+  }
+  slot_t* slot = &mjpeg->slots[mjpeg->head];
+  while (wait && slot->state != SLOT_DONE) 
+    pthread_cond_wait(&mjpeg->decoded, &mjpeg->mutex);
+  if (slot->state != SLOT_DONE) {
+    pthread_mutex_unlock(&mjpeg->mutex);
+    return false;
+  }
+  slot->state = SLOT_HELD;
+  mjpeg->held = mjpeg->head;
+  mjpeg->head = (mjpeg->head + 1) % mjpeg->slot_count;
+  mjpeg->pending--;
+
+  uint64_t latency = slot->decoded - slot->submitted;
+  mjpeg->stats.frames++;
+  if (!slot->ok) mjpeg->stats.failed++;
+  mjpeg->stats.latency_total_us += latency;
+  if (latency > mjpeg->stats.latency_max_us) 
+    mjpeg->stats.latency_max_us = latency;
+  pthread_mutex_unlock(&mjpeg->mutex);
+
+  frame->rgb = slot->rgb;
+  frame->width = slot->width;
+  frame->height = slot->height;
+  frame->ok = slot->ok;
+  frame->latency_us = latency;
+  frame->meta = slot->meta;
+  return true;
+}
+
+void camera_mjpeg_stats(camera_mjpeg_t* mjpeg, camera_mjpeg_stats_t* stats)
+{
+  pthread_mutex_lock(&mjpeg->mutex);
+  *stats = mjpeg->stats;
+  pthread_mutex_unlock(&mjpeg->mutex);
+}
+
+void camera_mjpeg_stats_reset(camera_mjpeg_t* mjpeg)
+{
+  pthread_mutex_lock(&mjpeg->mutex);
+  memset(&mjpeg->stats, 0, sizeof mjpeg->stats);
+  pthread_mutex_unlock(&mjpeg->mutex);
+}
+
+size_t camera_mjpeg_memory(camera_mjpeg_t* mjpeg)
+{
+  size_t total = sizeof *mjpeg + mjpeg->thread_count * sizeof (pthread_t)
+    + mjpeg->slot_count * sizeof (slot_t);
+  // resized outside the mutex, by the submitter and the decoding threads
+  for (size_t i = 0; i < mjpeg->slot_count; i++) {
+    total += __atomic_load_n(&mjpeg->slots[i].capacity, __ATOMIC_RELAXED);
+    total += __atomic_load_n(&mjpeg->slots[i].rgb_capacity, __ATOMIC_RELAXED);
+  }
+  return total;
+}
@@ -0,0 +1,59 @@
+#ifndef CAMERA_MJPEG_H
+#define CAMERA_MJPEG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "capture.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* MJPEG frames decoded to packed RGB on a pool of libjpeg(-turbo) threads.
+ * several frames are in flight and come back in submission order */
+typedef struct camera_mjpeg camera_mjpeg_t;
+
+typedef struct {
+  uint8_t* rgb; /* valid until the next camera_mjpeg_collect() */
+  uint32_t width;
+  uint32_t height;
+  bool ok;
+  uint64_t latency_us; /* from submit to the end of decoding */
+  camera_frame_meta_t meta; /* as submitted with the frame */
+} camera_mjpeg_frame_t;
+
+typedef struct {
+  uint64_t frames;
+  uint64_t failed;
+  uint64_t dropped; /* refused by camera_mjpeg_submit() */
+  uint64_t latency_total_us;
+  uint64_t latency_max_us;
+} camera_mjpeg_stats_t;
+
+/* threads 0: one per online cpu. depth: frames in flight at most.
+ * NULL when out of memory or no thread could start */
+camera_mjpeg_t* camera_mjpeg_new(size_t threads, size_t depth);
+void camera_mjpeg_delete(camera_mjpeg_t* mjpeg);
+size_t camera_mjpeg_threads(camera_mjpeg_t* mjpeg);
+size_t camera_mjpeg_pending(camera_mjpeg_t* mjpeg);
+
+/* copies the compressed frame; false, and counted as dropped, when depth
+ * frames are in flight or the copy cannot be allocated */
+bool camera_mjpeg_submit(camera_mjpeg_t* mjpeg, 
+                         const uint8_t* data, size_t length,
+                         const camera_frame_meta_t* meta);
+/* the oldest submitted frame. false when none is in flight, or when 
+ * it is not decoded yet and wait is false */
+bool camera_mjpeg_collect(camera_mjpeg_t* mjpeg, 
+                          camera_mjpeg_frame_t* frame, bool wait);
+void camera_mjpeg_stats(camera_mjpeg_t* mjpeg, camera_mjpeg_stats_t* stats);
+void camera_mjpeg_stats_reset(camera_mjpeg_t* mjpeg);
+/* bytes allocated: the compressed copies and decoded images of every slot */
+size_t camera_mjpeg_memory(camera_mjpeg_t* mjpeg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -15,6 +15,7 @@
 #include <fstream>
 
 #include <opencv2/opencv.hpp>
+#include <linux/videodev2.h>
 
 //Sigh
 extern "C" {
@@ -57,18 +58,28 @@ extern "C" {
 
 extern void BGR2RGB(const cv::Mat &src, uint8_t *dst, int stride);
 
+namespace omxcv {
+    /* Input stride in bytes (of the Y plane when planar) for the format. */
+    int InputStride(int width, uint32_t format);
+    OMX_COLOR_FORMATTYPE InputColorFormat(uint32_t format);
+    /* Copies an image into a padded OMX input buffer, row by row. */
+    bool CopyInput(const camera_image_t *image, OMX_BUFFERHEADERTYPE *in,
+            int stride, int slice_height);
+}
+
 namespace omxcv {
     /**
      * Our implementation class of the encoder.
      */
     class OmxCvImpl {
         public:
-            OmxCvImpl(const char *name, int width, int height, int bitrate, int fpsnum=-1, int fpsden=-1);
+            OmxCvImpl(const char *name, int width, int height, int bitrate, int fpsnum=-1, int fpsden=-1, uint32_t format=V4L2_PIX_FMT_RGB24);
             virtual ~OmxCvImpl();
 
-            bool process(const unsigned char *in_data);
+            bool process(const camera_image_t *image);
         private:
-            int m_width, m_height, m_stride, m_bitrate, m_fpsnum, m_fpsden;
+            int m_width, m_height, m_stride, m_slice_height, m_bitrate, m_fpsnum, m_fpsden;
+            uint32_t m_format;
 
             std::string m_filename;
             std::ofstream m_ofstream;
@@ -84,6 +95,7 @@ namespace omxcv {
             COMPONENT_T *m_encoder_component;
 
             std::chrono::steady_clock::time_point m_frame_start;
+            int64_t m_pts_start;
             int m_frame_count;
 
             void input_worker();
@@ -92,12 +104,13 @@ namespace omxcv {
     
     class OmxCvJpegImpl {
         public:
-            OmxCvJpegImpl(int width, int height, int quality=90);
+            OmxCvJpegImpl(int width, int height, int quality=90, uint32_t format=V4L2_PIX_FMT_RGB24);
             virtual ~OmxCvJpegImpl();
             
-            bool process(const char *filename, const unsigned char *in_data);
+            bool process(const char *filename, const camera_image_t *image);
         private:
-            int m_width, m_height, m_stride, m_quality;
+            int m_width, m_height, m_stride, m_slice_height, m_quality;
+            uint32_t m_format;
             
             std::condition_variable m_input_signaller;
             std::deque<std::pair<OMX_BUFFERHEADERTYPE *, std::string>> m_input_queue;
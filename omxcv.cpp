@@ -10,6 +10,7 @@ using namespace omxcv;
 
 using std::this_thread::sleep_for;
 using std::chrono::milliseconds;
+using std::chrono::microseconds;
 using std::chrono::steady_clock;
 using std::chrono::duration_cast;
 
@@ -41,6 +42,53 @@ void BGR2RGB(const cv::Mat &src, uint8_t *dst, int stride) {
 #endif
 }
 
+/**
+ * Input stride for the encoder.
+ * @param [in] width The image width.
+ * @param [in] format V4L2_PIX_FMT_RGB24 or V4L2_PIX_FMT_YUV420.
+ * @return The stride in bytes, of the Y plane when planar.
+ */
+int omxcv::InputStride(int width, uint32_t format) {
+	//Must be a multiple of 32
+	int aligned = (width + 31) & ~31;
+	return format == V4L2_PIX_FMT_YUV420 ? aligned : aligned * 3;
+}
+
+/**
+ * OpenMAX colour format for the input format.
+ * @param [in] format V4L2_PIX_FMT_RGB24 or V4L2_PIX_FMT_YUV420.
+ * @throws std::invalid_argument for other formats.
+ */
+OMX_COLOR_FORMATTYPE omxcv::InputColorFormat(uint32_t format) {
+	switch (format) {
+	case V4L2_PIX_FMT_RGB24:
+		return OMX_COLOR_Format24bitBGR888;
+	case V4L2_PIX_FMT_YUV420:
+		return OMX_COLOR_FormatYUV420PackedPlanar;
+	default:
+		throw std::invalid_argument("Unsupported input format.");
+	}
+}
+
+/**
+ * Copy an image into an OpenMAX input buffer, unless it was filled in place.
+ * Only the image's rows are read: its stride may differ from the buffer's.
+ * @param [in] image The source image.
+ * @param [in] in The input buffer.
+ * @param [in] stride The stride of the input buffer (Y plane when planar).
+ * @param [in] slice_height The rows per plane of the input buffer.
+ * @return false when the image does not fit the buffer's layout.
+ */
+bool omxcv::CopyInput(const camera_image_t *image, OMX_BUFFERHEADERTYPE *in,
+		int stride, int slice_height) {
+	camera_image_t dst;
+	size_t size = camera_image_init(&dst, in->pBuffer, image->format,
+			image->width, image->height, stride, slice_height);
+	if (size == 0 || size > in->nAllocLen)
+		return false;
+	return camera_image_copy(image, &dst);
+}
+
 /**
  * Constructor.
  * @param [in] name The file to save to.
@@ -49,11 +97,14 @@ void BGR2RGB(const cv::Mat &src, uint8_t *dst, int stride) {
  * @param [in] bitrate The bitrate, in Kbps.
  * @param [in] fpsnum The FPS numerator.
  * @param [in] fpsden The FPS denominator.
+ * @param [in] format The input format (RGB24 or YUV420).
  */
 OmxCvImpl::OmxCvImpl(const char *name, int width, int height, int bitrate,
-		int fpsnum, int fpsden) :
-		m_width(width), m_height(height), m_stride(((width + 31) & ~31) * 3), m_bitrate(
-				bitrate), m_filename(name), m_stop { false } {
+		int fpsnum, int fpsden, uint32_t format) :
+		m_width(width), m_height(height), m_stride(
+				InputStride(width, format)), m_slice_height(
+				(height + 15) & ~15), m_bitrate(bitrate), m_format(format), m_filename(
+				name), m_stop { false }, m_pts_start(-1), m_frame_count(0) {
 	int ret;
 	bcm_host_init();
 
@@ -90,12 +141,15 @@ OmxCvImpl::OmxCvImpl(const char *name, int width, int height, int bitrate,
 	def.format.video.nFrameHeight = m_height;
 	def.format.video.xFramerate = 30 << 16;
 	//Must be a multiple of 16
-	def.format.video.nSliceHeight = (m_height + 15) & ~15;
+	def.format.video.nSliceHeight = m_slice_height;
 	//Must be a multiple of 32
 	def.format.video.nStride = m_stride;
-	def.format.video.eColorFormat = OMX_COLOR_Format24bitBGR888; //OMX_COLOR_Format32bitABGR8888;//OMX_COLOR_FormatYUV420PackedPlanar;
+	def.format.video.eColorFormat = InputColorFormat(m_format); //OMX_COLOR_Format32bitABGR8888;
 	//Must be manually defined to ensure sufficient size if stride needs to be rounded up to multiple of 32.
 	def.nBufferSize = def.format.video.nStride * def.format.video.nSliceHeight;
+	if (m_format == V4L2_PIX_FMT_YUV420) {
+		def.nBufferSize = def.nBufferSize * 3 / 2;
+	}
 	//We allocate 1 input buffers.
 	def.nBufferCountActual = 1;
 
@@ -216,6 +270,22 @@ OmxCvImpl::~OmxCvImpl() {
 	ilclient_destroy(m_ilclient);
 }
 
+/**
+ * Converts a timestamp in microseconds to OpenMAX ticks.
+ * @param [in] us The timestamp.
+ * @return The ticks, split in two halves unless 64 bit ticks are enabled.
+ */
+static inline OMX_TICKS ToOMXTicks(int64_t us) {
+#ifdef OMX_SKIP64BIT
+	OMX_TICKS ticks;
+	ticks.nLowPart = (OMX_U32) us;
+	ticks.nHighPart = (OMX_U32) (us >> 32);
+	return ticks;
+#else
+	return us;
+#endif
+}
+
 /**
  * Input encoding routine.
  */
@@ -268,7 +338,7 @@ void OmxCvImpl::input_worker() {
 /**
  * Output muxing routine.
  * @param [in] out Buffer to be saved.
- * @param [in] timestamp Timestamp of this buffer.
+ * @param [in] timestamp Presentation timestamp of this buffer, in microseconds.
  * @return true if buffer was saved.
  */
 bool OmxCvImpl::write_data(OMX_BUFFERHEADERTYPE *out, int64_t timestamp) {
@@ -285,10 +355,16 @@ bool OmxCvImpl::write_data(OMX_BUFFERHEADERTYPE *out, int64_t timestamp) {
 
 /**
  * Enqueue video to be encoded.
- * @param [in] mat The mat to be encoded.
+ * @param [in] image The image to be encoded, copied into an input buffer.
+ * Its timestamp_us is the capture time in microseconds; the presentation
+ * timestamp is taken relative to the first frame's. When
+ * negative, the time of the call is used instead.
  * @return true iff enqueued.
  */
-bool OmxCvImpl::process(const unsigned char *in_data) {
+bool OmxCvImpl::process(const camera_image_t *image) {
+	if ((int) image->width != m_width || (int) image->height != m_height
+			|| image->format != m_format)
+		return false;
 	OMX_BUFFERHEADERTYPE *in = ilclient_get_input_buffer(m_encoder_component,
 	OMX_ENCODE_PORT_IN, 0);
 	if (in == NULL) {
@@ -297,18 +373,27 @@ bool OmxCvImpl::process(const unsigned char *in_data) {
 	}
 
 	auto now = steady_clock::now();
-	memcpy(in->pBuffer, in_data, m_stride * m_height);
+	int64_t timestamp_us = image->timestamp_us;
+	if (!CopyInput(image, in, m_stride, m_slice_height)) {
+		//back to the port empty, it wants all its buffers to shut down
+		in->nFilledLen = 0;
+		OMX_EmptyThisBuffer(ILC_GET_HANDLE(m_encoder_component), in);
+		return false;
+	}
 	//BGR2RGB(mat, in->pBuffer, m_stride);
 	in->nFilledLen = in->nAllocLen;
 
 	std::unique_lock < std::mutex > lock(m_input_mutex);
 	if (m_frame_count++ == 0) {
 		m_frame_start = now;
+		m_pts_start = timestamp_us;
 	}
+	int64_t pts = (timestamp_us >= 0 && m_pts_start >= 0) ?
+			timestamp_us - m_pts_start :
+			duration_cast < microseconds > (now - m_frame_start).count();
+	in->nTimeStamp = ToOMXTicks(pts);
 	m_input_queue.push_back(
-			std::pair<OMX_BUFFERHEADERTYPE *, int64_t>(in,
-					duration_cast < milliseconds
-							> (now - m_frame_start).count()));
+			std::pair<OMX_BUFFERHEADERTYPE *, int64_t>(in, pts));
 	lock.unlock();
 	m_input_signaller.notify_one();
 	return true;
@@ -322,10 +407,12 @@ bool OmxCvImpl::process(const unsigned char *in_data) {
  * @param [in] bitrate The bitrate, in Kbps.
  * @param [in] fpsnum The FPS numerator.
  * @param [in] fpsden The FPS denominator.
+ * @param [in] format The input format (RGB24 or YUV420).
  */
 OmxCv::OmxCv(const char *name, int width, int height, int bitrate, int fpsnum,
-		int fpsden) {
-	m_impl = new OmxCvImpl(name, width, height, bitrate, fpsnum, fpsden);
+		int fpsden, uint32_t format) {
+	m_impl = new OmxCvImpl(name, width, height, bitrate, fpsnum, fpsden,
+			format);
 }
 
 /**
@@ -337,9 +424,12 @@ OmxCv::~OmxCv() {
 
 /**
  * Encode image.
- * @param [in] in Image to be encoded.
+ * @param [in] image Image to be encoded. Its capture timestamp in
+ * microseconds is used for the presentation timestamp, or the time of the
+ * call when negative.
  * @return true iff the image was encoded.
  */
-bool OmxCv::Encode(const unsigned char *in_data) {
-	return m_impl->process(in_data);
+bool OmxCv::Encode(const camera_image_t *image) {
+	return m_impl->process(image);
 }
+
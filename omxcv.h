@@ -7,6 +7,9 @@
 #define __OMXCV_H
 
 #include <opencv2/opencv.hpp>
+#include <linux/videodev2.h>
+#include <stdint.h>
+#include "capture.h"
 
 namespace omxcv {
     /* Forward declaration of our H.264 implementation. */
@@ -16,11 +19,13 @@ namespace omxcv {
 
     /**
      * Real-time OpenMAX H.264 encoder for the Raspberry Pi/OpenCV.
+     * Input frames are V4L2_PIX_FMT_RGB24 or V4L2_PIX_FMT_YUV420 (I420),
+     * of any stride.
      */
     class OmxCv {
         public:
-            OmxCv(const char *name, int width, int height, int bitrate=3000, int fpsnum=25, int fpsden=1);
-            bool Encode(const unsigned char *in_data);
+            OmxCv(const char *name, int width, int height, int bitrate=3000, int fpsnum=25, int fpsden=1, uint32_t format=V4L2_PIX_FMT_RGB24);
+            bool Encode(const camera_image_t *image);
             virtual ~OmxCv();
         private:
             OmxCvImpl *m_impl;
@@ -31,8 +36,8 @@ namespace omxcv {
      */
      class OmxCvJpeg {
          public:
-            OmxCvJpeg(int width, int height, int quality=90);
-            bool Encode(const char *filename, const unsigned char *in_data);
+            OmxCvJpeg(int width, int height, int quality=90, uint32_t format=V4L2_PIX_FMT_RGB24);
+            bool Encode(const char *filename, const camera_image_t *image);
             virtual ~OmxCvJpeg();
          private:
             OmxCvJpegImpl *m_impl;
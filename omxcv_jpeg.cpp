@@ -14,13 +14,16 @@ using namespace omxcv;
  * @param [in] width The width of the image to encode.
  * @param [in] height The height of the image to encode.
  * @param [in] quality The JPEG quality factor (1-100). 100 is best quality.
+ * @param [in] format The input format (RGB24 or YUV420).
  * @throws std::invalid_argument on error.
  */
-OmxCvJpegImpl::OmxCvJpegImpl(int width, int height, int quality)
+OmxCvJpegImpl::OmxCvJpegImpl(int width, int height, int quality, uint32_t format)
 : m_width(width)
 , m_height(height)
-, m_stride(((width + 31) & ~31) * 3)
+, m_stride(InputStride(width, format))
+, m_slice_height((height + 15) & ~15)
 , m_quality(quality)
+, m_format(format)
 , m_stop{false}
 {
     int ret;
@@ -51,12 +54,15 @@ OmxCvJpegImpl::OmxCvJpegImpl(int width, int height, int quality)
     def.format.image.nFrameWidth = m_width;
     def.format.image.nFrameHeight = m_height;
     //16 byte alignment. I don't know if these also hold for image encoding.
-    def.format.image.nSliceHeight = (m_height + 15) & ~15;
+    def.format.image.nSliceHeight = m_slice_height;
+    def.format.image.nStride = m_stride;
     //Must be manually defined to ensure sufficient size if stride needs to be rounded up to multiple of 32.
     def.nBufferSize = def.format.image.nStride * def.format.image.nSliceHeight;
-    def.format.image.nStride = m_stride;
+    if (m_format == V4L2_PIX_FMT_YUV420) {
+        def.nBufferSize = def.nBufferSize * 3 / 2;
+    }
     def.format.image.bFlagErrorConcealment = OMX_FALSE;
-    def.format.image.eColorFormat =  OMX_COLOR_Format24bitBGR888; //OMX_COLOR_Format32bitABGR8888;//OMX_COLOR_FormatYUV420PackedPlanar;
+    def.format.image.eColorFormat = InputColorFormat(m_format); //OMX_COLOR_Format32bitABGR8888;
 
     ret = OMX_SetParameter(ILC_GET_HANDLE(m_encoder_component),
             OMX_IndexParamPortDefinition, &def);
@@ -167,11 +173,15 @@ void OmxCvJpegImpl::input_worker() {
 /**
  * Process a frame.
  * @param [in] filename The filename to save to.
- * @param [in] mat The image data to save.
+ * @param [in] image The image to save, of any stride.
  * @return true iff the image will be saved. Will return false if there's no
- *         free input buffer.
+ *         free input buffer or the image is not of the encoder's size and
+ *         format.
  */
-bool OmxCvJpegImpl::process(const char *filename, const unsigned char *in_data) {
+bool OmxCvJpegImpl::process(const char *filename, const camera_image_t *image) {
+    if ((int) image->width != m_width || (int) image->height != m_height
+            || image->format != m_format)
+        return false;
     //static const std::vector<int> saveparams = {CV_IMWRITE_JPEG_QUALITY, 75};
     //cv::imwrite(filename, mat, saveparams);
     OMX_BUFFERHEADERTYPE *in = ilclient_get_input_buffer(
@@ -180,7 +190,12 @@ bool OmxCvJpegImpl::process(const char *filename, const unsigned char *in_data)
         return false;
     }
 
-    memcpy(in->pBuffer, in_data, m_stride * m_height);
+    if (!CopyInput(image, in, m_stride, m_slice_height)) {
+        //Back to the free list, empty
+        in->nFilledLen = 0;
+        OMX_EmptyThisBuffer(ILC_GET_HANDLE(m_encoder_component), in);
+        return false;
+    }
     //BGR2RGB(mat, in->pBuffer, m_stride);
     in->nFilledLen = in->nAllocLen;
 
@@ -202,12 +217,12 @@ bool OmxCvJpegImpl::process(const char *filename, const unsigned char *in_data)
  * @param [in] fpsnum The FPS numerator.
  * @param [in] fpsden The FPS denominator.
  */
-OmxCvJpeg::OmxCvJpeg(int width, int height, int quality)
+OmxCvJpeg::OmxCvJpeg(int width, int height, int quality, uint32_t format)
 : m_width(width)
 , m_height(height)
 , m_quality(quality)
 {
-    m_impl = new OmxCvJpegImpl(width, height, quality);
+    m_impl = new OmxCvJpegImpl(width, height, quality, format);
 }
 
 /**
@@ -220,13 +235,12 @@ OmxCvJpeg::~OmxCvJpeg() {
 /**
  * Encode image.
  * @param [in] filename The path to save the image to.
- * @param [in] in Image to be encoded. If the width and height of this
- *                image does not match what was set in the constructor,
- *                this function will fallback to using OpenCV's imwrite.
+ * @param [in] image Image to be encoded, of the size and format set in
+ *                the constructor.
  * @return true iff the file was encoded.
  */
-bool OmxCvJpeg::Encode(const char *filename, const unsigned char *in_data) {
-    bool ret = m_impl->process(filename, in_data);
+bool OmxCvJpeg::Encode(const char *filename, const camera_image_t *image) {
+    bool ret = m_impl->process(filename, image);
     return ret;
 }
 
@@ -1,15 +1,34 @@
 #include "capture.h"
+#include "fanout.h"
+#include "group.h"
+#include "mjpeg.h"
 #include "picam360_tools.h"
 #include <node.h>
+#include <node_buffer.h>
 #include <v8.h>
 #include <uv.h>
 
+#include <ctype.h>
 #include <errno.h>
+#include <poll.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <sstream>
+#include <thread>
+#include <vector>
 
+// largest image size accepted
 #define MAX_WIDTH 1024*4
 #define MAX_HEIGHT 1024*4
 
@@ -19,44 +38,266 @@ struct CallbackData {
 	v8::Persistent<v8::Function> callback;
 };
 
+// work for the camera's native thread. callback is only touched on the loop
+struct Paused;
+class Camera;
+class CameraGroup;
+
+struct Job {
+	enum Kind {
+		CAPTURE, ADD_FRAME, TO_JPEG, PREPARE
+	} kind;
+	v8::Persistent<v8::Function> callback;
+	std::string filename;
+	int quality;
+	bool ok;
+	camera_frame_meta_t meta;
+	double transformed;
+	int slot; // leased with the frame views, -1 without
+	// PREPARE: microseconds each part took, -1 for parts not run
+	double camera_us;
+	double transformer_us;
+	double jpeg_us;
+	double total_us;
+};
+
+// equirect output of one frame. with frame views on, a slot stays leased
+// with the raw frame it was transformed from until JS gives it back, and the
+// raw frame stays off the camera until its view is collected too. the
+// sinks hold it by reference while it is queued on or being read by them
+struct Slot {
+	enum State {
+		FREE, HELD, RETURNED
+	} state;
+	int refs; // of the fan-out
+	unsigned char* image;
+	size_t capacity;
+	size_t length; // of the image in it
+	camera_image_t desc; // of the image in it
+	camera_frame_meta_t meta;
+	camera_frame_t frame;
+	uint32_t lease;
+	int views; // live Buffers of the lease
+	int image_views; // live Buffers over image
+	int raw_views; // live Buffers over frame, which keep it from the camera
+	uint32_t generation; // of image, replaced while viewed
+};
+
+// what a sink's thread reads besides its frames. a removed sink keeps its own
+// until the worker joined the thread, beside the one that replaced it
+struct SinkContext {
+	Camera* camera;
+	std::string file; // jpeg
+	int quality;
+	int width; // preview
+	int height;
+	std::vector<unsigned char> scaled;
+};
+
+// an image allocation replaced while Buffers still view it
+struct Orphan {
+	unsigned char* image;
+	size_t capacity;
+	int views;
+};
+
+struct ViewHint {
+	Camera* camera;
+	uint32_t lease;
+	int slot;
+	bool image;
+	uint32_t generation;
+};
+
 class Camera: node::ObjectWrap {
 public:
 	static void Init(v8::Handle<v8::Object> exports);
 private:
+	friend class CameraGroup;
 	static v8::Handle<v8::Value> New(const v8::Arguments& args);
 	static v8::Handle<v8::Value> Start(const v8::Arguments& args);
 	static v8::Handle<v8::Value> Stop(const v8::Arguments& args);
+	static v8::Handle<v8::Value> Prepare(const v8::Arguments& args);
 	static v8::Handle<v8::Value> StartRecord(const v8::Arguments& args);
 	static v8::Handle<v8::Value> StopRecord(const v8::Arguments& args);
 	static v8::Handle<v8::Value> Capture(const v8::Arguments& args);
+	static v8::Handle<v8::Value> StartStreaming(const v8::Arguments& args);
+	static v8::Handle<v8::Value> StopStreaming(const v8::Arguments& args);
+	static v8::Handle<v8::Value> SetSink(const v8::Arguments& args);
+	static v8::Handle<v8::Value> SetFrameViews(const v8::Arguments& args);
+	static v8::Handle<v8::Value> ReleaseFrame(const v8::Arguments& args);
 	static v8::Handle<v8::Value> ToJpeg(const v8::Arguments& args);
 	static v8::Handle<v8::Value> AddFrame(const v8::Arguments& args);
 	static v8::Handle<v8::Value> SetRotation(const v8::Arguments& args);
 	static v8::Handle<v8::Value> SetImageSize(const v8::Arguments& args);
+	static v8::Handle<v8::Value> SetImageFormat(const v8::Arguments& args);
 	static v8::Handle<v8::Value> ConfigGet(const v8::Arguments& args);
 	static v8::Handle<v8::Value> ConfigSet(const v8::Arguments& args);
+	static v8::Handle<v8::Value> Reconfigure(const v8::Arguments& args);
+	static v8::Handle<v8::Value> CropGet(const v8::Arguments& args);
+	static v8::Handle<v8::Value> CropSet(const v8::Arguments& args);
+	static v8::Handle<v8::Value> ImageCircleBounds(const v8::Arguments& args);
 	static v8::Handle<v8::Value> ControlGet(const v8::Arguments& args);
 	static v8::Handle<v8::Value> ControlSet(const v8::Arguments& args);
+	static v8::Handle<v8::Value> ControlsGet(const v8::Arguments& args);
+	static v8::Handle<v8::Value> ControlsSet(const v8::Arguments& args);
+	static v8::Handle<v8::Value> SetBufferCount(const v8::Arguments& args);
+	static v8::Handle<v8::Value> SetLatestOnly(const v8::Arguments& args);
+	static v8::Handle<v8::Value> StartCaptureThread(const v8::Arguments& args);
+	static v8::Handle<v8::Value> StopCaptureThread(const v8::Arguments& args);
+	static v8::Handle<v8::Value> Stats(const v8::Arguments& args);
+	static v8::Handle<v8::Value> MemoryUsage(const v8::Arguments& args);
+	static v8::Handle<v8::Value> ExportBuffers(const v8::Arguments& args);
+	static v8::Handle<v8::Value> SetMemory(const v8::Arguments& args);
+	static v8::Handle<v8::Value> SetConvertThreads(const v8::Arguments& args);
 
 	static v8::Local<v8::Object> Controls(camera_t* camera);
 	static v8::Local<v8::Object> Formats(camera_t* camera);
 	static void StopCB(uv_poll_t* handle, int status, int events);
-	static void CaptureCB(uv_poll_t* handle, int status, int events);
 
 	static void
 	WatchCB(uv_poll_t* handle, void (*callbackCall)(CallbackData* data));
 	static v8::Handle<v8::Value>
-	Watch(const v8::Arguments& args, uv_poll_cb cb);
+	Watch(const v8::Arguments& args, uv_poll_cb cb, int fd);
 	Camera();
 	~Camera();
+	// frames come from the capture thread's ring when it runs
+	bool Acquire(camera_frame_t* frame);
+	void Release(camera_frame_t* frame);
+	void StopThread();
+	// jobs run in order on one native thread, which owns the GL context and
+	// the encoders, and which streams frames between jobs. completions come
+	// back to the loop through done_async
+	friend struct Paused;
+	enum Wait {
+		FRAME, WOKEN, FAILED
+	};
+	void StartWorker();
+	void Hold();
+	void Unhold();
+	void Submit(Job* job, v8::Local<v8::Value> callback);
+	void Pause();
+	void Resume();
+	void StopWorker();
+	void WorkerMain();
+	bool Ready();
+	void RunJob(Job* job, bool cancelled, int slot);
+	bool Warm(Job* job, int slot);
+	void WarmConverter();
+	Wait WaitFrame(camera_frame_t* frame);
+	bool TransformFrame(camera_frame_t* frame, int slot);
+	void EndStream();
+	static void DoneCB(uv_async_t* handle, int status);
+	// native consumers of every transformed frame, fed through the fan-out.
+	// JS itself takes frames through the stream, which keeps the latest
+	enum Sink {
+		RECORD, JPEG, PREVIEW, SINKS
+	};
+	static const int SINK_DEPTH_MAX = 2;
+	void Feed(int slot);
+	void RemoveSink(int sink);
+	void JoinSinks(std::unique_lock<std::mutex>& lock);
+	static void SinkRelease(void* frame, void* pointer);
+	static void RecordSink(void* frame, void* pointer);
+	static void JpegSink(void* frame, void* pointer);
+	static void PreviewSink(void* frame, void* pointer);
+	// output slots, under jobs_mutex: the one transformed into, those with
+	// JS, and those the sinks can hold, so a slow sink never waits for one.
+	// images are allocated for as many as the leases and the sink queues on
+	// need, and freed again when those shrink
+	static const int LEASES = 2;
+	static const int SLOTS = 1 + LEASES + SINKS * (SINK_DEPTH_MAX + 1);
+	int SlotBudget();
+	int Holding();
+	int FreeSlot();
+	bool Leased();
+	bool SizeSlot(int slot);
+	void FreeImage(Slot* slot);
+	void TrimSlots();
+	void Reclaim();
+	void Return(int slot);
+	Slot* FindLease(uint32_t lease);
+	void FrameViews(v8::Local<v8::Object> meta, int slot);
+	static void ViewFree(char* data, void* hint);
+	bool Texture(const camera_frame_t* frame, camera_image_t* texture,
+			camera_frame_meta_t* meta);
 	camera_t* camera;
-	unsigned char *image_buffer;
+	// while a started group dequeues its frames, which nothing else may
+	CameraGroup* group;
+	picam360_pipeline_t* pipeline;
+	Slot slots[SLOTS];
+	std::vector<Orphan> orphans;
+	int image_slot; // the latest transformed, -1 before the first frame
+	uint32_t image_format;
+	bool frame_views;
+	uint32_t leases;
+	unsigned char *rgb_buffer;
+	size_t rgb_capacity;
+	camera_workers_t *workers;
+	camera_mjpeg_t *mjpeg;
+	camera_thread_t *capture_thread;
+	size_t thread_depth; // as asked for, to start it again after reconfigure
 	int image_width;
 	int image_height;
+	std::thread worker;
+	std::mutex jobs_mutex;
+	std::condition_variable jobs_cond;
+	std::deque<Job*> jobs;
+	std::deque<Job*> done;
+	bool worker_frame; // on the camera or the transformer, what Pause waits out
+	bool worker_quit;
+	int pauses;
+	int wake_fd;
+	uv_async_t* done_async;
+	size_t jobs_pending; // jobs and stream not called back yet
+	v8::Persistent<v8::Function> on_frame;
+	bool streaming;
+	bool stream_frame; // transformed, not called back yet
+	bool stream_failed;
+	camera_frame_meta_t stream_meta;
+	double stream_transformed;
+	int stream_slot;
+	uint64_t stream_coalesced;
+	uint64_t stream_dropped; // not called back, JS holding all its leases
+	uint64_t transform_failed; // uploaded, then dropped without an image
+	camera_fanout_t* fanout;
+	int sinks[SINKS]; // fan-out sink indices, -1 when off
+	SinkContext* sink_contexts[SINKS];
+	// under jobs_mutex: the queue depths of the sinks on, 0 when off, and the
+	// sinks removed whose threads the worker joins
+	size_t sink_depths[SINKS];
+	std::vector<std::pair<int, SinkContext*>> sinks_stopped;
+	bool trim_slots; // the budget shrank: Reclaim() frees idle images
+	// the encoders are shared by jobs and sinks
+	std::mutex record_mutex;
+	std::mutex jpeg_mutex;
+	v8::Persistent<v8::Function> on_preview;
+	// the latest preview for the loop, under jobs_mutex
+	std::vector<unsigned char> preview;
+	int preview_width;
+	int preview_height;
+	size_t preview_scaled_capacity; // of the preview sink's other buffer
+	bool preview_frame;
+	camera_frame_meta_t preview_meta;
+	uint64_t preview_coalesced;
+};
+
+// the worker stays off the camera for the scope
+struct Paused {
+	Camera* camera;
+	explicit Paused(Camera* camera) :
+			camera(camera) {
+		camera->Pause();
+	}
+	~Paused() {
+		camera->Resume();
+	}
 };
 
 //[error message handling]
+// the last message of the camera, logged by whichever thread uses it
 struct LogContext {
+	std::mutex mutex;
 	std::string msg;
 };
 static void logRecord(camera_log_t type, const char* msg, void* pointer) {
@@ -73,7 +314,9 @@ static void logRecord(camera_log_t type, const char* msg, void* pointer) {
 		ss << "CAMERA INFO [" << msg << "]";
 		break;
 	}
-	static_cast<LogContext*>(pointer)->msg = ss.str();
+	auto ctx = static_cast<LogContext*>(pointer);
+	std::lock_guard<std::mutex> lock(ctx->mutex);
+	ctx->msg = ss.str();
 }
 
 static inline v8::Handle<v8::Value> throwTypeError(const char* msg) {
@@ -84,9 +327,20 @@ static inline v8::Handle<v8::Value> throwError(const char* msg) {
 	auto message = v8::String::New(msg);
 	return v8::ThrowException(v8::Exception::Error(message));
 }
-static inline v8::Handle<v8::Value> throwError(camera_t* camera) {
+static inline std::string lastMessage(camera_t* camera) {
 	auto ctx = static_cast<LogContext*>(camera->context.pointer);
-	return throwError(ctx->msg.c_str());
+	std::lock_guard<std::mutex> lock(ctx->mutex);
+	return ctx->msg;
+}
+static inline v8::Handle<v8::Value> throwError(camera_t* camera) {
+	return throwError(lastMessage(camera).c_str());
+}
+static inline v8::Handle<v8::Value> throwGrouped() {
+	return throwError("grouped: frames go to the started CameraGroup");
+}
+static inline v8::Handle<v8::Value> throwLeased() {
+	return throwError(
+			"frames are leased: releaseFrame() them and drop their raw views first");
 }
 
 //[helpers]
@@ -124,6 +378,43 @@ static inline void setBool(const v8::Local<v8::Object>& self, const char* name,
 	setValue(self, name, v8::Boolean::New(value));
 }
 
+// the exported buffers still open, empty once they are freed: their fds are
+// closed with them and may be reused for anything
+static v8::Local<v8::Array> syncBuffers(const v8::Local<v8::Object>& thisObj,
+		camera_t* camera) {
+	auto buffers = v8::Array::New();
+	for (size_t i = 0; i < camera->buffer_count; i++) {
+		if (camera->buffers[i].dmabuf_fd < 0)
+			continue;
+		auto buffer = v8::Object::New();
+		setUint(buffer, "index", i);
+		setUint(buffer, "length", camera->buffers[i].length);
+		setInt(buffer, "fd", camera->buffers[i].dmabuf_fd);
+		buffers->Set(buffers->Length(), buffer);
+	}
+	setValue(thisObj, "buffers", buffers);
+	return buffers;
+}
+
+static v8::Local<v8::Object> convertMeta(const camera_frame_meta_t* cmeta) {
+	auto meta = v8::Object::New();
+	setValue(meta, "timestamp", v8::Number::New(cmeta->timestamp_us));
+#ifdef V4L2_BUF_FLAG_TIMESTAMP_MASK
+	setBool(meta, "monotonic", (cmeta->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK)
+			== V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC);
+#endif
+	setUint(meta, "sequence", cmeta->sequence);
+	setUint(meta, "bytesused", cmeta->bytesused);
+	setUint(meta, "flags", cmeta->flags);
+	setUint(meta, "field", cmeta->field);
+	return meta;
+}
+static inline double monotonicNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
 //[callback helpers]
 void Camera::WatchCB(uv_poll_t* handle,
 		void (*callbackCall)(CallbackData* data)) {
@@ -137,28 +428,27 @@ void Camera::WatchCB(uv_poll_t* handle,
 	data->callback.Dispose();
 	delete data;
 }
-v8::Handle<v8::Value> Camera::Watch(const v8::Arguments& args, uv_poll_cb cb) {
+v8::Handle<v8::Value> Camera::Watch(const v8::Arguments& args, uv_poll_cb cb,
+		int fd) {
 	v8::HandleScope scope;
 	auto data = new CallbackData;
 	auto thisObj = args.This();
 	data->thisObj = v8::Persistent < v8::Object > ::New(thisObj);
 	data->callback = v8::Persistent < v8::Function
 			> ::New(args[0].As<v8::Function>());
-	auto camera = node::ObjectWrap::Unwrap < Camera > (thisObj)->camera;
 
 	uv_poll_t* handle = new uv_poll_t;
 	handle->data = data;
-	uv_poll_init(uv_default_loop(), handle, camera->fd);
+	uv_poll_init(uv_default_loop(), handle, fd);
 	uv_poll_start(handle, UV_READABLE, cb);
 	return v8::Undefined();
 }
 
 //[methods]
 static const char* control_type_names[] = { "invalid", "int", "bool", "menu",
-		"int64", "class"
-				"string", "bitmask", "int_menu", };
+		"button", "int64", "class", "string", "bitmask", "int_menu", };
 v8::Local<v8::Object> Camera::Controls(camera_t* camera) {
-	auto ccontrols = camera_controls_new(camera);
+	auto ccontrols = camera_controls_cache(camera);
 	auto controls = v8::Array::New(ccontrols->length);
 	for (size_t i = 0; i < ccontrols->length; i++) {
 		auto ccontrol = &ccontrols->head[i];
@@ -205,7 +495,6 @@ v8::Local<v8::Object> Camera::Controls(camera_t* camera) {
 			break;
 		}
 	}
-	camera_controls_delete(ccontrols);
 	return controls;
 }
 
@@ -223,6 +512,14 @@ static v8::Local<v8::Object> convertFormat(camera_format_t* cformat) {
 	setUint(interval, "denominator", cformat->interval.denominator);
 	return format;
 }
+static v8::Local<v8::Object> convertRect(camera_rect_t* crect) {
+	auto rect = v8::Object::New();
+	setInt(rect, "left", crect->left);
+	setInt(rect, "top", crect->top);
+	setUint(rect, "width", crect->width);
+	setUint(rect, "height", crect->height);
+	return rect;
+}
 v8::Local<v8::Object> Camera::Formats(camera_t* camera) {
 	auto cformats = camera_formats_new(camera);
 	auto formats = v8::Array::New(cformats->length);
@@ -235,9 +532,40 @@ v8::Local<v8::Object> Camera::Formats(camera_t* camera) {
 }
 
 Camera::Camera() :
-		camera(nullptr) {
+		camera(nullptr), group(nullptr), pipeline(nullptr), slots(), image_slot(-1), image_format(
+				V4L2_PIX_FMT_RGB24), frame_views(false), leases(0), rgb_buffer(
+				nullptr), rgb_capacity(0), workers(nullptr), mjpeg(nullptr), capture_thread(
+				nullptr), thread_depth(0), worker_frame(false), worker_quit(false), pauses(0), wake_fd(
+				-1), done_async(nullptr), jobs_pending(0), streaming(false), stream_frame(
+				false), stream_failed(false), stream_meta(), stream_transformed(
+				0), stream_slot(-1), stream_coalesced(0), stream_dropped(0), transform_failed(0), fanout(
+				nullptr), trim_slots(false), preview_width(0), preview_height(0), preview_scaled_capacity(
+				0), preview_frame(false), preview_meta(), preview_coalesced(
+				0) {
+	for (int i = 0; i < SINKS; i++) {
+		sinks[i] = -1;
+		sink_contexts[i] = nullptr;
+		sink_depths[i] = 0;
+	}
 }
 Camera::~Camera() {
+	// the worker feeds the sinks and joins them, the preview sink wakes the
+	// loop
+	for (int i = 0; i < SINKS; i++)
+		RemoveSink(i);
+	StopWorker();
+	camera_fanout_delete(fanout);
+	StopThread();
+	DeletePipeline(pipeline);
+	if (mjpeg)
+		camera_mjpeg_delete(mjpeg);
+	if (workers)
+		camera_workers_delete(workers);
+	free(rgb_buffer);
+	for (int i = 0; i < SLOTS; i++)
+		free(slots[i].image);
+	for (auto& orphan : orphans)
+		free(orphan.image);
 	if (camera) {
 		auto ctx = static_cast<LogContext*>(camera->context.pointer);
 		camera_close(camera);
@@ -250,6 +578,11 @@ v8::Handle<v8::Value> Camera::New(const v8::Arguments& args) {
 	v8::HandleScope scope;
 	if (args.Length() < 1)
 		return throwTypeError("argument required: device");
+	int width = args[1]->IsUndefined() ? 1024 : (int)args[1]->NumberValue();
+	int height = args[2]->IsUndefined() ? 512 : (int)args[2]->NumberValue();
+	auto reason = CheckImageSize(V4L2_PIX_FMT_RGB24, width, height);
+	if (reason != nullptr)
+		return throwTypeError(reason);
 	v8::String::Utf8Value device(args[0]->ToString());
 	auto camera = camera_open(*device);
 	if (!camera)
@@ -260,17 +593,20 @@ v8::Handle<v8::Value> Camera::New(const v8::Arguments& args) {
 	auto thisObj = args.This();
 	auto self = new Camera();
 	self->camera = camera;
+	self->pipeline = CreatePipeline();
+	self->fanout = camera_fanout_new(SinkRelease, self);
+	if (!self->fanout) {
+		delete self;
+		return throwError(strerror(errno));
+	}
 	self->Wrap(thisObj);
 	setValue(thisObj, "device", args[0]);
 	setValue(thisObj, "formats", Formats(camera));
 	setValue(thisObj, "controls", Controls(camera));
 
-	self->image_buffer = (unsigned char*)malloc(MAX_WIDTH * MAX_HEIGHT * 3);
-	if(self->image_buffer == NULL){
-		return throwError("error on malloc");
-	}
-	self->image_width = args[1]->IsUndefined() ? 1024 : (int)args[1]->NumberValue();
-	self->image_height = args[2]->IsUndefined() ? 512 : (int)args[2]->NumberValue();
+	// output buffers are allocated at the first frame, at this size
+	self->image_width = width;
+	self->image_height = height;
 
 	return scope.Close(thisObj);
 }
@@ -278,11 +614,17 @@ v8::Handle<v8::Value> Camera::New(const v8::Arguments& args) {
 v8::Handle<v8::Value> Camera::Start(const v8::Arguments& args) {
 	v8::HandleScope scope;
 	auto thisObj = args.This();
-	auto camera = node::ObjectWrap::Unwrap < Camera > (thisObj)->camera;
-	if (!camera_start(camera))
+	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
+	auto camera = self->camera;
+	// prepare() may be starting the camera on the worker
+	Paused paused(self);
+	if (!camera->streaming && !camera_start(camera))
 		return throwError(camera);
 	setUint(thisObj, "width", camera->width);
 	setUint(thisObj, "height", camera->height);
+	setUint(thisObj, "bufferCount", camera->buffer_count);
+	setString(thisObj, "memory",
+			camera->memory == CAMERA_MEMORY_USERPTR ? "userptr" : "mmap");
 	return scope.Close(thisObj);
 }
 
@@ -297,57 +639,1136 @@ void Camera::StopCB(uv_poll_t* handle, int /*status*/, int /*events*/) {
 v8::Handle<v8::Value> Camera::Stop(const v8::Arguments& args) {
 	v8::HandleScope scope;
 	auto thisObj = args.This();
-	auto camera = node::ObjectWrap::Unwrap < Camera > (thisObj)->camera;
-	if (!camera_stop(camera))
+	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
+	auto camera = self->camera;
+	if (self->group)
+		return throwGrouped();
+	self->EndStream();
+	Paused paused(self);
+	if (self->Leased())
+		return throwLeased();
+	self->StopThread();
+	bool ok = camera_stop(camera);
+	syncBuffers(thisObj, camera);
+	if (!ok)
 		return throwError(camera);
-	return Watch(args, StopCB);
+	return Watch(args, StopCB, camera->fd);
+}
+
+// prepare([jpegQuality][, callback(ok, timings)]): starts the camera if
+// needed and builds the transformer, the output buffer and, with a quality,
+// the jpeg encoder ahead of the first frame
+v8::Handle<v8::Value> Camera::Prepare(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	auto thisObj = args.This();
+	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
+	if (self->group)
+		return throwGrouped();
+	int callback = 0;
+	auto job = new Job();
+	job->kind = Job::PREPARE;
+	if (args.Length() > 0 && args[0]->IsNumber()) {
+		job->quality = (int) args[0]->NumberValue();
+		callback = 1;
+	}
+	self->Submit(job, args[callback]);
+	return scope.Close(thisObj);
 }
 
 v8::Handle<v8::Value> Camera::StartRecord(const v8::Arguments& args) {
 	v8::HandleScope scope;
 	auto thisObj = args.This();
-	auto camera = node::ObjectWrap::Unwrap < Camera > (thisObj)->camera;
+	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
 	if (args.Length() < 2)
-		throwTypeError("argument required: filename");
+		return throwTypeError("argument required: filename, bitrate");
 	v8::String::AsciiValue filename(args[0]->ToString());
 	int bitrate = args[1]->Uint32Value();
-	::StartRecord(*filename, bitrate);
+	// the recorder is used by the worker and the record sink
+	Paused paused(self);
+	std::lock_guard<std::mutex> lock(self->record_mutex);
+	// at the size and format the next frames are transformed to
+	switch (::StartRecord(self->pipeline, *filename, self->image_width,
+			self->image_height, self->image_format, bitrate)) {
+	case 0:
+		break;
+	case -1:
+		return throwError("already recording");
+	default:
+		return throwError("cannot start the recorder");
+	}
 	return scope.Close(thisObj);
 }
 
 v8::Handle<v8::Value> Camera::StopRecord(const v8::Arguments& args) {
 	v8::HandleScope scope;
 	auto thisObj = args.This();
-	auto camera = node::ObjectWrap::Unwrap < Camera > (thisObj)->camera;
-	::StopRecord();
+	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
+	Paused paused(self);
+	std::lock_guard<std::mutex> lock(self->record_mutex);
+	::StopRecord(self->pipeline);
 	return scope.Close(thisObj);
 }
 
-void Camera::CaptureCB(uv_poll_t* handle, int /*status*/, int /*events*/) {
-	auto callCallback = [](CallbackData* data) -> void {
+// what frames of the camera format are uploaded as
+static uint32_t textureFormat(uint32_t format) {
+	switch (format) {
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_NV12:
+		return format;
+	default:
+		return V4L2_PIX_FMT_RGB24;
+	}
+}
+
+// the frame as uploaded: planar and RGB frames as they are, at the driver's
+// strides, YUYV and MJPEG ones converted to packed RGB first. meta is that of
+// the frame uploaded, for MJPEG an earlier one than frame
+bool Camera::Texture(const camera_frame_t* frame, camera_image_t* texture,
+		camera_frame_meta_t* meta) {
+	*meta = frame->meta;
+	switch (camera->format) {
+	case V4L2_PIX_FMT_YUYV: {
+		camera_image_t yuyv;
+		if (camera_image_frame(camera, frame, &yuyv) == 0)
+			return false;
+		if (rgb_capacity != (size_t) camera->width * camera->height * 3) {
+			size_t size = (size_t) camera->width * camera->height * 3;
+			auto rgb = (unsigned char*) realloc(rgb_buffer, size);
+			if (rgb == nullptr)
+				return false;
+			std::lock_guard<std::mutex> lock(jobs_mutex);
+			rgb_buffer = rgb;
+			rgb_capacity = size;
+		}
+		WarmConverter();
+		camera_image_init(texture, rgb_buffer, V4L2_PIX_FMT_RGB24,
+				camera->width, camera->height, 0, 0);
+		// on this thread alone when the pool could not be built
+		if (workers)
+			camera_yuyv2rgb_parallel(workers, yuyv.plane[0], yuyv.stride[0],
+					texture->plane[0], texture->stride[0], camera->width,
+					camera->height);
+		else
+			camera_yuyv2rgb(yuyv.plane[0], yuyv.stride[0], texture->plane[0],
+					texture->stride[0], camera->width, camera->height);
+		break;
+	}
+	case V4L2_PIX_FMT_MJPEG: {
+		WarmConverter();
+		if (mjpeg == nullptr)
+			return false;
+		// keep one frame per decoding thread in flight
+		camera_mjpeg_submit(mjpeg, frame->start, frame->length, &frame->meta);
+		bool wait = camera_mjpeg_pending(mjpeg) > camera_mjpeg_threads(mjpeg);
+		camera_mjpeg_frame_t decoded;
+		bool found = false;
+		while (!found && camera_mjpeg_collect(mjpeg, &decoded, wait)) {
+			found = decoded.ok && decoded.width == camera->width
+					&& decoded.height == camera->height;
+			wait = false;
+		}
+		if (!found)
+			return false;
+		camera_image_init(texture, decoded.rgb, V4L2_PIX_FMT_RGB24,
+				camera->width, camera->height, 0, 0);
+		// decoded frames come back a few submissions late
+		*meta = decoded.meta;
+		break;
+	}
+	default:
+		// planar frames are converted on the GPU
+		if (camera_image_frame(camera, frame, texture) == 0)
+			return false;
+	}
+	texture->timestamp_us = meta->timestamp_us;
+	return true;
+}
+
+v8::Handle<v8::Value> Camera::Capture(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	if (args.Length() < 1 || !args[0]->IsFunction())
+		return throwTypeError("argument required: callback");
+	auto self = node::ObjectWrap::Unwrap<Camera>(args.This());
+	if (!self->on_frame.IsEmpty())
+		return throwError("streaming: frames go to the onFrame callback");
+	if (self->group)
+		return throwGrouped();
+	auto job = new Job();
+	job->kind = Job::CAPTURE;
+	self->Submit(job, args[0]);
+	return v8::Undefined();
+}
+
+bool Camera::Acquire(camera_frame_t* frame) {
+	if (capture_thread)
+		return camera_thread_pop(capture_thread, frame,
+				camera_latest_only(camera));
+	return camera_frame_acquire(camera, frame);
+}
+void Camera::Release(camera_frame_t* frame) {
+	if (capture_thread)
+		camera_thread_release(capture_thread, frame);
+	else
+		camera_frame_release(camera, frame);
+}
+void Camera::StopThread() {
+	if (capture_thread) {
+		camera_thread_delete(capture_thread);
+		capture_thread = nullptr;
+	}
+}
+
+void Camera::StartWorker() {
+	if (worker.joinable())
+		return;
+	wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	done_async = new uv_async_t;
+	done_async->data = this;
+	uv_async_init(uv_default_loop(), done_async, DoneCB);
+	uv_unref(reinterpret_cast<uv_handle_t*>(done_async));
+	worker = std::thread(&Camera::WorkerMain, this);
+}
+
+// pending jobs and the stream keep the loop and this object alive, as a
+// watch does
+void Camera::Hold() {
+	if (jobs_pending++ == 0)
+		uv_ref(reinterpret_cast<uv_handle_t*>(done_async));
+	Ref();
+}
+void Camera::Unhold() {
+	if (--jobs_pending == 0)
+		uv_unref(reinterpret_cast<uv_handle_t*>(done_async));
+	Unref();
+}
+
+void Camera::Submit(Job* job, v8::Local<v8::Value> callback) {
+	StartWorker();
+	if (callback->IsFunction())
+		job->callback = v8::Persistent<v8::Function>::New(
+				callback.As<v8::Function>());
+	Hold();
+	std::lock_guard<std::mutex> lock(jobs_mutex);
+	jobs.push_back(job);
+	// jobs go before the next frame of the stream
+	if (streaming)
+		eventfd_write(wake_fd, 1);
+	jobs_cond.notify_all();
+}
+
+// keeps the worker off the camera and the transformer until Resume(): waits
+// for the frame in progress only. a capture waiting for a frame is cancelled
+// and called back with false; the stream waits. jobs on the last image go on
+void Camera::Pause() {
+	if (!worker.joinable())
+		return;
+	std::unique_lock<std::mutex> lock(jobs_mutex);
+	pauses++;
+	eventfd_write(wake_fd, 1);
+	jobs_cond.notify_all();
+	jobs_cond.wait(lock, [this] {return !worker_frame;});
+	Reclaim();
+}
+void Camera::Resume() {
+	if (!worker.joinable())
+		return;
+	std::lock_guard<std::mutex> lock(jobs_mutex);
+	pauses--;
+	jobs_cond.notify_all();
+}
+
+void Camera::StopWorker() {
+	if (!worker.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(jobs_mutex);
+		worker_quit = true;
+		eventfd_write(wake_fd, 1);
+		jobs_cond.notify_all();
+	}
+	worker.join();
+	close(wake_fd);
+	uv_close(reinterpret_cast<uv_handle_t*>(done_async),
+			[](uv_handle_t* handle) -> void {
+				delete reinterpret_cast<uv_async_t*>(handle);});
+}
+
+static size_t imageSize(uint32_t format, int width, int height) {
+	return format == V4L2_PIX_FMT_YUV420 ?
+			(size_t) width * height * 3 / 2 : (size_t) width * height * 3;
+}
+
+// under jobs_mutex: something the worker can do now
+bool Camera::Ready() {
+	if (worker_quit || !sinks_stopped.empty() || trim_slots)
+		return true;
+	for (int i = 0; i < SLOTS; i++) {
+		if (slots[i].state == Slot::RETURNED && slots[i].raw_views == 0)
+			return true;
+	}
+	bool slot = FreeSlot() >= 0;
+	if (!jobs.empty())
+		return jobs.front()->kind != Job::CAPTURE || slot || pauses > 0;
+	return streaming && pauses == 0 && slot;
+}
+
+void Camera::WorkerMain() {
+	std::unique_lock<std::mutex> lock(jobs_mutex);
+	for (;;) {
+		jobs_cond.wait(lock, [this] {return Ready();});
+		Reclaim();
+		if (!sinks_stopped.empty()) {
+			JoinSinks(lock);
+			continue;
+		}
+		if (worker_quit && jobs.empty()) {
+			// the GL contexts are current here, not on the loop
+			lock.unlock();
+			ReleaseTransformers(pipeline);
+			return;
+		}
+		int slot = FreeSlot();
+		bool cancelled = pauses > 0 || worker_quit;
+		if (!jobs.empty()) {
+			if (jobs.front()->kind == Job::CAPTURE && !cancelled && slot < 0)
+				continue;
+		} else if (!streaming || pauses > 0 || slot < 0) {
+			continue;
+		}
+		// written before this point, a wakeup is already being served
+		eventfd_t drain;
+		eventfd_read(wake_fd, &drain);
+		worker_frame = jobs.empty() || (!cancelled
+				&& (jobs.front()->kind == Job::CAPTURE
+						|| jobs.front()->kind == Job::PREPARE));
+		if (!jobs.empty()) {
+			auto job = jobs.front();
+			jobs.pop_front();
+			lock.unlock();
+			RunJob(job, cancelled, slot);
+			lock.lock();
+			// past LEASES a capture comes back without views
+			if (job->kind == Job::CAPTURE && job->ok && frame_views
+					&& Holding() < LEASES) {
+				slots[slot].state = Slot::HELD;
+				slots[slot].lease = ++leases;
+				job->slot = slot;
+			} else if (job->kind == Job::CAPTURE && job->ok && frame_views) {
+				Return(slot);
+			}
+			done.push_back(job);
+			uv_async_send(done_async);
+		} else {
+			lock.unlock();
+			camera_frame_t frame;
+			Wait wait = WaitFrame(&frame);
+			bool transformed = wait == FRAME && TransformFrame(&frame, slot);
+			double now = monotonicNow();
+			lock.lock();
+			// JS holding all its leases: the frame is only for the sinks
+			int held = Holding() - (stream_frame && stream_slot >= 0);
+			if (transformed && frame_views && held >= LEASES) {
+				stream_dropped++;
+				Return(slot);
+			} else if (transformed) {
+				// the loop sees the latest frame when it falls behind
+				if (stream_frame) {
+					stream_coalesced++;
+					if (stream_slot >= 0)
+						Return(stream_slot);
+				}
+				stream_slot = -1;
+				if (frame_views) {
+					slots[slot].state = Slot::HELD;
+					slots[slot].lease = ++leases;
+					stream_slot = slot;
+				}
+				stream_frame = true;
+				stream_meta = slots[slot].meta;
+				stream_transformed = now;
+				uv_async_send(done_async);
+			} else if (wait == FAILED && streaming) {
+				streaming = false;
+				stream_failed = true;
+				uv_async_send(done_async);
+			}
+		}
+		worker_frame = false;
+		jobs_cond.notify_all();
+	}
+}
+
+Camera::Wait Camera::WaitFrame(camera_frame_t* frame) {
+	for (;;) {
+		int fd = capture_thread ?
+				camera_thread_fd(capture_thread) : camera->fd;
+		struct pollfd fds[] = { { fd, POLLIN, 0 }, { wake_fd, POLLIN, 0 } };
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			return FAILED;
+		}
+		if (fds[1].revents)
+			return WOKEN;
+		if (Acquire(frame))
+			return FRAME;
+		// the ring may be drained by an earlier latest only pop
+		if (errno != EAGAIN)
+			return FAILED;
+	}
+}
+
+// converts and transforms a frame into a slot. the frame is released,
+// unless views of it are handed out with the slot
+bool Camera::TransformFrame(camera_frame_t* frame, int slot) {
+	camera_image_t texture;
+	camera_frame_meta_t meta;
+	bool texture_ok = Texture(frame, &texture, &meta);
+	bool ok = texture_ok;
+	if (ok) {
+		std::unique_lock<std::mutex> lock(jobs_mutex);
+		ok = SizeSlot(slot);
+	}
+	if (ok) {
+		auto transformed = &slots[slot];
+		camera_image_init(&transformed->desc, transformed->image,
+				image_format, image_width, image_height, 0, 0);
+		ok = TransformToEquirectangular(pipeline, &texture,
+				&transformed->desc) == 0;
+		transformed->meta = meta;
+	}
+	if (ok) {
+		image_slot = slot;
+	} else if (texture_ok) {
+		// the frame is dropped, the stream goes on
+		std::lock_guard<std::mutex> lock(jobs_mutex);
+		transform_failed++;
+	}
+	if (ok && frame_views)
+		slots[slot].frame = *frame;
+	else
+		Release(frame);
+	if (ok)
+		Feed(slot);
+	return ok;
+}
+
+// hands the slot to the sinks. the fan-out holds one reference for all of
+// them, dropped through SinkRelease()
+void Camera::Feed(int slot) {
+	{
+		std::lock_guard<std::mutex> lock(jobs_mutex);
+		slots[slot].refs++;
+	}
+	if (camera_fanout_push(fanout, &slots[slot]) == 0) {
+		std::lock_guard<std::mutex> lock(jobs_mutex);
+		slots[slot].refs--;
+	}
+}
+
+void Camera::SinkRelease(void* frame, void* pointer) {
+	auto self = static_cast<Camera*>(pointer);
+	std::lock_guard<std::mutex> lock(self->jobs_mutex);
+	static_cast<Slot*>(frame)->refs--;
+	self->jobs_cond.notify_all();
+}
+
+void Camera::RecordSink(void* frame, void* pointer) {
+	auto self = static_cast<SinkContext*>(pointer)->camera;
+	auto fed = static_cast<Slot*>(frame);
+	std::lock_guard<std::mutex> lock(self->record_mutex);
+	// frames come while not recording too
+	::AddFrame(self->pipeline, &fed->desc);
+}
+
+void Camera::JpegSink(void* frame, void* pointer) {
+	auto context = static_cast<SinkContext*>(pointer);
+	auto self = context->camera;
+	auto fed = static_cast<Slot*>(frame);
+	std::lock_guard<std::mutex> lock(self->jpeg_mutex);
+	::SaveJpeg(self->pipeline, &fed->desc, context->file.c_str(),
+			context->quality);
+}
+
+// nearest pixel downscale, plane by plane
+static void scaleImage(const camera_image_t* src, camera_image_t* dst) {
+	for (size_t i = 0; i < camera_image_planes(src->format); i++) {
+		uint32_t src_width, src_height, width, height, bpp;
+		camera_image_plane_size(src, i, &src_width, &src_height, &bpp);
+		camera_image_plane_size(dst, i, &width, &height, &bpp);
+		for (uint32_t y = 0; y < height; y++) {
+			auto row = src->plane[i]
+					+ (size_t) (y * src_height / height) * src->stride[i];
+			auto out = dst->plane[i] + (size_t) y * dst->stride[i];
+			for (uint32_t x = 0; x < width; x++, out += bpp)
+				memcpy(out, row + (size_t) (x * src_width / width) * bpp, bpp);
+		}
+	}
+}
+
+// scales into the thread's buffer and swaps it in as the latest preview
+void Camera::PreviewSink(void* frame, void* pointer) {
+	auto context = static_cast<SinkContext*>(pointer);
+	auto self = context->camera;
+	auto fed = static_cast<Slot*>(frame);
+	int width = context->width;
+	int height = context->height;
+	auto& scaled = context->scaled;
+	scaled.resize(imageSize(fed->desc.format, width, height));
+	camera_image_t preview;
+	camera_image_init(&preview, scaled.data(), fed->desc.format, width,
+			height, 0, 0);
+	scaleImage(&fed->desc, &preview);
+	std::lock_guard<std::mutex> lock(self->jobs_mutex);
+	if (self->preview_frame)
+		self->preview_coalesced++;
+	self->preview.swap(scaled);
+	self->preview_width = width;
+	self->preview_height = height;
+	self->preview_scaled_capacity = scaled.capacity();
+	self->preview_meta = fed->meta;
+	self->preview_frame = true;
+	uv_async_send(self->done_async);
+}
+
+void Camera::RemoveSink(int sink) {
+	if (sinks[sink] < 0)
+		return;
+	// a slow sink is not waited for here: the worker joins it
+	camera_fanout_stop(fanout, sinks[sink]);
+	{
+		std::lock_guard<std::mutex> lock(jobs_mutex);
+		sinks_stopped.push_back(std::make_pair(sinks[sink],
+				sink_contexts[sink]));
+		sink_depths[sink] = 0;
+		trim_slots = true;
+		if (sink == PREVIEW)
+			preview_frame = false;
+		jobs_cond.notify_all();
+	}
+	sinks[sink] = -1;
+	sink_contexts[sink] = nullptr;
+	if (sink != PREVIEW)
+		return;
+	on_preview.Dispose();
+	on_preview.Clear();
+	Unhold();
+}
+
+// on the worker: waits for the threads of removed sinks, off the loop
+void Camera::JoinSinks(std::unique_lock<std::mutex>& lock) {
+	std::vector<std::pair<int, SinkContext*>> stopped;
+	stopped.swap(sinks_stopped);
+	lock.unlock();
+	for (auto& sink : stopped) {
+		camera_fanout_join(fanout, sink.first);
+		delete sink.second;
+	}
+	lock.lock();
+}
+
+void Camera::RunJob(Job* job, bool cancelled, int slot) {
+	job->ok = false;
+	job->slot = -1;
+	switch (job->kind) {
+	case Job::CAPTURE: {
+		camera_frame_t frame;
+		if (cancelled || WaitFrame(&frame) != FRAME)
+			break;
+		job->ok = TransformFrame(&frame, slot);
+		job->meta = job->ok ? slots[slot].meta : frame.meta;
+		// same clock as timestamp when monotonic: capture to image latency
+		job->transformed = monotonicNow();
+		break;
+	}
+	case Job::ADD_FRAME: {
+		std::lock_guard<std::mutex> lock(record_mutex);
+		job->ok = image_slot >= 0
+				&& ::AddFrame(pipeline, &slots[image_slot].desc) == 0;
+		break;
+	}
+	case Job::TO_JPEG: {
+		if (image_slot < 0)
+			break;
+		std::lock_guard<std::mutex> lock(jpeg_mutex);
+		job->ok = ::SaveJpeg(pipeline, &slots[image_slot].desc,
+				job->filename.c_str(), job->quality) == 0;
+		break;
+	}
+	case Job::PREPARE:
+		job->camera_us = job->transformer_us = job->jpeg_us = -1;
+		job->total_us = 0;
+		job->ok = !cancelled && Warm(job, slot);
+		break;
+	}
+}
+
+// the threads or decoder the camera format needs, built at the first frame
+// unless prepared
+// only within a frame of the worker (see Pause), which setConvertThreads()
+// waits out before replacing them
+void Camera::WarmConverter() {
+	if (camera->format == V4L2_PIX_FMT_YUYV && workers == nullptr)
+		workers = camera_workers_new(0);
+	if (camera->format == V4L2_PIX_FMT_MJPEG && mjpeg == nullptr)
+		mjpeg = camera_mjpeg_new(0, 0);
+}
+
+// what the first frame and the first jpeg would otherwise set up, the slow
+// parts side by side: the camera start on one thread, the jpeg encoder on
+// another and the transformer here, where its GL context has to live
+bool Camera::Warm(Job* job, int slot) {
+	double start = monotonicNow();
+	// the geometry the camera starts with
+	camera_format_t format = { camera->format, camera->width, camera->height,
+			{ 0, 0 } };
+	if (!camera->streaming && !camera_config_get(camera, &format))
+		return false;
+	bool started = true;
+	std::thread starting;
+	if (!camera->streaming) {
+		starting = std::thread([this, job, &started] {
+			double begin = monotonicNow();
+			started = camera_start(camera);
+			if (started)
+				WarmConverter();
+			job->camera_us = monotonicNow() - begin;
+		});
+	}
+	bool encoded = true;
+	std::thread encoding;
+	if (job->quality > 0) {
+		encoding = std::thread([this, job, &encoded] {
+			double begin = monotonicNow();
+			std::lock_guard<std::mutex> lock(jpeg_mutex);
+			encoded = PrepareJpeg(pipeline, image_width, image_height,
+					job->quality) == 0;
+			job->jpeg_us = monotonicNow() - begin;
+		});
+	}
+	double begin = monotonicNow();
+	bool transformed = PrepareTransform(pipeline, format.width, format.height,
+			textureFormat(format.format), image_width, image_height) == 0;
+	if (slot >= 0) {
+		std::lock_guard<std::mutex> lock(jobs_mutex);
+		transformed = SizeSlot(slot) && transformed;
+	}
+	job->transformer_us = monotonicNow() - begin;
+	if (starting.joinable())
+		starting.join();
+	if (encoding.joinable())
+		encoding.join();
+	job->total_us = monotonicNow() - start;
+	return started && encoded && transformed;
+}
+
+// slots in use at most: the one transformed into, the leases and the sink
+// queues with the frame each sink is on
+int Camera::SlotBudget() {
+	int budget = 1 + std::max(Holding(), frame_views ? LEASES : 0);
+	for (int i = 0; i < SINKS; i++) {
+		if (sink_depths[i] > 0)
+			budget += sink_depths[i] + 1;
+	}
+	return budget;
+}
+
+// slots with JS: leased, or released with a raw view still alive. leases are
+// only granted below LEASES, so JS never holds up the worker
+int Camera::Holding() {
+	int held = 0;
+	for (int i = 0; i < SLOTS; i++) {
+		if (slots[i].state == Slot::HELD
+				|| (slots[i].state == Slot::RETURNED && slots[i].raw_views > 0))
+			held++;
+	}
+	return held;
+}
+
+// a free slot. without views the latest one is reused, so a single output
+// buffer is allocated; with views the other one, while JS reads the latest.
+// a slot without an image only while the pool is under budget: -1 then only
+// while a removed sink finishes its frame
+int Camera::FreeSlot() {
+	int found = -1;
+	for (int i = 0; i < SLOTS; i++) {
+		if (slots[i].state != Slot::FREE || slots[i].refs > 0
+				|| slots[i].capacity == 0)
+			continue;
+		found = i;
+		if ((i == image_slot) != frame_views)
+			break;
+	}
+	if (found >= 0)
+		return found;
+	int allocated = 0;
+	for (int i = 0; i < SLOTS; i++) {
+		if (slots[i].state != Slot::FREE || slots[i].capacity > 0)
+			allocated++;
+		else if (found < 0 && slots[i].refs == 0)
+			found = i;
+	}
+	return allocated < SlotBudget() ? found : -1;
+}
+
+// leased frames, and released ones whose raw view is still alive: the camera
+// buffers they view have to stay mapped
+bool Camera::Leased() {
+	for (int i = 0; i < SLOTS; i++) {
+		if (slots[i].state != Slot::FREE)
+			return true;
+	}
+	return false;
+}
+
+// sizes a free slot for the current image size and format. memory still
+// viewed by Buffers is left to them when it has to be replaced
+bool Camera::SizeSlot(int slot) {
+	auto sized = &slots[slot];
+	size_t length = imageSize(image_format, image_width, image_height);
+	sized->length = length;
+	if (sized->capacity == length
+			|| (sized->capacity > length && sized->image_views > 0))
+		return true;
+	if (sized->image_views > 0)
+		FreeImage(sized);
+	auto image = (unsigned char*) realloc(sized->image, length);
+	if (image == nullptr)
+		return false;
+	sized->image = image;
+	sized->capacity = length;
+	return true;
+}
+
+// frees the image, or leaves it to the Buffers still viewing it
+void Camera::FreeImage(Slot* slot) {
+	if (slot->image_views > 0) {
+		orphans.push_back(Orphan { slot->image, slot->capacity,
+				slot->image_views });
+		slot->image_views = 0;
+		slot->generation++;
+	} else {
+		free(slot->image);
+	}
+	slot->image = nullptr;
+	slot->capacity = 0;
+}
+
+// frees idle images past the budget, the latest image kept for the jobs
+void Camera::TrimSlots() {
+	trim_slots = false;
+	int allocated = 0;
+	for (int i = 0; i < SLOTS; i++) {
+		if (slots[i].state != Slot::FREE || slots[i].capacity > 0)
+			allocated++;
+	}
+	int budget = SlotBudget();
+	for (int i = SLOTS - 1; i >= 0 && allocated > budget; i--) {
+		auto idle = &slots[i];
+		if (idle->state != Slot::FREE || idle->refs > 0
+				|| idle->capacity == 0 || i == image_slot)
+			continue;
+		FreeImage(idle);
+		allocated--;
+	}
+}
+
+// gives the raw frames of returned slots back to the camera once no Buffer
+// views them, on the worker or while it is paused: Release() is not for two
+// threads at once. the images of a shrunk pool go with them
+void Camera::Reclaim() {
+	for (int i = 0; i < SLOTS; i++) {
+		if (slots[i].state == Slot::RETURNED && slots[i].raw_views == 0) {
+			Release(&slots[i].frame);
+			slots[i].state = Slot::FREE;
+		}
+	}
+	if (trim_slots)
+		TrimSlots();
+}
+
+void Camera::Return(int slot) {
+	slots[slot].state = Slot::RETURNED;
+	slots[slot].lease = 0;
+	jobs_cond.notify_all();
+}
+
+Slot* Camera::FindLease(uint32_t lease) {
+	for (int i = 0; i < SLOTS; i++) {
+		if (slots[i].state == Slot::HELD && slots[i].lease == lease)
+			return &slots[i];
+	}
+	return nullptr;
+}
+
+
+// adds raw and image Buffers over the slot memory and the lease to give back
+void Camera::FrameViews(v8::Local<v8::Object> meta, int slot) {
+	auto leased = &slots[slot];
+	char* data[] = { reinterpret_cast<char*>(leased->frame.start),
+			reinterpret_cast<char*>(leased->image) };
+	size_t length[] = { leased->frame.length, leased->length };
+	const char* names[] = { "raw", "image" };
+	for (int i = 0; i < 2; i++) {
+		auto hint = new ViewHint { this, leased->lease, slot, i == 1,
+				leased->generation };
+		auto buffer = node::Buffer::New(data[i], length[i], ViewFree, hint);
+		setValue(meta, names[i],
+				v8::Local<v8::Object>::New(buffer->handle_));
+		leased->views++;
+		if (hint->image)
+			leased->image_views++;
+		else
+			leased->raw_views++;
+		// the memory is this camera's
+		Ref();
+	}
+	setUint(meta, "lease", leased->lease);
+}
+
+// a view collected: the lease ends with its last view if not released yet
+void Camera::ViewFree(char* data, void* hint) {
+	auto view = static_cast<ViewHint*>(hint);
+	auto self = view->camera;
+	{
+		std::lock_guard<std::mutex> lock(self->jobs_mutex);
+		auto viewed = &self->slots[view->slot];
+		if (!view->image) {
+			// the frame goes back to the camera at the next Reclaim()
+			if (--viewed->raw_views == 0 && viewed->state == Slot::RETURNED)
+				self->jobs_cond.notify_all();
+		} else if (view->generation == viewed->generation) {
+			viewed->image_views--;
+		} else {
+			auto& orphans = self->orphans;
+			for (auto it = orphans.begin(); it != orphans.end(); ++it) {
+				if (it->image == reinterpret_cast<unsigned char*>(data)) {
+					if (--it->views == 0) {
+						free(it->image);
+						orphans.erase(it);
+					}
+					break;
+				}
+			}
+		}
+		auto leased = self->FindLease(view->lease);
+		if (leased && --leased->views == 0)
+			self->Return(leased - self->slots);
+	}
+	delete view;
+	self->Unref();
+}
+
+static v8::Local<v8::Object> frameMeta(const camera_frame_meta_t* cmeta,
+		double transformed) {
+	auto meta = convertMeta(cmeta);
+	setValue(meta, "transformed", v8::Number::New(transformed));
+	return meta;
+}
+
+// milliseconds, like the decode latencies in stats(). the camera properties
+// start() sets are set when prepare() started it
+static v8::Local<v8::Object> prepareTimings(const Job* job,
+		v8::Local<v8::Object> thisObj, camera_t* camera) {
+	if (camera->streaming) {
+		setUint(thisObj, "width", camera->width);
+		setUint(thisObj, "height", camera->height);
+		setUint(thisObj, "bufferCount", camera->buffer_count);
+		setString(thisObj, "memory",
+				camera->memory == CAMERA_MEMORY_USERPTR ? "userptr" : "mmap");
+	}
+	auto timings = v8::Object::New();
+	const char* names[] = { "camera", "transformer", "jpeg", "total" };
+	double took[] = { job->camera_us, job->transformer_us, job->jpeg_us,
+			job->total_us };
+	for (int i = 0; i < 4; i++) {
+		if (took[i] >= 0)
+			setValue(timings, names[i], v8::Number::New(took[i] / 1000.0));
+	}
+	return timings;
+}
+
+void Camera::DoneCB(uv_async_t* handle, int /*status*/) {
+	auto self = static_cast<Camera*>(handle->data);
+	std::deque<Job*> finished;
+	bool frame, failed;
+	camera_frame_meta_t meta;
+	double transformed;
+	int slot;
+	bool previewed;
+	std::vector<unsigned char> preview;
+	camera_frame_meta_t preview_meta;
+	int preview_width, preview_height;
+	{
+		std::lock_guard<std::mutex> lock(self->jobs_mutex);
+		finished.swap(self->done);
+		previewed = self->preview_frame;
+		if (previewed)
+			preview.swap(self->preview);
+		preview_meta = self->preview_meta;
+		preview_width = self->preview_width;
+		preview_height = self->preview_height;
+		self->preview_frame = false;
+		frame = self->stream_frame;
+		failed = self->stream_failed;
+		meta = self->stream_meta;
+		transformed = self->stream_transformed;
+		slot = self->stream_slot;
+		self->stream_frame = false;
+		self->stream_failed = false;
+		self->stream_slot = -1;
+	}
+	// the stream or a job keeps a reference until its last callback
+	self->Ref();
+	v8::HandleScope scope;
+	auto thisObj = v8::Local<v8::Object>::New(self->handle_);
+	for (auto job : finished) {
 		v8::HandleScope scope;
-		auto thisObj = v8::Local<v8::Object>::New(data->thisObj);
-		auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
-		auto camera = self->camera;
-		bool captured = camera_capture(camera);
+		if (!job->callback.IsEmpty()) {
+			v8::Local<v8::Value> meta = v8::Local<v8::Value>::New(v8::Null());
+			if (job->kind == Job::CAPTURE && job->ok) {
+				auto object = frameMeta(&job->meta, job->transformed);
+				if (job->slot >= 0)
+					self->FrameViews(object, job->slot);
+				meta = object;
+			} else if (job->kind == Job::PREPARE) {
+				meta = prepareTimings(job, thisObj, self->camera);
+			}
+			v8::Local<v8::Value> argv[] = {
+				v8::Local<v8::Value>::New(v8::Boolean::New(job->ok)),
+				meta,
+			};
+			job->callback->Call(thisObj,
+					job->kind == Job::CAPTURE || job->kind == Job::PREPARE ?
+							2 : 1, argv);
+			job->callback.Dispose();
+		}
+		delete job;
+		self->Unhold();
+	}
+	if (frame && !self->on_frame.IsEmpty()) {
+		auto callback = v8::Local<v8::Function>::New(self->on_frame);
+		auto object = frameMeta(&meta, transformed);
+		if (slot >= 0)
+			self->FrameViews(object, slot);
 		v8::Local<v8::Value> argv[] = {
-			v8::Local<v8::Value>::New(v8::Boolean::New(captured)),
+			v8::Local<v8::Value>::New(v8::Boolean::New(true)),
+			object,
 		};
-		TransformToEquirectangular(camera->width, camera->height, self->image_width, self->image_height, camera->head.start, self->image_buffer);
-		data->callback->Call(thisObj, 1, argv);
-	};
-	WatchCB(handle, callCallback);
+		callback->Call(thisObj, 2, argv);
+	} else if (frame && slot >= 0) {
+		std::lock_guard<std::mutex> lock(self->jobs_mutex);
+		self->Return(slot);
+	}
+	if (previewed && !self->on_preview.IsEmpty()) {
+		auto callback = v8::Local<v8::Function>::New(self->on_preview);
+		auto buffer = node::Buffer::New(
+				reinterpret_cast<const char*>(preview.data()), preview.size());
+		auto object = convertMeta(&preview_meta);
+		setInt(object, "width", preview_width);
+		setInt(object, "height", preview_height);
+		v8::Local<v8::Value> argv[] = {
+			v8::Local<v8::Object>::New(buffer->handle_),
+			object,
+		};
+		callback->Call(thisObj, 2, argv);
+	}
+	if (failed && !self->on_frame.IsEmpty()) {
+		// the device stopped: the stream ends with a last false call
+		auto callback = v8::Local<v8::Function>::New(self->on_frame);
+		self->EndStream();
+		v8::Local<v8::Value> argv[] = {
+			v8::Local<v8::Value>::New(v8::Boolean::New(false)),
+			v8::Local<v8::Value>::New(v8::Null()),
+		};
+		callback->Call(thisObj, 2, argv);
+	}
+	self->Unref();
 }
-v8::Handle<v8::Value> Camera::Capture(const v8::Arguments& args) {
-	return Watch(args, CaptureCB);
+
+v8::Handle<v8::Value> Camera::StartStreaming(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	if (args.Length() < 1 || !args[0]->IsFunction())
+		return throwTypeError("argument required: onFrame");
+	auto thisObj = args.This();
+	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
+	if (!self->on_frame.IsEmpty())
+		return throwError("already streaming");
+	if (self->group)
+		return throwGrouped();
+	self->StartWorker();
+	self->on_frame = v8::Persistent<v8::Function>::New(
+			args[0].As<v8::Function>());
+	self->Hold();
+	std::lock_guard<std::mutex> lock(self->jobs_mutex);
+	self->streaming = true;
+	self->jobs_cond.notify_all();
+	return scope.Close(thisObj);
+}
+
+v8::Handle<v8::Value> Camera::StopStreaming(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	auto thisObj = args.This();
+	node::ObjectWrap::Unwrap<Camera>(thisObj)->EndStream();
+	return scope.Close(thisObj);
+}
+
+// null on success, else the type error message
+static const char* toQueue(v8::Local<v8::Object> options, size_t* depth,
+		camera_drop_t* drop) {
+	auto fdepth = getValue(options, "depth");
+	*depth = fdepth->IsUndefined() ? 1 : fdepth->Uint32Value();
+	*drop = CAMERA_DROP_OLDEST;
+	auto fdrop = getValue(options, "drop");
+	if (!fdrop->IsUndefined()) {
+		v8::String::AsciiValue name(fdrop);
+		if (strcmp(*name, "newest") == 0)
+			*drop = CAMERA_DROP_NEWEST;
+		else if (strcmp(*name, "oldest") != 0)
+			return "drop must be \"oldest\" or \"newest\"";
+	}
+	return nullptr;
+}
+
+// setSink(name, options): feeds every transformed frame to a native sink
+// with its own queue of options.depth frames (1 or 2) and, when full,
+// options.drop "oldest" or "newest". a false options removes the sink.
+//   "record": the current recording
+//   "jpeg": options.file, rewritten at options.quality
+//   "preview": options.onPreview(buffer, meta), at options.width x height
+// a removed sink finishes its frame on its own, the worker joins it
+v8::Handle<v8::Value> Camera::SetSink(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	if (args.Length() < 2)
+		return throwTypeError("argument required: name, options");
+	auto thisObj = args.This();
+	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
+	v8::String::AsciiValue name(args[0]->ToString());
+	const char* names[] = { "record", "jpeg", "preview" };
+	int sink = 0;
+	while (sink < SINKS && strcmp(*name, names[sink]) != 0)
+		sink++;
+	if (sink == SINKS)
+		return throwTypeError("sink must be \"record\", \"jpeg\" or \"preview\"");
+	self->RemoveSink(sink);
+	if (!args[1]->IsObject())
+		return scope.Close(thisObj);
+
+	auto options = args[1]->ToObject();
+	size_t depth;
+	camera_drop_t drop;
+	auto message = toQueue(options, &depth, &drop);
+	if (message != nullptr)
+		return throwTypeError(message);
+	if (depth < 1 || depth > SINK_DEPTH_MAX)
+		return throwTypeError("depth out of range: 1 or 2");
+	std::unique_ptr<SinkContext> context(new SinkContext());
+	context->camera = self;
+	camera_fanout_func_t func = RecordSink;
+	auto callback = getValue(options, "onPreview");
+	if (sink == JPEG) {
+		auto file = getValue(options, "file");
+		if (!file->IsString())
+			return throwTypeError("option required: file");
+		v8::String::Utf8Value path(file);
+		context->file = *path;
+		context->quality = getInt(options, "quality");
+		if (context->quality <= 0)
+			context->quality = 90;
+		func = JpegSink;
+	} else if (sink == PREVIEW) {
+		if (!callback->IsFunction())
+			return throwTypeError("option required: onPreview");
+		// even, for the chroma planes of I420
+		context->width = getInt(options, "width") & ~1;
+		context->height = getInt(options, "height") & ~1;
+		if (context->width <= 0 || context->height <= 0
+				|| context->width > MAX_WIDTH || context->height > MAX_HEIGHT)
+			return throwTypeError("preview size out of range");
+		func = PreviewSink;
+	}
+	// the worker feeds the sinks and joins them once removed. the preview
+	// wakes the loop through its async handle
+	self->StartWorker();
+	self->sinks[sink] = camera_fanout_add(self->fanout, func, context.get(),
+			depth, drop);
+	if (self->sinks[sink] < 0)
+		return throwError("cannot start the sink thread");
+	self->sink_contexts[sink] = context.release();
+	{
+		std::lock_guard<std::mutex> lock(self->jobs_mutex);
+		self->sink_depths[sink] = depth;
+	}
+	if (sink == PREVIEW) {
+		self->on_preview = v8::Persistent<v8::Function>::New(
+				callback.As<v8::Function>());
+		self->Hold();
+	}
+	return scope.Close(thisObj);
+}
+
+void Camera::EndStream() {
+	if (on_frame.IsEmpty())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(jobs_mutex);
+		streaming = false;
+		// a frame transformed but not called back yet is dropped
+		if (stream_frame && stream_slot >= 0)
+			Return(stream_slot);
+		stream_frame = false;
+		stream_slot = -1;
+		eventfd_write(wake_fd, 1);
+	}
+	on_frame.Dispose();
+	on_frame.Clear();
+	Unhold();
+}
+
+// setFrameViews(on): frames come with raw and image Buffers over the native
+// memory and a lease, LEASES at most at once. past those the stream keeps its
+// frames for the sinks and a capture comes back without views
+v8::Handle<v8::Value> Camera::SetFrameViews(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	auto thisObj = args.This();
+	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
+	Paused paused(self);
+	self->frame_views = args.Length() < 1 || args[0]->BooleanValue();
+	{
+		std::lock_guard<std::mutex> lock(self->jobs_mutex);
+		self->trim_slots = true;
+		self->jobs_cond.notify_all();
+	}
+	setBool(thisObj, "frameViews", self->frame_views);
+	return scope.Close(thisObj);
+}
+
+v8::Handle<v8::Value> Camera::ReleaseFrame(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	if (args.Length() < 1)
+		return throwTypeError("argument required: frame meta or lease");
+	auto lease = args[0]->IsObject() ?
+			getUint(args[0]->ToObject(), "lease") : args[0]->Uint32Value();
+	auto self = node::ObjectWrap::Unwrap<Camera>(args.This());
+	bool released = false;
+	if (self->worker.joinable()) {
+		std::lock_guard<std::mutex> lock(self->jobs_mutex);
+		auto leased = self->FindLease(lease);
+		if (leased) {
+			self->Return(leased - self->slots);
+			released = true;
+		}
+	}
+	return scope.Close(v8::Boolean::New(released));
 }
 
 v8::Handle<v8::Value> Camera::AddFrame(const v8::Arguments& args) {
 	v8::HandleScope scope;
 	auto thisObj = args.This();
 	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
-	auto camera = self->camera;
-	::AddFrame(self->image_buffer);
+	auto job = new Job();
+	job->kind = Job::ADD_FRAME;
+	self->Submit(job, args[0]);
 	return scope.Close(thisObj);
 }
 
@@ -355,28 +1776,32 @@ v8::Handle<v8::Value> Camera::ToJpeg(const v8::Arguments& args) {
 	v8::HandleScope scope;
 	auto thisObj = args.This();
 	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
-	auto camera = self->camera;
 	if (args.Length() < 1) {
-		throwTypeError("argument required: filename");
+		return throwTypeError("argument required: filename");
 	}
 	if (args.Length() < 2) {
-		throwTypeError("argument required: quality");
+		return throwTypeError("argument required: quality");
 	}
 	v8::String::AsciiValue filename(args[0]->ToString());
-	::SaveJpeg(self->image_buffer, *filename, (int)args[1]->NumberValue());
+	auto job = new Job();
+	job->kind = Job::TO_JPEG;
+	job->filename = *filename;
+	job->quality = (int) args[1]->NumberValue();
+	self->Submit(job, args[2]);
 	return scope.Close(thisObj);
 }
 
 v8::Handle<v8::Value> Camera::SetRotation(const v8::Arguments& args) {
 	v8::HandleScope scope;
 	auto thisObj = args.This();
-	auto camera = node::ObjectWrap::Unwrap < Camera > (thisObj)->camera;
+	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
 	if (args.Length() < 3)
-		throwTypeError("argument required: rotation");
+		return throwTypeError("argument required: rotation");
 	float x_deg = args[0]->NumberValue();
 	float y_deg = args[1]->NumberValue();
 	float z_deg = args[2]->NumberValue();
-	::SetRotation(x_deg, y_deg, z_deg);
+	Paused paused(self);
+	::SetRotation(self->pipeline, x_deg, y_deg, z_deg);
 	return scope.Close(thisObj);
 }
 
@@ -386,9 +1811,53 @@ v8::Handle<v8::Value> Camera::SetImageSize(const v8::Arguments& args) {
 	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
 	auto camera = self->camera;
 	if (args.Length() < 2)
-		throwTypeError("argument required: image size");
-	self->image_width = (int)args[0]->NumberValue();
-	self->image_height = (int)args[1]->NumberValue();
+		return throwTypeError("argument required: image size");
+	int width = (int) args[0]->NumberValue();
+	int height = (int) args[1]->NumberValue();
+	if (width <= 0 || height <= 0 || width > MAX_WIDTH || height > MAX_HEIGHT)
+		return throwTypeError("image size out of range");
+	auto reason = CheckImageSize(self->image_format, width, height);
+	if (reason != nullptr)
+		return throwTypeError(reason);
+	// the output buffers follow at the next frame
+	Paused paused(self);
+	{
+		std::lock_guard<std::mutex> lock(self->record_mutex);
+		// the recorder keeps the size it was started with
+		if (IsRecording(self->pipeline) && (width != self->image_width
+				|| height != self->image_height))
+			return throwError("recording: stopRecord() before changing the image size");
+	}
+	self->image_width = width;
+	self->image_height = height;
+	return scope.Close(thisObj);
+}
+
+v8::Handle<v8::Value> Camera::SetImageFormat(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	auto thisObj = args.This();
+	if (args.Length() < 1)
+		return throwTypeError("argument required: image format");
+	v8::String::AsciiValue name(args[0]->ToString());
+	if (name.length() != 4)
+		return throwTypeError("image format must be 4 chars: \"RGB3\" or \"I420\"");
+	uint32_t format = strcmp(*name, "I420") == 0 ? V4L2_PIX_FMT_YUV420 :
+			camera_format_id(*name);
+	if (format != V4L2_PIX_FMT_RGB24 && format != V4L2_PIX_FMT_YUV420)
+		return throwTypeError("image format not supported: use \"RGB3\" or \"I420\"");
+	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
+	auto reason = CheckImageSize(format, self->image_width,
+			self->image_height);
+	if (reason != nullptr)
+		return throwTypeError(reason);
+	Paused paused(self);
+	std::lock_guard<std::mutex> lock(self->record_mutex);
+	// the recorder keeps the format it was started with
+	if (IsRecording(self->pipeline) && format != self->image_format)
+		return throwError("recording: stopRecord() before changing the image format");
+	if (::SetImageFormat(self->pipeline, format) != 0)
+		return throwTypeError("image format not supported: use \"RGB3\" or \"I420\"");
+	self->image_format = format;
 	return scope.Close(thisObj);
 }
 
@@ -403,11 +1872,9 @@ v8::Handle<v8::Value> Camera::ConfigGet(const v8::Arguments& args) {
 	return scope.Close(format);
 }
 
-v8::Handle<v8::Value> Camera::ConfigSet(const v8::Arguments& args) {
-	v8::HandleScope scope;
-	if (args.Length() < 1)
-		throwTypeError("argument required: config");
-	auto format = args[0]->ToObject();
+// null on success, else the type error message
+static const char* toFormat(v8::Local<v8::Object> format,
+		camera_format_t* cformat) {
 	uint32_t width = getUint(format, "width");
 	uint32_t height = getUint(format, "height");
 	uint32_t numerator = 0;
@@ -418,16 +1885,129 @@ v8::Handle<v8::Value> Camera::ConfigSet(const v8::Arguments& args) {
 		numerator = getUint(interval, "numerator");
 		denominator = getUint(interval, "denominator");
 	}
-	camera_format_t cformat = { 0, width, height, { numerator, denominator } };
+	uint32_t pixformat = getUint(format, "format");
+	auto fname = getValue(format, "formatName");
+	if (fname->IsString()) {
+		v8::String::AsciiValue name(fname);
+		if (name.length() != 4)
+			return "formatName must be 4 chars: e.g. \"MJPG\"";
+		pixformat = camera_format_id(*name);
+	}
+	*cformat = { pixformat, width, height, { numerator, denominator } };
+	return nullptr;
+}
+
+v8::Handle<v8::Value> Camera::ConfigSet(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	if (args.Length() < 1)
+		return throwTypeError("argument required: config");
+	camera_format_t cformat;
+	auto message = toFormat(args[0]->ToObject(), &cformat);
+	if (message != nullptr)
+		return throwTypeError(message);
 	auto thisObj = args.This();
-	auto camera = node::ObjectWrap::Unwrap < Camera > (thisObj)->camera;
-	if (!camera_config_set(camera, &cformat))
+	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
+	auto camera = self->camera;
+	if (self->group)
+		return throwGrouped();
+	Paused paused(self);
+	if (self->Leased())
+		return throwLeased();
+	self->StopThread();
+	bool ok = camera_config_set(camera, &cformat);
+	syncBuffers(thisObj, camera);
+	setValue(thisObj, "controls", Controls(camera));
+	if (!ok)
+		return throwError(camera);
+	setUint(thisObj, "width", camera->width);
+	setUint(thisObj, "height", camera->height);
+	return scope.Close(thisObj);
+}
+
+v8::Handle<v8::Value> Camera::Reconfigure(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	if (args.Length() < 1)
+		return throwTypeError("argument required: config");
+	camera_format_t cformat;
+	auto message = toFormat(args[0]->ToObject(), &cformat);
+	if (message != nullptr)
+		return throwTypeError(message);
+	auto thisObj = args.This();
+	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
+	auto camera = self->camera;
+	// the thread holds leases on the buffers being resized
+	if (self->group)
+		return throwGrouped();
+	Paused paused(self);
+	if (self->Leased())
+		return throwLeased();
+	bool threaded = self->capture_thread != nullptr;
+	self->StopThread();
+	bool ok = camera_reconfigure(camera, &cformat);
+	syncBuffers(thisObj, camera);
+	setValue(thisObj, "controls", Controls(camera));
+	// the capture thread goes on, over the new buffers
+	if (threaded && camera->streaming)
+		self->capture_thread = camera_thread_new(camera, self->thread_depth);
+	if (!ok || (threaded && camera->streaming && !self->capture_thread))
 		return throwError(camera);
 	setUint(thisObj, "width", camera->width);
 	setUint(thisObj, "height", camera->height);
 	return scope.Close(thisObj);
 }
 
+v8::Handle<v8::Value> Camera::CropGet(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	auto thisObj = args.This();
+	auto camera = node::ObjectWrap::Unwrap < Camera > (thisObj)->camera;
+	camera_rect_t bounds, crop;
+	if (!camera_crop_get(camera, &bounds, &crop))
+		return throwError(camera);
+	auto ret = v8::Object::New();
+	setValue(ret, "bounds", convertRect(&bounds));
+	setValue(ret, "crop", convertRect(&crop));
+	return scope.Close(ret);
+}
+
+v8::Handle<v8::Value> Camera::CropSet(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	if (args.Length() < 1 || !args[0]->IsObject())
+		return throwTypeError("argument required: {left, top, width, height}");
+	auto rect = args[0]->ToObject();
+	camera_rect_t crop = { getInt(rect, "left"), getInt(rect, "top"), getUint(
+			rect, "width"), getUint(rect, "height") };
+	auto thisObj = args.This();
+	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
+	auto camera = self->camera;
+	Paused paused(self);
+	camera_rect_t bounds, ignored;
+	bool ok = camera_crop_set(camera, &crop);
+	setValue(thisObj, "controls", Controls(camera));
+	if (!ok || !camera_crop_get(camera, &bounds, &ignored))
+		return throwError(camera);
+	// the transform samples the cropped area where it is on the sensor
+	::SetCrop(self->pipeline, bounds.width, bounds.height, crop.left - bounds.left,
+			crop.top - bounds.top, crop.width, crop.height);
+	setUint(thisObj, "width", camera->width);
+	setUint(thisObj, "height", camera->height);
+	return scope.Close(convertRect(&crop));
+}
+
+v8::Handle<v8::Value> Camera::ImageCircleBounds(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	auto thisObj = args.This();
+	auto camera = node::ObjectWrap::Unwrap < Camera > (thisObj)->camera;
+	camera_rect_t bounds, crop;
+	if (!camera_crop_get(camera, &bounds, &crop))
+		return throwError(camera);
+	int left, top, width, height;
+	::GetImageCircleBounds(bounds.width, bounds.height, &left, &top, &width,
+			&height);
+	camera_rect_t circles = { bounds.left + left, bounds.top + top,
+			(uint32_t) width, (uint32_t) height };
+	return scope.Close(convertRect(&circles));
+}
+
 v8::Handle<v8::Value> Camera::ControlGet(const v8::Arguments& args) {
 	v8::HandleScope scope;
 	if (args.Length() < 1)
@@ -456,6 +2036,583 @@ v8::Handle<v8::Value> Camera::ControlSet(const v8::Arguments& args) {
 	return scope.Close(thisObj);
 }
 
+// control key: the id, as a number or a string of decimal digits (object
+// keys are strings), or the name as listed in `controls`
+static bool controlId(camera_t* camera, const v8::Local<v8::Value>& key,
+		uint32_t* id) {
+	if (key->IsNumber()) {
+		double number = key->NumberValue();
+		if (number < 1 || number > std::numeric_limits<uint32_t>::max()
+				|| number != std::floor(number))
+			return false;
+		*id = (uint32_t) number;
+		return true;
+	}
+	if (!key->IsString())
+		return false;
+	v8::String::Utf8Value name(key);
+	if (name.length() == 0)
+		return false;
+	if (isdigit((unsigned char) (*name)[0])) {
+		char* end;
+		errno = 0;
+		unsigned long long number = strtoull(*name, &end, 10);
+		// else a name starting with a digit
+		if (*end == '\0') {
+			if (errno == ERANGE || number == 0
+					|| number > std::numeric_limits<uint32_t>::max())
+				return false;
+			*id = (uint32_t) number;
+			return true;
+		}
+	}
+	auto controls = camera_controls_cache(camera);
+	for (size_t i = 0; i < controls->length; i++) {
+		if (strcmp(reinterpret_cast<const char*>(controls->head[i].name),
+				*name) == 0) {
+			*id = controls->head[i].id;
+			return true;
+		}
+	}
+	return false;
+}
+
+v8::Handle<v8::Value> Camera::ControlsGet(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	auto thisObj = args.This();
+	auto camera = node::ObjectWrap::Unwrap < Camera > (thisObj)->camera;
+	std::vector<camera_control_value_t> values;
+	if (args.Length() > 0 && args[0]->IsArray()) {
+		auto keys = args[0].As<v8::Array>();
+		for (uint32_t i = 0; i < keys->Length(); i++) {
+			camera_control_value_t value = { 0, 0 };
+			if (!controlId(camera, keys->Get(i), &value.id))
+				return throwTypeError("unknown control");
+			values.push_back(value);
+		}
+	} else {
+		// every control with a readable value
+		auto controls = camera_controls_cache(camera);
+		for (size_t i = 0; i < controls->length; i++) {
+			auto control = &controls->head[i];
+			if (control->flags.write_only || control->flags.disabled
+					|| control->type == CAMERA_CTRL_BUTTON
+					|| control->type == CAMERA_CTRL_STRING)
+				continue;
+			camera_control_value_t value = { control->id, 0 };
+			values.push_back(value);
+		}
+	}
+	auto result = v8::Object::New();
+	if (!camera_controls_get(camera, values.data(), values.size())) {
+		if (args.Length() > 0 && args[0]->IsArray())
+			return throwError(camera);
+		// one failing control fails the batch: read them one by one, an
+		// Error in place of each value that cannot be read
+		for (auto& value : values) {
+			int32_t single;
+			auto key = v8::Integer::NewFromUnsigned(value.id);
+			if (camera_control_get(camera, value.id, &single))
+				result->Set(key, v8::Number::New(single));
+			else
+				result->Set(key, v8::Exception::Error(
+						v8::String::New(lastMessage(camera).c_str())));
+		}
+		return scope.Close(result);
+	}
+	for (auto& value : values) {
+		result->Set(v8::Integer::NewFromUnsigned(value.id),
+				v8::Number::New(value.value));
+	}
+	return scope.Close(result);
+}
+
+v8::Handle<v8::Value> Camera::ControlsSet(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	if (args.Length() < 1 || !args[0]->IsObject())
+		return throwTypeError("argument required: {id or name: value}");
+	auto thisObj = args.This();
+	auto camera = node::ObjectWrap::Unwrap < Camera > (thisObj)->camera;
+	auto object = args[0]->ToObject();
+	auto keys = object->GetOwnPropertyNames();
+	std::vector<camera_control_value_t> values;
+	for (uint32_t i = 0; i < keys->Length(); i++) {
+		auto key = keys->Get(i);
+		camera_control_value_t value = { 0, 0 };
+		if (!controlId(camera, key, &value.id))
+			return throwTypeError("unknown control");
+		value.value = object->Get(key)->IntegerValue();
+		values.push_back(value);
+	}
+	if (!camera_controls_set(camera, values.data(), values.size()))
+		return throwError(camera);
+	return scope.Close(thisObj);
+}
+
+v8::Handle<v8::Value> Camera::SetBufferCount(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	if (args.Length() < 1)
+		return throwTypeError("argument required: count");
+	auto thisObj = args.This();
+	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
+	auto camera = self->camera;
+	if (self->group)
+		return throwGrouped();
+	Paused paused(self);
+	if (self->Leased())
+		return throwLeased();
+	bool ok = camera_buffer_count_set(camera, args[0]->Uint32Value());
+	syncBuffers(thisObj, camera);
+	if (!ok)
+		return throwError(camera);
+	return scope.Close(thisObj);
+}
+
+v8::Handle<v8::Value> Camera::SetLatestOnly(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	auto thisObj = args.This();
+	auto camera = node::ObjectWrap::Unwrap < Camera > (thisObj)->camera;
+	camera_latest_only_set(camera, args.Length() < 1 || args[0]->BooleanValue());
+	setBool(thisObj, "latestOnly", camera_latest_only(camera));
+	return scope.Close(thisObj);
+}
+
+v8::Handle<v8::Value> Camera::StartCaptureThread(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	auto thisObj = args.This();
+	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
+	auto camera = self->camera;
+	if (self->capture_thread)
+		return throwError("capture thread already running");
+	if (self->group)
+		return throwGrouped();
+	Paused paused(self);
+	if (self->Leased())
+		return throwLeased();
+	size_t depth = args.Length() > 0 ? args[0]->Uint32Value() : 0;
+	self->capture_thread = camera_thread_new(camera, depth);
+	self->thread_depth = depth;
+	if (!self->capture_thread)
+		return throwError(camera);
+	return scope.Close(thisObj);
+}
+
+v8::Handle<v8::Value> Camera::StopCaptureThread(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	auto thisObj = args.This();
+	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
+	Paused paused(self);
+	if (self->Leased())
+		return throwLeased();
+	self->StopThread();
+	return scope.Close(thisObj);
+}
+
+v8::Handle<v8::Value> Camera::Stats(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	auto thisObj = args.This();
+	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
+	auto camera = self->camera;
+	auto stats = v8::Object::New();
+	camera_stats_t cstats;
+	camera_stats_get(camera, &cstats);
+	setUint(stats, "bufferCount", camera->buffer_count);
+	setValue(stats, "frames", v8::Number::New(cstats.frames));
+	setValue(stats, "dropped", v8::Number::New(cstats.dropped));
+	setValue(stats, "queueEmpty", v8::Number::New(cstats.queue_empty));
+	setValue(stats, "skipped", v8::Number::New(cstats.skipped));
+	setUint(stats, "outstanding", cstats.outstanding);
+	setUint(stats, "maxOutstanding", cstats.max_outstanding);
+	if (self->worker.joinable()) {
+		std::lock_guard<std::mutex> lock(self->jobs_mutex);
+		// stream frames replaced before the loop called back
+		setValue(stats, "coalesced", v8::Number::New(self->stream_coalesced));
+		// stream frames only for the sinks, JS holding all its leases
+		setValue(stats, "leaseDropped",
+				v8::Number::New(self->stream_dropped));
+		// frames the transformer failed on, logged to stderr
+		setValue(stats, "transformFailed",
+				v8::Number::New(self->transform_failed));
+		// previews replaced before the loop called back
+		setValue(stats, "previewCoalesced",
+				v8::Number::New(self->preview_coalesced));
+	}
+	auto sinks = v8::Object::New();
+	const char* sink_names[] = { "record", "jpeg", "preview" };
+	for (int i = 0; i < SINKS; i++) {
+		camera_fanout_stats_t csink;
+		if (!camera_fanout_stats(self->fanout, self->sinks[i], &csink))
+			continue;
+		auto sink = v8::Object::New();
+		setValue(sinks, sink_names[i], sink);
+		setValue(sink, "queued", v8::Number::New(csink.queued));
+		setValue(sink, "done", v8::Number::New(csink.done));
+		setValue(sink, "dropped", v8::Number::New(csink.dropped));
+		setUint(sink, "length", csink.length);
+	}
+	setValue(stats, "sinks", sinks);
+	if (self->mjpeg) {
+		camera_mjpeg_stats_t cdecode;
+		camera_mjpeg_stats(self->mjpeg, &cdecode);
+		auto decode = v8::Object::New();
+		setValue(stats, "decode", decode);
+		setValue(decode, "frames", v8::Number::New(cdecode.frames));
+		setValue(decode, "failed", v8::Number::New(cdecode.failed));
+		setValue(decode, "dropped", v8::Number::New(cdecode.dropped));
+		setValue(decode, "averageLatency", v8::Number::New(
+				cdecode.frames ?
+						cdecode.latency_total_us / 1000.0 / cdecode.frames : 0));
+		setValue(decode, "maxLatency",
+				v8::Number::New(cdecode.latency_max_us / 1000.0));
+	}
+	if (self->capture_thread) {
+		camera_thread_stats_t cthread;
+		camera_thread_stats(self->capture_thread, &cthread);
+		auto thread = v8::Object::New();
+		setValue(stats, "thread", thread);
+		setValue(thread, "frames", v8::Number::New(cthread.frames));
+		setValue(thread, "overruns", v8::Number::New(cthread.overruns));
+		setValue(thread, "skipped", v8::Number::New(cthread.skipped));
+		// the capture ended on a device failure
+		if (cthread.error != 0)
+			setString(thread, "error", strerror(cthread.error));
+	}
+	if (args.Length() > 0 && args[0]->BooleanValue())
+		camera_stats_reset(camera);
+	if (args.Length() > 0 && args[0]->BooleanValue() && self->mjpeg)
+		camera_mjpeg_stats_reset(self->mjpeg);
+	return scope.Close(stats);
+}
+
+// bytes of native memory held for this camera: what is allocated, not what
+// the current frame or image fills of it
+v8::Handle<v8::Value> Camera::MemoryUsage(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	auto self = node::ObjectWrap::Unwrap<Camera>(args.This());
+	auto camera = self->camera;
+	size_t capture = camera->head_capacity;
+	for (size_t i = 0; i < camera->buffer_count; i++)
+		capture += camera->buffers[i].length;
+	if (self->capture_thread)
+		capture += camera_thread_memory(self->capture_thread);
+	size_t images = 0;
+	size_t convert = 0;
+	size_t preview = 0;
+	{
+		std::lock_guard<std::mutex> lock(self->jobs_mutex);
+		for (int i = 0; i < SLOTS; i++)
+			images += self->slots[i].capacity;
+		for (auto& orphan : self->orphans)
+			images += orphan.capacity;
+		convert = self->rgb_capacity;
+		preview = self->preview.capacity() + self->preview_scaled_capacity;
+	}
+	if (self->mjpeg)
+		convert += camera_mjpeg_memory(self->mjpeg);
+	auto usage = v8::Object::New();
+	setValue(usage, "capture", v8::Number::New(capture));
+	setValue(usage, "images", v8::Number::New(images));
+	setValue(usage, "convert", v8::Number::New(convert));
+	setValue(usage, "preview", v8::Number::New(preview));
+	setValue(usage, "total",
+			v8::Number::New(capture + images + convert + preview));
+	return scope.Close(usage);
+}
+
+v8::Handle<v8::Value> Camera::ExportBuffers(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	auto thisObj = args.This();
+	auto camera = node::ObjectWrap::Unwrap < Camera > (thisObj)->camera;
+	if (!camera_buffers_export(camera))
+		return throwError(camera);
+	return scope.Close(syncBuffers(thisObj, camera));
+}
+
+v8::Handle<v8::Value> Camera::SetMemory(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	if (args.Length() < 1)
+		return throwTypeError("argument required: memory");
+	v8::String::AsciiValue name(args[0]->ToString());
+	camera_memory_t memory;
+	if (strcmp(*name, "mmap") == 0) {
+		memory = CAMERA_MEMORY_MMAP;
+	} else if (strcmp(*name, "userptr") == 0) {
+		memory = CAMERA_MEMORY_USERPTR;
+	} else {
+		return throwTypeError("memory must be \"mmap\" or \"userptr\"");
+	}
+	bool hugepages = args.Length() > 1 && args[1]->BooleanValue();
+	auto thisObj = args.This();
+	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
+	auto camera = self->camera;
+	if (self->group)
+		return throwGrouped();
+	Paused paused(self);
+	if (self->Leased())
+		return throwLeased();
+	bool ok = camera_memory_set(camera, memory, hugepages);
+	syncBuffers(thisObj, camera);
+	if (!ok)
+		return throwError(camera);
+	return scope.Close(thisObj);
+}
+
+v8::Handle<v8::Value> Camera::SetConvertThreads(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	if (args.Length() < 1)
+		return throwTypeError("argument required: threads");
+	auto thisObj = args.This();
+	auto self = node::ObjectWrap::Unwrap<Camera>(thisObj);
+	// 0 for one per cpu, clamped to CAMERA_WORKERS_MAX
+	size_t threads = std::min<size_t>(args[0]->Uint32Value(),
+			CAMERA_WORKERS_MAX);
+	// the worker may be converting on them
+	Paused paused(self);
+	auto workers = camera_workers_new(threads);
+	if (!workers)
+		return throwError(strerror(ENOMEM));
+	if (self->workers)
+		camera_workers_delete(self->workers);
+	self->workers = workers;
+	setUint(thisObj, "convertThreads", camera_workers_count(self->workers));
+	return scope.Close(thisObj);
+}
+
+//[camera group]
+// of Camera objects, set at module init
+static v8::Persistent<v8::FunctionTemplate> cameraClass;
+
+// cameras dequeued by one native thread blocked on a single epoll set (see
+// group.h), for capturing from several devices with comparable timestamps.
+// frames are copied out on that thread, and the latest of each device not
+// called back yet is handed to the loop
+class CameraGroup: node::ObjectWrap {
+public:
+	static void Init(v8::Handle<v8::Object> exports);
+private:
+	static v8::Handle<v8::Value> New(const v8::Arguments& args);
+	static v8::Handle<v8::Value> Add(const v8::Arguments& args);
+	static v8::Handle<v8::Value> Start(const v8::Arguments& args);
+	static v8::Handle<v8::Value> Stop(const v8::Arguments& args);
+	static v8::Handle<v8::Value> Stats(const v8::Arguments& args);
+	static void OnFrame(const camera_group_frame_t* frame, void* pointer);
+	static void FrameCB(uv_async_t* handle, int status);
+	CameraGroup();
+	~CameraGroup();
+	void StopGroup();
+	struct Pending {
+		std::vector<unsigned char> data;
+		camera_frame_meta_t meta;
+		uint64_t dequeued_us;
+		bool ready;
+	};
+	camera_group_t* group;
+	std::vector<Camera*> cameras;
+	std::vector<v8::Persistent<v8::Object> > objects; // keeps them alive
+	bool running;
+	uv_async_t* frame_async;
+	v8::Persistent<v8::Function> on_frame;
+	// per device, under mutex. spare holds the other buffers, on the loop
+	std::mutex mutex;
+	std::vector<Pending> pending;
+	std::vector<Pending> spare;
+	uint64_t coalesced;
+};
+
+CameraGroup::CameraGroup() :
+		group(nullptr), running(false), frame_async(nullptr), coalesced(0) {
+}
+CameraGroup::~CameraGroup() {
+	// a started group is referenced, so it is stopped by now
+	camera_group_delete(group);
+	if (frame_async)
+		uv_close(reinterpret_cast<uv_handle_t*>(frame_async),
+				[](uv_handle_t* handle) -> void {
+					delete reinterpret_cast<uv_async_t*>(handle);});
+	for (auto& object : objects)
+		object.Dispose();
+}
+
+v8::Handle<v8::Value> CameraGroup::New(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	auto group = camera_group_new();
+	if (!group)
+		return throwError(strerror(errno));
+	auto thisObj = args.This();
+	auto self = new CameraGroup();
+	self->group = group;
+	self->frame_async = new uv_async_t;
+	self->frame_async->data = self;
+	uv_async_init(uv_default_loop(), self->frame_async, FrameCB);
+	uv_unref(reinterpret_cast<uv_handle_t*>(self->frame_async));
+	self->Wrap(thisObj);
+	return scope.Close(thisObj);
+}
+
+// add(camera): the device index its frames are called back with
+v8::Handle<v8::Value> CameraGroup::Add(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	auto self = node::ObjectWrap::Unwrap<CameraGroup>(args.This());
+	if (args.Length() < 1 || !args[0]->IsObject())
+		return throwTypeError("argument required: camera");
+	auto object = args[0]->ToObject();
+	if (!cameraClass->HasInstance(object))
+		return throwTypeError("argument required: camera");
+	auto camera = node::ObjectWrap::Unwrap<Camera>(object);
+	for (auto added : self->cameras) {
+		if (added == camera)
+			return throwError("camera already in the group");
+	}
+	if (self->running)
+		return throwError("group started: stop() before adding");
+	int device = camera_group_add(self->group, camera->camera);
+	if (device < 0)
+		return throwError("group full");
+	self->cameras.push_back(camera);
+	self->objects.push_back(v8::Persistent<v8::Object>::New(object));
+	return scope.Close(v8::Integer::New(device));
+}
+
+// start(onFrame(device, data, meta)): starts the cameras not started yet.
+// they must not be streaming, capturing or running their capture thread,
+// and refuse to until stop()
+v8::Handle<v8::Value> CameraGroup::Start(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	auto thisObj = args.This();
+	auto self = node::ObjectWrap::Unwrap<CameraGroup>(thisObj);
+	if (args.Length() < 1 || !args[0]->IsFunction())
+		return throwTypeError("argument required: onFrame");
+	if (self->running)
+		return throwError("already started");
+	if (self->cameras.empty())
+		return throwError("no camera: add() them first");
+	for (auto camera : self->cameras) {
+		if (camera->group || camera->jobs_pending > 0
+				|| camera->capture_thread)
+			return throwError("camera busy: stop its stream, captures and "
+					"capture thread first");
+	}
+	// on failure the cameras started here are stopped again
+	std::vector<Camera*> started;
+	auto undo = [&started] {
+		for (auto camera : started) {
+			Paused paused(camera);
+			camera_stop(camera->camera);
+		}
+	};
+	for (auto camera : self->cameras) {
+		Paused paused(camera);
+		if (camera->camera->streaming)
+			continue;
+		if (!camera_start(camera->camera)) {
+			auto message = lastMessage(camera->camera);
+			undo();
+			return throwError(message.c_str());
+		}
+		started.push_back(camera);
+	}
+	self->pending.assign(self->cameras.size(), Pending());
+	self->spare.assign(self->cameras.size(), Pending());
+	if (!camera_group_start(self->group, OnFrame, self)) {
+		undo();
+		return throwError("cannot start the group thread");
+	}
+	for (auto camera : self->cameras)
+		camera->group = self;
+	self->running = true;
+	self->on_frame = v8::Persistent<v8::Function>::New(
+			args[0].As<v8::Function>());
+	uv_ref(reinterpret_cast<uv_handle_t*>(self->frame_async));
+	self->Ref();
+	return scope.Close(thisObj);
+}
+
+void CameraGroup::StopGroup() {
+	if (!running)
+		return;
+	camera_group_stop(group);
+	for (auto camera : cameras)
+		camera->group = nullptr;
+	running = false;
+	on_frame.Dispose();
+	on_frame.Clear();
+	uv_unref(reinterpret_cast<uv_handle_t*>(frame_async));
+	Unref();
+}
+
+v8::Handle<v8::Value> CameraGroup::Stop(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	auto thisObj = args.This();
+	node::ObjectWrap::Unwrap<CameraGroup>(thisObj)->StopGroup();
+	return scope.Close(thisObj);
+}
+
+v8::Handle<v8::Value> CameraGroup::Stats(const v8::Arguments& args) {
+	v8::HandleScope scope;
+	auto self = node::ObjectWrap::Unwrap<CameraGroup>(args.This());
+	camera_group_stats_t cstats;
+	camera_group_stats(self->group, &cstats);
+	auto stats = v8::Object::New();
+	setValue(stats, "wakeups", v8::Number::New(cstats.wakeups));
+	setValue(stats, "frames", v8::Number::New(cstats.frames));
+	std::lock_guard<std::mutex> lock(self->mutex);
+	// frames replaced before the loop called back
+	setValue(stats, "coalesced", v8::Number::New(self->coalesced));
+	return scope.Close(stats);
+}
+
+// on the group thread, which gives the frame back to the driver on return
+void CameraGroup::OnFrame(const camera_group_frame_t* frame, void* pointer) {
+	auto self = static_cast<CameraGroup*>(pointer);
+	{
+		std::lock_guard<std::mutex> lock(self->mutex);
+		auto& pending = self->pending[frame->device];
+		if (pending.ready)
+			self->coalesced++;
+		pending.data.assign(frame->frame.start,
+				frame->frame.start + frame->frame.length);
+		pending.meta = frame->frame.meta;
+		pending.dequeued_us = frame->timestamp_us;
+		pending.ready = true;
+	}
+	uv_async_send(self->frame_async);
+}
+
+void CameraGroup::FrameCB(uv_async_t* handle, int /*status*/) {
+	auto self = static_cast<CameraGroup*>(handle->data);
+	auto& taken = self->spare;
+	{
+		std::lock_guard<std::mutex> lock(self->mutex);
+		for (size_t i = 0; i < taken.size(); i++) {
+			taken[i].ready = false;
+			if (self->pending[i].ready)
+				std::swap(taken[i], self->pending[i]);
+		}
+	}
+	v8::HandleScope scope;
+	auto thisObj = v8::Local<v8::Object>::New(self->handle_);
+	for (size_t i = 0; i < taken.size(); i++) {
+		// stopped by an earlier callback
+		if (self->on_frame.IsEmpty())
+			break;
+		if (!taken[i].ready)
+			continue;
+		v8::HandleScope scope;
+		auto buffer = node::Buffer::New(
+				reinterpret_cast<char*>(taken[i].data.data()),
+				taken[i].data.size());
+		auto meta = convertMeta(&taken[i].meta);
+		setValue(meta, "dequeued", v8::Number::New(taken[i].dequeued_us));
+		v8::Local<v8::Value> argv[] = {
+			v8::Local<v8::Value>::New(v8::Integer::New((int) i)),
+			v8::Local<v8::Value>::New(buffer->handle_),
+			meta,
+		};
+		auto callback = v8::Local<v8::Function>::New(self->on_frame);
+		callback->Call(thisObj, 3, argv);
+	}
+}
+
 //[module init]
 static inline void setMethod(const v8::Local<v8::ObjectTemplate>& proto,
 		const char* name,
@@ -468,23 +2625,65 @@ void Camera::Init(v8::Handle<v8::Object> exports) {
 	auto name = v8::String::NewSymbol("Camera");
 	auto clazz = v8::FunctionTemplate::New(New);
 	clazz->SetClassName(name);
+	cameraClass = v8::Persistent<v8::FunctionTemplate>::New(clazz);
 	clazz->InstanceTemplate()->SetInternalFieldCount(1);
 	auto proto = clazz->PrototypeTemplate();
 	setMethod(proto, "start", Start);
 	setMethod(proto, "stop", Stop);
+	setMethod(proto, "prepare", Prepare);
 	setMethod(proto, "startRecord", StartRecord);
 	setMethod(proto, "stopRecord", StopRecord);
 	setMethod(proto, "addFrame", AddFrame);
 	setMethod(proto, "capture", Capture);
+	setMethod(proto, "startStreaming", StartStreaming);
+	setMethod(proto, "stopStreaming", StopStreaming);
+	setMethod(proto, "setSink", SetSink);
+	setMethod(proto, "setFrameViews", SetFrameViews);
+	setMethod(proto, "releaseFrame", ReleaseFrame);
 	setMethod(proto, "toJpeg", ToJpeg);
 	setMethod(proto, "setRotation", SetRotation);
 	setMethod(proto, "setImageSize", SetImageSize);
+	setMethod(proto, "setImageFormat", SetImageFormat);
 	setMethod(proto, "configGet", ConfigGet);
 	setMethod(proto, "configSet", ConfigSet);
+	setMethod(proto, "reconfigure", Reconfigure);
+	setMethod(proto, "cropGet", CropGet);
+	setMethod(proto, "cropSet", CropSet);
+	setMethod(proto, "imageCircleBounds", ImageCircleBounds);
 	setMethod(proto, "controlGet", ControlGet);
 	setMethod(proto, "controlSet", ControlSet);
+	setMethod(proto, "controlsGet", ControlsGet);
+	setMethod(proto, "controlsSet", ControlsSet);
+	setMethod(proto, "setBufferCount", SetBufferCount);
+	setMethod(proto, "setLatestOnly", SetLatestOnly);
+	setMethod(proto, "startCaptureThread", StartCaptureThread);
+	setMethod(proto, "stopCaptureThread", StopCaptureThread);
+	setMethod(proto, "stats", Stats);
+	setMethod(proto, "memoryUsage", MemoryUsage);
+	setMethod(proto, "exportBuffers", ExportBuffers);
+	setMethod(proto, "setMemory", SetMemory);
+	setMethod(proto, "setConvertThreads", SetConvertThreads);
 	auto ctor = v8::Local < v8::Function > ::New(clazz->GetFunction());
 	exports->Set(name, ctor);
 }
+void CameraGroup::Init(v8::Handle<v8::Object> exports) {
+	v8::HandleScope scope;
+	auto name = v8::String::NewSymbol("CameraGroup");
+	auto clazz = v8::FunctionTemplate::New(New);
+	clazz->SetClassName(name);
+	clazz->InstanceTemplate()->SetInternalFieldCount(1);
+	auto proto = clazz->PrototypeTemplate();
+	setMethod(proto, "add", Add);
+	setMethod(proto, "start", Start);
+	setMethod(proto, "stop", Stop);
+	setMethod(proto, "stats", Stats);
+	auto ctor = v8::Local < v8::Function > ::New(clazz->GetFunction());
+	exports->Set(name, ctor);
+}
+
+static void init(v8::Handle<v8::Object> exports) {
+	Camera::Init(exports);
+	CameraGroup::Init(exports);
+}
 }
-NODE_MODULE(picam360, Camera::Init)
+NODE_MODULE(picam360, init)
@@ -9,7 +9,12 @@
 #include <cstdio>
 #include <cstdlib>
 #include <ctime>
+#include <cmath>
+#include <algorithm>
 #include <chrono>
+#include <iterator>
+#include <list>
+#include <stdexcept>
 #include <thread>
 
 #define TIMEDIFF(start) (duration_cast<microseconds>(steady_clock::now() - start).count())
@@ -26,96 +31,337 @@ using namespace openblw;
 
 //pre procedure difinition
 
+//ready transformers kept per pipeline, for switching sizes back and forth
+#define TRANSFORMER_POOL_SIZE 3
+
 //structure difinition
+struct pooled_transformer {
+	int texture_width;
+	int texture_height;
+	uint32_t texture_format;
+	int equirectangular_width;
+	int equirectangular_height;
+	uint32_t image_format;
+	uint32_t stride; //of the first output plane
+	GLTransform *transformer;
+};
+
+struct picam360_pipeline {
+	//geometry of the last transform, which the encoders follow
+	int equirectangular_width;
+	int equirectangular_height;
+	uint32_t image_format;
+	uint32_t transformer_image_format;
+	float x_deg;
+	float y_deg;
+	float z_deg;
+	float crop[4];
+	//most recently used first. the front one's context is current
+	std::list<pooled_transformer> transformers;
+	//the jpeg encoder is kept until the image it encodes changes
+	OmxCvJpeg *encoder;
+	int encoder_width;
+	int encoder_height;
+	uint32_t encoder_image_format;
+	int jpeg_quality;
+	OmxCv *recorder;
+};
+
+picam360_pipeline_t *CreatePipeline() {
+	picam360_pipeline_t *pipeline = new picam360_pipeline_t();
+	pipeline->image_format = V4L2_PIX_FMT_RGB24;
+	pipeline->crop[2] = 1;
+	pipeline->crop[3] = 1;
+	return pipeline;
+}
+
+void DeletePipeline(picam360_pipeline_t *pipeline) {
+	if (pipeline == NULL)
+		return;
+	delete pipeline->recorder;
+	delete pipeline->encoder;
+	delete pipeline;
+}
+
+void ReleaseTransformers(picam360_pipeline_t *pipeline) {
+	for (auto &pooled : pipeline->transformers)
+		delete pooled.transformer;
+	pipeline->transformers.clear();
+	//each transformer releases its own context, this covers a failed build
+	EGLDisplay display = eglGetCurrentDisplay();
+	if (display != EGL_NO_DISPLAY)
+		eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+				EGL_NO_CONTEXT);
+	eglReleaseThread();
+}
 
-//global variables
-static int TEXURE_WIDTH = 0;
-static int TEXURE_HEIGHT = 0;
-static int EQUIRECTANGULAR_WIDTH = 0;
-static int EQUIRECTANGULAR_HEIGHT = 0;
-static int X_DEG = 0;
-static int Y_DEG = 0;
-static int Z_DEG = 0;
-static int JPEG_QUALITY = 90;
-
-static OmxCvJpeg *encoder = NULL;
-static GLTransform *transformer = NULL;
-static OmxCv *recorder = NULL;
-
-int TransformToEquirectangular(int texture_width, int texture_height,
+static bool same_output(const pooled_transformer &pooled, int width,
+		int height, uint32_t format, uint32_t stride) {
+	return pooled.equirectangular_width == width
+			&& pooled.equirectangular_height == height
+			&& pooled.image_format == format && pooled.stride == stride;
+}
+
+/**
+ * The transformer for this geometry, moved to the front of the pool and with
+ * its context current. A miss on a full pool recycles the least recently
+ * used one: by replacing only its input textures when the output matches,
+ * else by building a new one in its place.
+ */
+static GLTransform *get_transformer(picam360_pipeline_t *pipeline,
+		int texture_width, int texture_height, uint32_t texture_format,
 		int equirectangular_width, int equirectangular_height,
-		const unsigned char *in_data, unsigned char *out_data) {
-
-	if (texture_width != TEXURE_WIDTH || texture_height != TEXURE_HEIGHT
-			|| equirectangular_width != EQUIRECTANGULAR_WIDTH
-			|| equirectangular_height != EQUIRECTANGULAR_HEIGHT) {
-		TEXURE_WIDTH = texture_width;
-		TEXURE_HEIGHT = texture_height;
-		EQUIRECTANGULAR_WIDTH = equirectangular_width;
-		EQUIRECTANGULAR_HEIGHT = equirectangular_height;
-
-		if (encoder != NULL) {
-			delete encoder;
-			encoder = NULL;
+		uint32_t image_format, uint32_t stride) {
+	std::list<pooled_transformer> &pool = pipeline->transformers;
+	auto it = pool.begin();
+	for (; it != pool.end(); ++it) {
+		if (it->texture_width == texture_width
+				&& it->texture_height == texture_height
+				&& it->texture_format == texture_format
+				&& same_output(*it, equirectangular_width,
+						equirectangular_height, image_format, stride))
+			break;
+	}
+	if (it == pool.end() && pool.size() >= TRANSFORMER_POOL_SIZE) {
+		it = std::prev(pool.end());
+		if (same_output(*it, equirectangular_width, equirectangular_height,
+				image_format, stride)) {
+			it->transformer->MakeCurrent();
+			it->transformer->SetInput(texture_width, texture_height,
+					texture_format);
+		} else {
+			delete it->transformer;
+			it->transformer = NULL;
+		}
+		it->texture_width = texture_width;
+		it->texture_height = texture_height;
+		it->texture_format = texture_format;
+		it->equirectangular_width = equirectangular_width;
+		it->equirectangular_height = equirectangular_height;
+		it->image_format = image_format;
+		it->stride = stride;
+	}
+	if (it == pool.end()) {
+		pooled_transformer pooled = { texture_width, texture_height,
+				texture_format, equirectangular_width, equirectangular_height,
+				image_format, stride, NULL };
+		it = pool.insert(pool.end(), pooled);
+	}
+	if (it->transformer == NULL) {
+		//the constructor makes the new context current
+		try {
+			it->transformer = new GLTransform(equirectangular_width,
+					equirectangular_height, texture_width, texture_height,
+					texture_format, image_format, stride);
+		} catch (...) {
+			pool.erase(it);
+			throw;
 		}
-		if (transformer != NULL) {
-			delete transformer;
-			transformer = NULL;
+	} else if (it != pool.begin()) {
+		it->transformer->MakeCurrent();
+	}
+	pool.splice(pool.begin(), pool, it);
+	return pool.front().transformer;
+}
+
+//runs on the camera's worker: nothing may be thrown from here
+static int transform(picam360_pipeline_t *pipeline, const camera_image_t *in,
+		const camera_image_t *out) {
+	try {
+		GLTransform *transformer = get_transformer(pipeline, in->width,
+				in->height, in->format, out->width, out->height, out->format,
+				out->stride[0]);
+		const float *crop = pipeline->crop;
+		transformer->SetRotation(pipeline->x_deg, pipeline->y_deg,
+				pipeline->z_deg);
+		transformer->SetCrop(crop[0], crop[1], crop[2], crop[3]);
+		if (!transformer->Transform(in, out)) {
+			fprintf(stderr, "transformer: image differs from the transformer\n");
+			return -1;
 		}
+	} catch (const std::exception &e) {
+		fprintf(stderr, "transformer: %s\n", e.what());
+		return -1;
+	}
+	return 0;
+}
+
+int TransformToEquirectangular(picam360_pipeline_t *pipeline,
+		const camera_image_t *in, camera_image_t *out) {
+	if (transform(pipeline, in, out) != 0)
+		return -1;
+	out->timestamp_us = in->timestamp_us;
+	pipeline->equirectangular_width = out->width;
+	pipeline->equirectangular_height = out->height;
+	pipeline->transformer_image_format = out->format;
+	return 0;
+}
+
+int PrepareTransform(picam360_pipeline_t *pipeline, int texture_width,
+		int texture_height, uint32_t texture_format, int equirectangular_width,
+		int equirectangular_height) {
+	const char *reason = CheckImageSize(pipeline->image_format,
+			equirectangular_width, equirectangular_height);
+	if (reason != NULL) {
+		fprintf(stderr, "transformer: %s\n", reason);
+		return -1;
+	}
+	camera_image_t layout;
+	camera_image_init(&layout, NULL, pipeline->image_format,
+			equirectangular_width, equirectangular_height, 0, 0);
+	try {
+		get_transformer(pipeline, texture_width, texture_height,
+				texture_format, equirectangular_width, equirectangular_height,
+				pipeline->image_format, layout.stride[0]);
+	} catch (const std::exception &e) {
+		fprintf(stderr, "transformer: %s\n", e.what());
+		return -1;
+	}
+	return 0;
+}
 
-		transformer = new GLTransform(EQUIRECTANGULAR_WIDTH,
-				EQUIRECTANGULAR_HEIGHT, TEXURE_WIDTH, TEXURE_HEIGHT);
+int SetImageFormat(picam360_pipeline_t *pipeline, uint32_t format) {
+	if (format != V4L2_PIX_FMT_RGB24 && format != V4L2_PIX_FMT_YUV420)
+		return -1;
+	pipeline->image_format = format;
+	return 0;
+}
+
+const char *CheckImageSize(uint32_t format, int width, int height) {
+	switch (format) {
+	case V4L2_PIX_FMT_RGB24:
+		if (width % 4 || height % 4)
+			return "RGB3 images need a width and height multiple of 4";
+		return NULL;
+	case V4L2_PIX_FMT_YUV420:
+		if (width % 32 || height % 8)
+			return "I420 images need a width multiple of 32 and a height multiple of 8";
+		return NULL;
+	default:
+		return "unsupported image format";
 	}
-	transformer->SetRotation(X_DEG, Y_DEG, Z_DEG);
-	transformer->Transform(in_data, out_data);
+}
+
+int IsRecording(picam360_pipeline_t *pipeline) {
+	return pipeline->recorder != NULL;
+}
+
+int SetRotation(picam360_pipeline_t *pipeline, float x_deg, float y_deg,
+		float z_deg) {
+	pipeline->x_deg = x_deg;
+	pipeline->y_deg = y_deg;
+	pipeline->z_deg = z_deg;
+	return 0;
+}
 
+int SetCrop(picam360_pipeline_t *pipeline, int bounds_width,
+		int bounds_height, int left, int top, int width, int height) {
+	if (bounds_width <= 0 || bounds_height <= 0 || width <= 0 || height <= 0)
+		return -1;
+	pipeline->crop[0] = (float) left / bounds_width;
+	pipeline->crop[1] = (float) top / bounds_height;
+	pipeline->crop[2] = (float) width / bounds_width;
+	pipeline->crop[3] = (float) height / bounds_height;
 	return 0;
 }
 
-int SetRotation(float x_deg, float y_deg, float z_deg) {
-	X_DEG = x_deg;
-	Y_DEG = y_deg;
-	Z_DEG = z_deg;
+int GetImageCircleBounds(int bounds_width, int bounds_height, int *left,
+		int *top, int *width, int *height) {
+	float bounds[4];
+	GLTransform::GetImageCircleBounds(bounds);
+	//outwards to even pixels, for the chroma planes
+	int x0 = (int) floor(bounds[0] * bounds_width) & ~1;
+	int y0 = (int) floor(bounds[1] * bounds_height) & ~1;
+	int x1 = std::min(((int) ceil((bounds[0] + bounds[2]) * bounds_width) + 1)
+			& ~1, bounds_width);
+	int y1 = std::min(((int) ceil((bounds[1] + bounds[3]) * bounds_height) + 1)
+			& ~1, bounds_height);
+	*left = x0;
+	*top = y0;
+	*width = x1 - x0;
+	*height = y1 - y0;
+	return 0;
 }
 
-int StartRecord(const char *filename, int bitrate_kbps) {
-	recorder = new OmxCv(filename, EQUIRECTANGULAR_WIDTH,
-			EQUIRECTANGULAR_HEIGHT, bitrate_kbps);
+int StartRecord(picam360_pipeline_t *pipeline, const char *filename,
+		int width, int height, uint32_t format, int bitrate_kbps) {
+	if (pipeline->recorder != NULL)
+		return -1;
+	try {
+		pipeline->recorder = new OmxCv(filename, width, height, bitrate_kbps,
+				25, 1, format);
+	} catch (const std::exception &e) {
+		fprintf(stderr, "recorder: %s\n", e.what());
+		return -2;
+	}
 	return 0;
 }
 
-int StopRecord() {
-	if (recorder == NULL)
+int StopRecord(picam360_pipeline_t *pipeline) {
+	if (pipeline->recorder == NULL)
 		return -1;
-	delete recorder;
-	recorder = NULL;
+	delete pipeline->recorder;
+	pipeline->recorder = NULL;
 	return 0;
 }
 
-int AddFrame( const unsigned char *in_data) {
-	if (recorder == NULL)
+int AddFrame(picam360_pipeline_t *pipeline, const camera_image_t *image) {
+	if (pipeline->recorder == NULL)
 		return -1;
 
-	recorder->Encode(in_data);
+	return pipeline->recorder->Encode(image) ? 0 : -1;
 }
 
-int SaveJpeg(const unsigned char *in_data, const char *out_filename, int quality) {
-	if(JPEG_QUALITY != quality) {
-		JPEG_QUALITY = quality;
-		if (encoder != NULL) {
-			delete encoder;
-			encoder = NULL;
+//touches the encoder fields only, so it can run beside a transform
+static void ensure_encoder(picam360_pipeline_t *pipeline, int width,
+		int height, uint32_t format, int quality) {
+	if (pipeline->jpeg_quality != quality || pipeline->encoder_width != width
+			|| pipeline->encoder_height != height
+			|| pipeline->encoder_image_format != format) {
+		pipeline->jpeg_quality = quality;
+		pipeline->encoder_width = width;
+		pipeline->encoder_height = height;
+		pipeline->encoder_image_format = format;
+		if (pipeline->encoder != NULL) {
+			delete pipeline->encoder;
+			pipeline->encoder = NULL;
 		}
 	}
-	if (encoder == NULL) {
-		encoder = new OmxCvJpeg(EQUIRECTANGULAR_WIDTH, EQUIRECTANGULAR_HEIGHT, JPEG_QUALITY);
+	if (pipeline->encoder == NULL) {
+		pipeline->encoder = new OmxCvJpeg(pipeline->encoder_width,
+				pipeline->encoder_height, pipeline->jpeg_quality,
+				pipeline->encoder_image_format);
 	}
-	if (out_filename != NULL) {
-		if (encoder->Encode(out_filename, in_data)) {
-		} else {
-			perror("error on jpeg encode");
-			return -1;
+}
+
+int PrepareJpeg(picam360_pipeline_t *pipeline, int width, int height,
+		int quality) {
+	try {
+		ensure_encoder(pipeline, width, height, pipeline->image_format,
+				quality);
+	} catch (const std::exception &e) {
+		fprintf(stderr, "jpeg encoder: %s\n", e.what());
+		return -1;
+	}
+	return 0;
+}
+
+int SaveJpeg(picam360_pipeline_t *pipeline, const camera_image_t *image,
+		const char *out_filename, int quality) {
+	//also called from the jpeg sink's thread
+	try {
+		ensure_encoder(pipeline, image->width, image->height, image->format,
+				quality);
+		if (out_filename != NULL) {
+			if (pipeline->encoder->Encode(out_filename, image)) {
+			} else {
+				perror("error on jpeg encode");
+				return -1;
+			}
 		}
+	} catch (const std::exception &e) {
+		fprintf(stderr, "jpeg encoder: %s\n", e.what());
+		return -1;
 	}
 
 	return 0;
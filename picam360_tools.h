@@ -1,19 +1,75 @@
 #ifndef PICAM360_TOOLS_H
 #define PICAM360_TOOLS_H
 
+#include <stdint.h>
+#include "capture.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-int TransformToEquirectangular(int texture_width, int texture_height,
-		int equirectangular_width, int equirectangular_height,
-		const unsigned char *in_data, unsigned char *out_data);
-int StartRecord(const char *filename, int bitrate_kbps);
-int StopRecord();
-int AddFrame(const unsigned char *in_data);
-int SaveJpeg(const unsigned char *in_data, const char *out_filename, int quality);
-int SetRotation(float x_deg, float y_deg, float z_deg);
+/* transformers, encoders and their settings for one camera. calls on a
+ * pipeline come from one thread at a time: the GL contexts of its
+ * transformers are current on the thread that created them. up to three
+ * transformers stay ready, keyed by texture and output geometry, so
+ * switching between recent sizes rebuilds no GL state */
+typedef struct picam360_pipeline picam360_pipeline_t;
+
+picam360_pipeline_t *CreatePipeline();
+/* the transformers have to be released before, on their thread */
+void DeletePipeline(picam360_pipeline_t *pipeline);
+/* deletes the transformers on the thread that transforms, leaving no GL
+ * context current on it, before that thread exits. the next transform
+ * builds them again */
+void ReleaseTransformers(picam360_pipeline_t *pipeline);
+
+/* images are described with their strides. formats are V4L2 fourccs.
+ * texture: RGB3, YU12 or NV12. image (equirectangular output and encoder
+ * input): RGB3 or YU12. out gives the size, format and layout to render at,
+ * and gets the timestamp of in. -1, with the reason on stderr, when the
+ * transformer could not be built or rendering failed */
+int TransformToEquirectangular(picam360_pipeline_t *pipeline,
+		const camera_image_t *in, camera_image_t *out);
+/* build ahead what the first transform and the first jpeg at this geometry
+ * and the current image format need. the two only share read-only settings,
+ * so they may run on two threads at once; the transform one on the thread
+ * that transforms. -1 when building failed */
+int PrepareTransform(picam360_pipeline_t *pipeline, int texture_width,
+		int texture_height, uint32_t texture_format, int equirectangular_width,
+		int equirectangular_height);
+int PrepareJpeg(picam360_pipeline_t *pipeline, int width, int height,
+		int quality);
+int SetImageFormat(picam360_pipeline_t *pipeline, uint32_t format);
+/* whether the transformer can render images of this format and size, the
+ * planes being packed into textures that are multiples of 4 texels: RGB3
+ * needs multiples of 4, I420 (4 chroma samples a texel) a width multiple of
+ * 32 and a height multiple of 8. NULL when it can, else the reason */
+const char *CheckImageSize(uint32_t format, int width, int height);
+/* 1 while recording: the recorder's size and format are fixed until
+ * StopRecord */
+int IsRecording(picam360_pipeline_t *pipeline);
+/* a recorder of images at this size and format (RGB3 or YU12). -1 when
+ * already recording, -2 when the encoder could not be built, the reason on
+ * stderr */
+int StartRecord(picam360_pipeline_t *pipeline, const char *filename,
+		int width, int height, uint32_t format, int bitrate_kbps);
+int StopRecord(picam360_pipeline_t *pipeline);
+/* image->timestamp_us: capture time used for the PTS, negative for the time
+ * of the call. the image must be at the recording size and format */
+int AddFrame(picam360_pipeline_t *pipeline, const camera_image_t *image);
+/* any image, not necessarily the last transformed, so that it can be
+ * encoded beside a transform */
+int SaveJpeg(picam360_pipeline_t *pipeline, const camera_image_t *image,
+		const char *out_filename, int quality);
+int SetRotation(picam360_pipeline_t *pipeline, float x_deg, float y_deg,
+		float z_deg);
+/* sensor crop of the texture, in sensor pixels relative to the whole sensor
+ * (bounds_width x bounds_height) */
+int SetCrop(picam360_pipeline_t *pipeline, int bounds_width,
+		int bounds_height, int left, int top, int width, int height);
+/* smallest crop holding both calibrated image circles, even aligned */
+int GetImageCircleBounds(int bounds_width, int bounds_height, int *left,
+		int *top, int *width, int *height);
 
 #ifdef __cplusplus
 }
@@ -1 +1,265 @@
+// behavior tests on a file backed camera. run with --expose-gc, so that the
+// raw views of leased frames can be collected
+var assert = require("assert");
+var fs = require("fs");
+var os = require("os");
+var path = require("path");
 var picam360 = require("./");
+
+var WIDTH = 64, HEIGHT = 32, FRAMES = 4;
+var file = path.join(os.tmpdir(), "picam360-test-" + process.pid + ".yuyv");
+var frame = new Buffer(WIDTH * HEIGHT * 2);
+for (var i = 0; i < frame.length; i++)
+    frame[i] = i & 0xff;
+var frames = [];
+for (var i = 0; i < FRAMES; i++)
+    frames.push(frame);
+fs.writeFileSync(file, Buffer.concat(frames));
+
+function open(fps) {
+    var camera = picam360.Camera(
+        "file:YUYV:" + WIDTH + "x" + HEIGHT + "@" + fps + ":" + file, 256, 128);
+    camera.start();
+    return camera;
+}
+
+function collect() {
+    if (global.gc) {
+        global.gc();
+        global.gc();
+    }
+}
+
+// frames as they come until count of them, then done(metas)
+function stream(camera, count, done) {
+    var metas = [];
+    camera.startStreaming(function(ok, meta) {
+        assert.ok(ok);
+        metas.push(meta);
+        if (metas.length == count) {
+            camera.stopStreaming();
+            done(metas);
+        }
+    });
+}
+
+var tests = [];
+function test(name, body) {
+    tests.push({ name: name, body: body });
+}
+
+test("capture hands out leases up to the limit", function(done) {
+    var camera = open(0);
+    camera.setFrameViews(true);
+    var metas = [];
+    function next() {
+        camera.capture(function(ok, meta) {
+            assert.ok(ok);
+            metas.push(meta);
+            if (metas.length < 3)
+                return next();
+            assert.ok(metas[0].raw.length >= WIDTH * HEIGHT * 2);
+            assert.ok(metas[0].image.length >= 256 * 128 * 3);
+            assert.notEqual(metas[0].lease, metas[1].lease);
+            // past the limit, no views
+            assert.strictEqual(metas[2].lease, undefined);
+            assert.strictEqual(metas[2].raw, undefined);
+
+            assert.throws(function() { camera.stop(function() {}); });
+            assert.throws(function() { camera.setBufferCount(6); });
+            assert.strictEqual(camera.releaseFrame(metas[0]), true);
+            assert.strictEqual(camera.releaseFrame(metas[0]), false);
+            assert.strictEqual(camera.releaseFrame(metas[1].lease), true);
+            if (!global.gc)
+                return done();
+            // the camera keeps the raw frames until their views are gone
+            metas = null;
+            setImmediate(function() {
+                collect();
+                camera.stop(done);
+            });
+        });
+    }
+    next();
+});
+
+test("a stream holding every lease drops frames for JS only", function(done) {
+    var camera = open(100);
+    camera.setFrameViews(true);
+    var held = [];
+    camera.startStreaming(function(ok, meta) {
+        assert.ok(ok);
+        held.push(meta);
+        assert.ok(held.length <= 2);
+        if (held.length < 2)
+            return;
+        // no more calls: the worker keeps its frames for the sinks
+        var timer = setInterval(function() {
+            if (camera.stats().leaseDropped < 3)
+                return;
+            clearInterval(timer);
+            camera.stopStreaming();
+            held.forEach(function(meta) {
+                assert.ok(camera.releaseFrame(meta));
+            });
+            camera.setFrameViews(false);
+            stream(camera, 2, function(metas) {
+                assert.strictEqual(metas[0].lease, undefined);
+                done();
+            });
+        }, 20);
+    });
+});
+
+test("sink options are checked", function(done) {
+    var camera = open(0);
+    assert.throws(function() { camera.setSink("gif", {}); });
+    assert.throws(function() { camera.setSink("jpeg", {}); });
+    assert.throws(function() {
+        camera.setSink("jpeg", { file: "x.jpeg", depth: 3 });
+    });
+    assert.throws(function() {
+        camera.setSink("jpeg", { file: "x.jpeg", drop: "any" });
+    });
+    assert.throws(function() {
+        camera.setSink("preview", { onPreview: function() {} });
+    });
+    assert.strictEqual(camera.stats().sinks.jpeg, undefined);
+    done();
+});
+
+// every frame queued is done or dropped once the sink is idle: dropping the
+// oldest queues the frame then drops one, dropping the newest turns it away
+[ "oldest", "newest" ].forEach(function(drop) {
+    test("sink queues drop the " + drop, function(done) {
+        var camera = open(0);
+        var jpeg = file + ".jpeg";
+        var previews = 0;
+        camera.setSink("jpeg", {
+            file: jpeg,
+            quality: 50,
+            depth: 1,
+            drop: drop
+        });
+        camera.setSink("preview", {
+            depth: 2,
+            drop: drop,
+            width: 64,
+            height: 32,
+            onPreview: function(buffer, meta) {
+                assert.equal(meta.width, 64);
+                assert.equal(buffer.length, 64 * 32 * 3 / 2);
+                previews++;
+            }
+        });
+        stream(camera, 20, function() {
+            setTimeout(function() {
+                var sinks = camera.stats().sinks;
+                [ sinks.jpeg, sinks.preview ].forEach(function(sink) {
+                    assert.equal(sink.length, 0);
+                    assert.ok(sink.done > 0);
+                    if (drop == "oldest")
+                        assert.equal(sink.queued, sink.done + sink.dropped);
+                    else
+                        assert.equal(sink.queued, sink.done);
+                });
+                assert.ok(previews > 0);
+                assert.ok(fs.statSync(jpeg).size > 0);
+                fs.unlinkSync(jpeg);
+                camera.setSink("jpeg", false);
+                camera.setSink("preview", false);
+                assert.strictEqual(camera.stats().sinks.jpeg, undefined);
+                done();
+            }, 500);
+        });
+    });
+});
+
+test("reconfigure keeps the stream on a rate change", function(done) {
+    var camera = open(100);
+    stream(camera, 2, function() {
+        camera.reconfigure({ interval: { numerator: 1, denominator: 50 } });
+        assert.equal(camera.configGet().interval.denominator, 50);
+        // frames go on without a restart
+        stream(camera, 2, function() {
+            camera.reconfigure({ formatName: "YUYV", width: 32, height: 16 });
+            // the file decides the size, as a driver adjusting it would
+            assert.equal(camera.width, WIDTH);
+            assert.equal(camera.height, HEIGHT);
+            stream(camera, 2, function() {
+                done();
+            });
+        });
+    });
+});
+
+test("the buffer count changes only while stopped", function(done) {
+    var camera = open(100);
+    var count = camera.bufferCount;
+    assert.throws(function() { camera.setBufferCount(count + 2); });
+    camera.stop(function() {
+        camera.setBufferCount(count + 2);
+        camera.start();
+        assert.equal(camera.bufferCount, count + 2);
+        stream(camera, 1, function() {
+            done();
+        });
+    });
+});
+
+test("reconfigure is refused while frames are leased", function(done) {
+    var camera = open(0);
+    camera.setFrameViews(true);
+    camera.capture(function(ok, meta) {
+        assert.ok(ok);
+        assert.throws(function() {
+            camera.reconfigure({ interval: { numerator: 1, denominator: 10 } });
+        });
+        camera.releaseFrame(meta);
+        if (!global.gc)
+            return done();
+        meta = null;
+        setImmediate(function() {
+            collect();
+            camera.reconfigure({ interval: { numerator: 1, denominator: 10 } });
+            done();
+        });
+    });
+});
+
+test("memoryUsage() reports what is allocated", function(done) {
+    var camera = open(0);
+    var before = camera.memoryUsage();
+    assert.equal(before.images, 0);
+    camera.capture(function(ok) {
+        assert.ok(ok);
+        var usage = camera.memoryUsage();
+        assert.ok(usage.capture >= camera.bufferCount * WIDTH * HEIGHT * 2);
+        assert.ok(usage.images >= 256 * 128 * 3);
+        assert.ok(usage.convert >= WIDTH * HEIGHT * 3);
+        assert.equal(usage.total, usage.capture + usage.images
+                + usage.convert + usage.preview);
+        done();
+    });
+});
+
+function run(index) {
+    if (index == tests.length) {
+        fs.unlinkSync(file);
+        console.log("ok " + tests.length + " tests");
+        return;
+    }
+    var name = tests[index].name;
+    var timer = setTimeout(function() {
+        throw new Error(name + ": timed out");
+    }, 10000);
+    tests[index].body(function() {
+        clearTimeout(timer);
+        console.log("ok " + name);
+        // the camera of the test is left to the collector
+        setImmediate(function() {
+            run(index + 1);
+        });
+    });
+}
+run(0);